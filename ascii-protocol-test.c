@@ -0,0 +1,193 @@
+/*
+ * Round trip test of the frame protocol in ascii-protocol.h: grids are
+ * encoded the way ascii-video-play --protocol-out sends them, including
+ * pictures split over several datagrams, decoded the way
+ * ascii-video-client applies them, and compared cell by cell.
+ *
+ * Build and run:
+ *   gcc -o ascii-protocol-test ascii-protocol-test.c && ./ascii-protocol-test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ascii-protocol.h"
+
+static int failures;
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    rng_state = rng_state * 1664525 + 1013904223;
+    return rng_state >> 8;
+}
+
+static uint32_t random_color(void)
+{
+    switch (rng() % 3) {
+    case AVP_COLOR_INDEXED:
+        return (uint32_t)AVP_COLOR_INDEXED << 24 | (rng() & 0xFF);
+    case AVP_COLOR_RGB:
+        return (uint32_t)AVP_COLOR_RGB << 24 | (rng() & 0xFFFFFF);
+    }
+    return 0;
+}
+
+/* Random cells, with runs of repeats and code points of every UTF-8 length. */
+static void random_cells(AVPCell *cells, int n)
+{
+    static const uint32_t chars[] = { ' ', 'A', '#', 0xE9, 0x2580, 0x259F, 0x1F600 };
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (i && rng() % 4 == 0) {
+            cells[i] = cells[i - 1];
+            continue;
+        }
+        cells[i].ch = chars[rng() % (sizeof(chars) / sizeof(chars[0]))];
+        cells[i].fg = random_color();
+        cells[i].bg = random_color();
+    }
+}
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void check_grid(const AVPCell *got, const AVPCell *want, int n, const char *what)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!avp_cell_equal(&got[i], &want[i])) {
+            fprintf(stderr, "FAIL: %s: cell %d is U+%04X %08X/%08X, should be U+%04X %08X/%08X\n", what, i,
+                    got[i].ch, got[i].fg, got[i].bg, want[i].ch, want[i].fg, want[i].bg);
+            failures++;
+            return;
+        }
+    }
+}
+
+/* Parse a frame and apply it to screen, as the client does. */
+static void receive_frame(AVPCell *screen, const uint8_t *buf, size_t len, int cols, int rows,
+                          int keyframe, uint32_t seq)
+{
+    AVPHeader h;
+
+    check(!avp_read_header(buf, &h), "header parses");
+    check(h.keyframe == keyframe, "only the first frame of a picture is a keyframe");
+    check(h.seq == seq, "sequence numbers follow each other");
+    check(h.cols == cols && h.rows == rows && h.size == len - AVP_HEADER_SIZE, "header fields");
+    check(!avp_decode_cells(screen, NULL, cols * rows, buf + AVP_HEADER_SIZE, buf + len), "frame decodes");
+}
+
+/*
+ * Send a picture like proto_send() does: one frame, or over UDP frames of
+ * AVP_DATAGRAM_CELLS cells each when it is too big for a datagram.
+ * Returns the number of frames.
+ */
+static int send_picture(AVPCell *screen, const AVPCell *cur, const AVPCell *prev, int cols, int rows,
+                        int keyframe, int udp, uint32_t *seq)
+{
+    int n = cols * rows, i, frames = 0;
+    uint8_t *buf = malloc(AVP_HEADER_SIZE + (size_t)n * AVP_MAX_CELL_SIZE);
+    AVPHeader h = { 0 };
+    size_t len;
+
+    if (!buf) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    h.keyframe = keyframe;
+    h.seq = *seq;
+    h.cols = cols;
+    h.rows = rows;
+    len = avp_encode_frame(buf, &h, cur, prev, 0, n);
+    check(len <= AVP_HEADER_SIZE + (size_t)n * AVP_MAX_CELL_SIZE, "frame within its worst case size");
+
+    if (!udp || len <= AVP_MAX_DATAGRAM) {
+        receive_frame(screen, buf, len, cols, rows, keyframe, (*seq)++);
+        frames++;
+    } else {
+        for (i = 0; i < n; i += AVP_DATAGRAM_CELLS) {
+            h.keyframe = keyframe && !i;
+            h.seq = *seq;
+            len = avp_encode_frame(buf, &h, cur, prev, i, n - i < AVP_DATAGRAM_CELLS ? n - i : AVP_DATAGRAM_CELLS);
+            check(len <= AVP_MAX_DATAGRAM, "split frame fits in a datagram");
+            receive_frame(screen, buf, len, cols, rows, h.keyframe, (*seq)++);
+            frames++;
+        }
+    }
+    free(buf);
+    return frames;
+}
+
+static void test_grid(int cols, int rows, int udp, int split)
+{
+    int n = cols * rows, i, frames;
+    AVPCell *prev = calloc(n, sizeof(*prev)), *cur = calloc(n, sizeof(*cur));
+    AVPCell *screen = calloc(n, sizeof(*screen));
+    uint32_t seq = 0;
+    char what[64];
+
+    if (!prev || !cur || !screen) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    snprintf(what, sizeof(what), "%dx%d%s keyframe", cols, rows, udp ? " over UDP" : "");
+    random_cells(cur, n);
+    frames = send_picture(screen, cur, prev, cols, rows, 1, udp, &seq);
+    check_grid(screen, cur, n, what);
+    check(frames == (split ? (n + AVP_DATAGRAM_CELLS - 1) / AVP_DATAGRAM_CELLS : 1),
+          split ? "picture split into datagrams" : "picture sent as one frame");
+
+    // A delta changing scattered cells and a whole stretch
+    memcpy(prev, cur, n * sizeof(*cur));
+    for (i = 0; i < n / 10; i++)
+        cur[rng() % n].ch ^= 1;
+    random_cells(cur + n / 3, n / 3);
+    snprintf(what, sizeof(what), "%dx%d%s delta", cols, rows, udp ? " over UDP" : "");
+    send_picture(screen, cur, prev, cols, rows, 0, udp, &seq);
+    check_grid(screen, cur, n, what);
+
+    free(prev);
+    free(cur);
+    free(screen);
+}
+
+static void test_malformed(void)
+{
+    AVPCell cells[4] = { { 0 } }, cur[4];
+    AVPHeader h = { 1, 0, 4, 1, 0 };
+    uint8_t buf[AVP_HEADER_SIZE + 4 * AVP_MAX_CELL_SIZE];
+    size_t len;
+
+    random_cells(cur, 4);
+    cur[3].fg = (uint32_t)AVP_COLOR_RGB << 24 | 0x123456;
+    len = avp_encode_frame(buf, &h, cur, NULL, 0, 4);
+    check(avp_decode_cells(cells, NULL, 4, buf + AVP_HEADER_SIZE, buf + len - 1) < 0, "truncated frame is refused");
+    check(avp_decode_cells(cells, NULL, 3, buf + AVP_HEADER_SIZE, buf + len) < 0, "frame past the grid is refused");
+}
+
+int main(void)
+{
+    test_grid(80, 24, 0, 0);
+    test_grid(80, 24, 1, 0);
+    // Truecolor noise far over one datagram, like -w 400 -r quad -c truecolor
+    test_grid(400, 120, 0, 0);
+    test_grid(400, 120, 1, 1);
+    test_malformed();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("ascii-protocol: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Binary frame protocol spoken by ascii-video-play --protocol-out and
+ * ascii-video-client. Instead of terminal escapes it carries the character
+ * grid itself, so a viewer only has to apply cell updates.
+ *
+ * Every frame starts with a 16 byte header, integers are little-endian:
+ *
+ *   0  'A' 'V'     magic
+ *   2  version     AVP_VERSION
+ *   3  flags       AVP_FLAG_KEYFRAME
+ *   4  seq         u32, frame number, increases by one per frame
+ *   8  cols, rows  u16 each, grid size
+ *  12  size        u32, payload bytes that follow
+ *
+ * A keyframe describes every cell, a delta only the cells that changed
+ * since the previous frame. The payload is a list of runs until it ends:
+ *
+ *   skip   varint, unchanged cells before the run (always 0 in keyframes)
+ *   count  varint, cells in the run
+ *   cells
+ *
+ * Cells are numbered row by row. Each one starts with a byte telling
+ * which fields differ from the previous cell of the frame (which starts
+ * out as a space with default colors), followed by those fields:
+ *
+ *   AVP_CELL_CH  varint code point
+ *   AVP_CELL_FG  color
+ *   AVP_CELL_BG  color
+ *
+ * A zero byte instead repeats the previous cell, followed by a varint
+ * repeat count. Colors are a type byte, AVP_COLOR_DEFAULT alone,
+ * AVP_COLOR_INDEXED plus one palette index byte or AVP_COLOR_RGB plus
+ * three bytes R, G, B.
+ *
+ * A delta only applies on top of the frame right before it. A receiver
+ * that missed one (a gap in seq) ignores deltas until the next keyframe.
+ * Over UDP every datagram holds exactly one frame, of AVP_MAX_DATAGRAM
+ * bytes at most. A picture that doesn't fit is sent as several frames in
+ * a row, each covering a range of cells; only the first of them carries
+ * the keyframe flag, the rest are deltas skipping to their range.
+ */
+#ifndef ASCII_PROTOCOL_H
+#define ASCII_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AVP_VERSION       1
+#define AVP_HEADER_SIZE   16
+#define AVP_FLAG_KEYFRAME 1
+#define AVP_MAX_DATAGRAM  65507   // Largest UDP payload over IPv4
+
+#define AVP_CELL_CH 1
+#define AVP_CELL_FG 2
+#define AVP_CELL_BG 4
+
+#define AVP_COLOR_DEFAULT 0
+#define AVP_COLOR_INDEXED 1
+#define AVP_COLOR_RGB     2
+
+// Worst case per cell: flags, 5 byte code point, two 4 byte colors, a new run
+#define AVP_MAX_CELL_SIZE 24
+// Cells a frame may cover so that it always fits in one datagram
+#define AVP_DATAGRAM_CELLS ((AVP_MAX_DATAGRAM - AVP_HEADER_SIZE) / AVP_MAX_CELL_SIZE)
+
+/* A grid cell. Colors are 0 for the default, else type << 24 | value. */
+typedef struct AVPCell {
+    uint32_t ch;
+    uint32_t fg, bg;
+} AVPCell;
+
+typedef struct AVPHeader {
+    int keyframe;
+    uint32_t seq;
+    int cols, rows;
+    uint32_t size;
+} AVPHeader;
+
+static inline void avp_write_header(uint8_t *p, const AVPHeader *h)
+{
+    p[0] = 'A';
+    p[1] = 'V';
+    p[2] = AVP_VERSION;
+    p[3] = h->keyframe ? AVP_FLAG_KEYFRAME : 0;
+    p[4] = h->seq;       p[5] = h->seq >> 8;  p[6] = h->seq >> 16; p[7] = h->seq >> 24;
+    p[8] = h->cols;      p[9] = h->cols >> 8;
+    p[10] = h->rows;     p[11] = h->rows >> 8;
+    p[12] = h->size;     p[13] = h->size >> 8; p[14] = h->size >> 16; p[15] = h->size >> 24;
+}
+
+/* Returns 0, or -1 if this is not a frame header we understand. */
+static inline int avp_read_header(const uint8_t *p, AVPHeader *h)
+{
+    if (p[0] != 'A' || p[1] != 'V' || p[2] != AVP_VERSION)
+        return -1;
+    h->keyframe = p[3] & AVP_FLAG_KEYFRAME;
+    h->seq  = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+    h->cols = p[8] | p[9] << 8;
+    h->rows = p[10] | p[11] << 8;
+    h->size = p[12] | p[13] << 8 | p[14] << 16 | (uint32_t)p[15] << 24;
+    return 0;
+}
+
+/* LEB128: 7 bits per byte, low bits first, the top bit marks a continuation. */
+static inline uint8_t *avp_put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+/* Returns the position after the varint, NULL if it runs past end. */
+static inline const uint8_t *avp_get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    int shift;
+
+    *v = 0;
+    for (shift = 0; p < end && shift < 35; shift += 7) {
+        *v |= (uint32_t)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+static inline int avp_cell_equal(const AVPCell *a, const AVPCell *b)
+{
+    return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg;
+}
+
+static inline uint8_t *avp_put_color(uint8_t *p, uint32_t color)
+{
+    *p++ = color >> 24;
+    switch (color >> 24) {
+    case AVP_COLOR_INDEXED:
+        *p++ = color;
+        break;
+    case AVP_COLOR_RGB:
+        *p++ = color >> 16;
+        *p++ = color >> 8;
+        *p++ = color;
+        break;
+    }
+    return p;
+}
+
+/* Returns the position after the color, NULL if it is malformed. */
+static inline const uint8_t *avp_get_color(const uint8_t *p, const uint8_t *end, uint32_t *color)
+{
+    if (p >= end)
+        return NULL;
+    switch (*p++) {
+    case AVP_COLOR_DEFAULT:
+        *color = 0;
+        return p;
+    case AVP_COLOR_INDEXED:
+        if (end - p < 1)
+            return NULL;
+        *color = (uint32_t)AVP_COLOR_INDEXED << 24 | p[0];
+        return p + 1;
+    case AVP_COLOR_RGB:
+        if (end - p < 3)
+            return NULL;
+        *color = (uint32_t)AVP_COLOR_RGB << 24 | p[0] << 16 | p[1] << 8 | p[2];
+        return p + 3;
+    }
+    return NULL;
+}
+
+/*
+ * Encode cells first to first + count - 1 of the grids as one frame, the
+ * header from h with its size filled in. A keyframe describes all of
+ * them, a delta those that differ from prev. buf needs room for
+ * AVP_HEADER_SIZE + count * AVP_MAX_CELL_SIZE bytes. Returns the frame size.
+ */
+static inline size_t avp_encode_frame(uint8_t *buf, AVPHeader *h, const AVPCell *cur, const AVPCell *prev,
+                                      int first, int count)
+{
+    AVPCell last = { ' ', 0, 0 };
+    uint8_t *p = buf + AVP_HEADER_SIZE;
+    int i = first, end = first + count, offset = first, start, skip, j, r;
+
+    while (i < end) {
+        for (skip = 0; !h->keyframe && i < end && avp_cell_equal(&cur[i], &prev[i]); skip++)
+            i++;
+        if (i == end)
+            break;
+        for (start = i++; i < end && (h->keyframe || !avp_cell_equal(&cur[i], &prev[i])); i++)
+            ;
+        // The first run also skips to the start of the range
+        p = avp_put_varint(p, skip + offset);
+        p = avp_put_varint(p, i - start);
+        offset = 0;
+
+        for (j = start; j < i; j++) {
+            const AVPCell *c = &cur[j];
+            int flags;
+
+            if (avp_cell_equal(c, &last)) {
+                for (r = 1; j + r < i && avp_cell_equal(&cur[j + r], &last); r++)
+                    ;
+                *p++ = 0;
+                p = avp_put_varint(p, r);
+                j += r - 1;
+                continue;
+            }
+            flags = (c->ch != last.ch ? AVP_CELL_CH : 0) | (c->fg != last.fg ? AVP_CELL_FG : 0) |
+                    (c->bg != last.bg ? AVP_CELL_BG : 0);
+            *p++ = flags;
+            if (flags & AVP_CELL_CH)
+                p = avp_put_varint(p, c->ch);
+            if (flags & AVP_CELL_FG)
+                p = avp_put_color(p, c->fg);
+            if (flags & AVP_CELL_BG)
+                p = avp_put_color(p, c->bg);
+            last = *c;
+        }
+    }
+    h->size = p - buf - AVP_HEADER_SIZE;
+    avp_write_header(buf, h);
+    return p - buf;
+}
+
+/*
+ * Apply a frame payload to a grid of n cells, setting dirty (if not NULL)
+ * for the cells it touches. Returns -1 if it is malformed.
+ */
+static inline int avp_decode_cells(AVPCell *cells, uint8_t *dirty, uint32_t n, const uint8_t *p, const uint8_t *end)
+{
+    AVPCell last = { ' ', 0, 0 };
+    uint32_t skip, count, i = 0, r;
+
+    while (p < end) {
+        if (!(p = avp_get_varint(p, end, &skip)) || !(p = avp_get_varint(p, end, &count)) ||
+            skip > n - i || count > n - i - skip)
+            return -1;
+        i += skip;
+        while (count) {
+            int flags;
+
+            if (p >= end)
+                return -1;
+            flags = *p++;
+            if (!flags) {
+                // Repeat of the previous cell
+                if (!(p = avp_get_varint(p, end, &r)) || !r || r > count)
+                    return -1;
+            } else {
+                r = 1;
+                if (flags & AVP_CELL_CH && !(p = avp_get_varint(p, end, &last.ch)))
+                    return -1;
+                if (flags & AVP_CELL_FG && !(p = avp_get_color(p, end, &last.fg)))
+                    return -1;
+                if (flags & AVP_CELL_BG && !(p = avp_get_color(p, end, &last.bg)))
+                    return -1;
+            }
+            for (count -= r; r; r--, i++) {
+                cells[i] = last;
+                if (dirty)
+                    dirty[i] = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+#endif /* ASCII_PROTOCOL_H */
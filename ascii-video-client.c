@@ -0,0 +1,273 @@
+/*
+ * Reference viewer for the binary frame protocol of ascii-video-play
+ * --protocol-out (see ascii-protocol.h). Reads frames from a file, from
+ * stdin or from a UDP port and draws them in the terminal, redrawing only
+ * the cells a frame changed.
+ *
+ *   ascii-video-play --protocol-out=udp://viewer:9000 video.mp4
+ *   ascii-video-client udp://:9000
+ *
+ *   ascii-video-play --protocol-out=- video.mp4 | ascii-video-client -
+ */
+#define _XOPEN_SOURCE 600
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "ascii-protocol.h"
+
+#define MAX_GRID_SIZE 1024            // Per dimension
+#define MAX_FRAME_SIZE (16 << 20)
+
+typedef struct Screen {
+    int cols, rows;
+    AVPCell *cells;
+    uint8_t *dirty;       // Cells to redraw
+    int synced;           // A keyframe has been applied and no frame was lost since
+    uint32_t next_seq;
+    char *out;            // Terminal output of one frame
+    size_t out_len, out_size;
+    unsigned frames, lost;
+} Screen;
+
+static void out_write(Screen *s, const char *data, size_t len)
+{
+    if (s->out_len + len > s->out_size) {
+        size_t size = s->out_size * 2 + len + 4096;
+        char *out = realloc(s->out, size);
+        if (!out)
+            return;
+        s->out = out;
+        s->out_size = size;
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+}
+
+static void out_printf(Screen *s, const char *fmt, ...)
+{
+    char buf[64];
+    va_list vl;
+    int len;
+
+    va_start(vl, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, vl);
+    va_end(vl);
+    if (len > 0)
+        out_write(s, buf, len < (int)sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
+
+static void out_color(Screen *s, uint32_t color, int bg)
+{
+    switch (color >> 24) {
+    case AVP_COLOR_INDEXED:
+        out_printf(s, ";%d;5;%u", bg ? 48 : 38, color & 0xFF);
+        break;
+    case AVP_COLOR_RGB:
+        out_printf(s, ";%d;2;%u;%u;%u", bg ? 48 : 38, color >> 16 & 0xFF, color >> 8 & 0xFF, color & 0xFF);
+        break;
+    default:
+        out_printf(s, ";%d", bg ? 49 : 39);
+    }
+}
+
+static void out_utf8(Screen *s, uint32_t c)
+{
+    char b[4];
+
+    if (c < 0x20 || c > 0x10FFFF)
+        c = '?';
+    if (c < 0x80) {
+        b[0] = c;
+        out_write(s, b, 1);
+    } else if (c < 0x800) {
+        b[0] = 0xC0 | c >> 6;
+        b[1] = 0x80 | (c & 0x3F);
+        out_write(s, b, 2);
+    } else if (c < 0x10000) {
+        b[0] = 0xE0 | c >> 12;
+        b[1] = 0x80 | (c >> 6 & 0x3F);
+        b[2] = 0x80 | (c & 0x3F);
+        out_write(s, b, 3);
+    } else {
+        b[0] = 0xF0 | c >> 18;
+        b[1] = 0x80 | (c >> 12 & 0x3F);
+        b[2] = 0x80 | (c >> 6 & 0x3F);
+        b[3] = 0x80 | (c & 0x3F);
+        out_write(s, b, 4);
+    }
+}
+
+/* Draw the dirty cells, moving the cursor only where the cells aren't contiguous. */
+static void draw(Screen *s)
+{
+    uint32_t fg = ~0u, bg = ~0u;
+    int x, y, cx = -1, cy = -1;
+
+    s->out_len = 0;
+    for (y = 0; y < s->rows; y++) {
+        for (x = 0; x < s->cols; x++) {
+            const AVPCell *c = &s->cells[y * s->cols + x];
+
+            if (!s->dirty[y * s->cols + x])
+                continue;
+            if (x != cx || y != cy)
+                out_printf(s, "\033[%d;%dH", y + 1, x + 1);
+            if (c->fg != fg || c->bg != bg) {
+                out_write(s, "\033[0", 3);
+                out_color(s, c->fg, 0);
+                out_color(s, c->bg, 1);
+                out_write(s, "m", 1);
+                fg = c->fg;
+                bg = c->bg;
+            }
+            out_utf8(s, c->ch);
+            cx = x + 1;
+            cy = y;
+        }
+    }
+    out_write(s, "\033[0m", 4);
+    memset(s->dirty, 0, s->cols * s->rows);
+    fwrite(s->out, 1, s->out_len, stdout);
+    fflush(stdout);
+}
+
+static void handle_frame(Screen *s, const AVPHeader *h, const uint8_t *payload)
+{
+    s->frames++;
+    if (!h->keyframe && (!s->synced || h->seq != s->next_seq)) {
+        // A delta on top of a frame we don't have, wait for the next keyframe
+        if (s->synced)
+            s->lost++;
+        s->synced = 0;
+        return;
+    }
+    s->next_seq = h->seq + 1;
+
+    if (h->cols != s->cols || h->rows != s->rows) {
+        if (!h->keyframe || !h->cols || !h->rows || h->cols > MAX_GRID_SIZE || h->rows > MAX_GRID_SIZE) {
+            s->synced = 0;
+            return;
+        }
+        free(s->cells);
+        free(s->dirty);
+        s->cols = h->cols;
+        s->rows = h->rows;
+        s->cells = calloc(s->cols * s->rows, sizeof(*s->cells));
+        s->dirty = calloc(s->cols * s->rows, 1);
+        if (!s->cells || !s->dirty) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        fputs("\033[0m\033[2J", stdout);
+    }
+    if (avp_decode_cells(s->cells, s->dirty, s->cols * s->rows, payload, payload + h->size) < 0) {
+        fprintf(stderr, "Malformed frame %u\n", h->seq);
+        s->synced = 0;
+        return;
+    }
+    s->synced = 1;
+    draw(s);
+}
+
+static int open_udp(const char *addr)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM,
+                              .ai_flags = AI_PASSIVE | AI_NUMERICSERV };
+    struct addrinfo *res;
+    const char *port = strrchr(addr, ':');
+    char host[256];
+    int fd, err;
+
+    if (!port) {
+        fprintf(stderr, "Missing port in udp://%s\n", addr);
+        return -1;
+    }
+    snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+    if ((err = getaddrinfo(*host ? host : NULL, port + 1, &hints, &res))) {
+        fprintf(stderr, "Invalid address %s: %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", addr, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int read_full(FILE *f, uint8_t *buf, size_t len)
+{
+    return fread(buf, 1, len, f) == len ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    Screen s = { 0 };
+    AVPHeader h;
+    uint8_t *buf;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s udp://[HOST]:PORT | file | -\n", argv[0]);
+        return 1;
+    }
+    if (!(buf = malloc(AVP_HEADER_SIZE + MAX_FRAME_SIZE))) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    if (!strncmp(argv[1], "udp://", 6)) {
+        int fd = open_udp(argv[1] + 6);
+        ssize_t n;
+
+        if (fd < 0)
+            return 1;
+        // One frame per datagram, anything that doesn't add up is dropped
+        while ((n = recv(fd, buf, AVP_HEADER_SIZE + MAX_FRAME_SIZE, 0)) >= 0) {
+            if (n < AVP_HEADER_SIZE || avp_read_header(buf, &h) < 0 || h.size != n - AVP_HEADER_SIZE)
+                continue;
+            handle_frame(&s, &h, buf + AVP_HEADER_SIZE);
+        }
+        fprintf(stderr, "Receive error: %s\n", strerror(errno));
+    } else {
+        FILE *f = strcmp(argv[1], "-") ? fopen(argv[1], "rb") : stdin;
+
+        if (!f) {
+            fprintf(stderr, "Cannot open %s: %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+        while (!read_full(f, buf, AVP_HEADER_SIZE)) {
+            // Out of step with the stream: slide forward until a header fits
+            while (avp_read_header(buf, &h) < 0 || h.size > MAX_FRAME_SIZE) {
+                int c = fgetc(f);
+                if (c == EOF)
+                    goto done;
+                memmove(buf, buf + 1, AVP_HEADER_SIZE - 1);
+                buf[AVP_HEADER_SIZE - 1] = c;
+            }
+            if (read_full(f, buf + AVP_HEADER_SIZE, h.size) < 0)
+                break;
+            handle_frame(&s, &h, buf + AVP_HEADER_SIZE);
+        }
+done:
+        if (f != stdin)
+            fclose(f);
+    }
+
+    printf("\033[0m\n");
+    fprintf(stderr, "%u frames, %u times resynchronized after a loss\n", s.frames, s.lost);
+    free(s.cells);
+    free(s.dirty);
+    free(s.out);
+    free(buf);
+    return 0;
+}
@@ -26,12 +26,36 @@
  * API example for decoding and filtering (with dynamic scale for ASCII output)
  */
 
+#define _GNU_SOURCE /* for CPU affinity */
 #define _XOPEN_SOURCE 600 /* for usleep */
 #include <unistd.h>      // For usleep (though not used in single-frame mode)
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>    // For PRId64
+#include <stdarg.h>
 #include <string.h>      // For snprintf, av_strdup
-#include <math.h>        // For round() and other math functions
+#include <math.h>        // Link with -lm: tone-mapping and statistics call pow, exp, log, sqrt
+#include <time.h>        // For clock_gettime
+#include <getopt.h>      // For getopt_long
+#include <pthread.h>     // For the playlist prefetch thread
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>        // The event loop waits for frame deadlines in poll()
+#include <sys/socket.h>  // For the --control socket
+#include <sys/un.h>
+#include <netdb.h>       // For the --metrics endpoint
+#include <signal.h>
+#include <termios.h>     // Raw terminal input for --flow-control
+#include <sched.h>       // For --affinity and --realtime
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>      // Zero-copy output buffers
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>   // --analytics statistics
+#endif
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -44,37 +68,475 @@
 #include <libavutil/log.h>     // For av_log, AV_LOG_ERROR
 #include <libavutil/error.h>   // For av_err2str
 #include <libavutil/rational.h> // For av_q2d
+#include <libavutil/pixdesc.h>  // For av_get_pix_fmt_name
+#include <libavutil/base64.h>   // For the kitty graphics payload
+#include <libavutil/mastering_display_metadata.h> // HDR peak brightness
+#include <libavutil/cpu.h>      // For av_cpu_count
+#include <zlib.h>
 
-static AVFormatContext *fmt_ctx;
-static AVCodecContext *dec_ctx;
-AVFilterContext *buffersink_ctx;
-AVFilterContext *buffersrc_ctx;
-AVFilterGraph *filter_graph;
-static int video_stream_index = -1;
+#include "ascii-protocol.h"
 
-#define MAX_ASCII_WIDTH 80 // Max characters per line for ASCII output
+/*
+ * A configured filtergraph and the parameters it was built for: the decoded
+ * frame geometry and format, and the output it scales to.
+ */
+typedef struct FilterGraph {
+    AVFilterGraph *graph;
+    AVFilterContext *buffersrc_ctx;
+    AVFilterContext *buffersink_ctx;
+    struct LumaScaler *luma; // Instead of graph, see luma_direct()
+    AVRational time_base;    // Of the frames coming out
+    int width, height, format;
+    AVRational sar;
+    const struct Renderer *renderer;
+    int ascii_width;
+    int view[4];             // Crop of the frames applied: x, y, width, height
+    int64_t last_used;
+} FilterGraph;
+
+// Graphs are built from the first frame's actual parameters and rebuilt
+// when they change mid-stream. The last few are kept, so streams that
+// alternate between resolutions switch graphs instead of rebuilding.
+#define FILTER_CACHE_SIZE 4
+
+/*
+ * Metrics for --metrics. Every thread counts into its own ThreadMetrics,
+ * written only by that thread with relaxed atomics, which compile to plain
+ * loads and stores. A scrape sums all of them up, so it never contends
+ * with playback.
+ */
+enum Stage { STAGE_DECODE, STAGE_FILTER, STAGE_RENDER, STAGE_WRITE, NB_STAGES };
+
+// Latency histogram bucket bounds in microseconds, a last one counts the rest
+static const int64_t latency_buckets[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000 };
+#define NB_LATENCY_BUCKETS FF_ARRAY_ELEMS(latency_buckets)
+
+typedef struct Histogram {
+    atomic_uint_least64_t buckets[NB_LATENCY_BUCKETS + 1];
+    atomic_uint_least64_t sum_ns;
+} Histogram;
+
+typedef struct ThreadMetrics {
+    atomic_uint_least64_t frames_decoded;
+    atomic_uint_least64_t bytes_demuxed;  // Read from the inputs
+    atomic_uint_least64_t bytes_used;     // Of those, in packets sent to the decoder
+    Histogram stages[NB_STAGES];
+} ThreadMetrics;
+
+/* Everything needed to decode and filter one playlist item. */
+typedef struct InputFile {
+    char *filename;
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *dec_ctx;
+    int video_stream_index;
+    FilterGraph graphs[FILTER_CACHE_SIZE];
+    FilterGraph *graph;    // The one frames currently go through
+    int64_t graph_clock;   // Use counter for LRU eviction
+    AVFrame *first_frame;  // Pre-decoded by the prefetch thread, NULL once consumed
+    int eof;               // Demuxer exhausted, decoder is being drained
+    int reused_decoder;    // dec_ctx was taken over from an earlier item
+    int64_t bytes_read;    // Input bytes counted into the metrics so far
+    int64_t seek_pts;      // Frames before this are decoded but not shown, after a seek
+    // Output the graphs are built for. A copy of the global settings, so
+    // the prefetch thread never reads what the main thread may change.
+    const struct Renderer *renderer;
+    int ascii_width;
+    int inset_width;       // Pixels wide a --pip inset shows it, 0 for the main picture
+    int analytics;         // Only looked at by --analytics, see analyze_segment()
+    int dec_threads;       // Its decoder threads, 0 for as many as there are CPUs
+} InputFile;
+
+/* Background open/probe/decode of the next playlist item. */
+typedef struct Prefetch {
+    pthread_t thread;
+    int running;
+    atomic_int done;       // Set by the thread when it is about to exit
+    int replace;           // Started by a load command, replaces the playing item
+    InputFile *in;
+    int ret;
+    ThreadMetrics metrics; // Shared by all prefetch threads, one runs at a time
+} Prefetch;
+
+static Prefetch prefetch;
+// The next playlist item, when a load command got in ahead of it
+static InputFile *queued;
+
+/*
+ * Decoding ahead for --preroll: the playing item is decoded on a thread of
+ * its own into a queue, filtering stays on the main thread.
+ */
+#define DECODE_QUEUE_SIZE 256 // Frames, whatever --preroll says
+
+typedef struct DecodeQueue {
+    pthread_t thread;
+    int running;
+    InputFile *in;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;   // Signalled whenever a frame goes in or out
+    AVFrame *frames[DECODE_QUEUE_SIZE];
+    int first, count;
+    int64_t duration;      // Queued, AV_TIME_BASE units
+    int64_t bytes;         // Queued frame data
+    int64_t frame_duration; // For frames that don't carry one
+    int done;              // The thread ran out of frames or failed, see ret
+    int ret;
+    int stop;              // Asks the thread to exit
+    ThreadMetrics metrics;
+    // count, duration and bytes for --metrics, stored under the lock and
+    // read without it, so a scrape never holds up the decoder
+    atomic_int metric_count;
+    atomic_int_least64_t metric_duration, metric_bytes;
+} DecodeQueue;
+
+static DecodeQueue decoder = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static double preroll;                // Seconds to decode ahead, 0 decodes on the main thread
+static int64_t preroll_max = 256 << 20; // Bytes, the queue never holds more
+
+// Decoder of the previously finished item, flushed and kept around so the
+// next item with identical codec parameters can skip avcodec_open2().
+// Only touched by the main thread or by the single running prefetch thread,
+// ownership is handed over by pthread_create()/pthread_join().
+static AVCodecContext *spare_dec_ctx;
+
+// Streams to demux, as the n-th stream of their type: -1 picks the best
+// video stream and no audio or subtitles. Everything else is discarded.
+static int video_stream = -1, audio_stream = -1, subtitle_stream = -1;
+
+#define MAX_ASCII_WIDTH 80 // Default characters per line for ASCII output
 // Characters are typically taller than they are wide.
 // A typical terminal font has a character aspect ratio (width/height) of around 0.5.
 // To make the video appear with its original proportions in ASCII,
 // we need to effectively "stretch" the width or "compress" the height based on this factor.
 #define CHARACTER_ASPECT_RATIO 0.5
 
-static int open_input_file(const char *filename);
-static int init_filters(int input_width, int input_height); // Updated prototype
+enum ColorMode {
+    COLOR_NONE,       // Plain grayscale ramp
+    COLOR_ANSI16,     // Nearest of the terminal's default 16 colors
+    COLOR_ADAPTIVE16, // 16 colors fitted to the scene, loaded with OSC 4
+    COLOR_ANSI256,    // xterm's 256 color palette, ascii renderer only
+    COLOR_TRUECOLOR,  // 24-bit color, ascii renderer only
+};
+
+enum Dither {
+    DITHER_NONE,      // Nearest shade of the ramp
+    DITHER_BLUE,      // Blue noise threshold, fixed pattern
+    DITHER_TEMPORAL,  // Blue noise shifted every frame
+};
+
+// Pixels per character cell for the graphics backends, 80 columns give a
+// 640 pixels wide picture. The 1:2 cell matches CHARACTER_ASPECT_RATIO, so
+// the pixels come out square.
+#define SIXEL_CELL_W 8
+#define SIXEL_CELL_H 16
+
+static int ascii_width = MAX_ASCII_WIDTH;
+
+// Part of the picture shown, see the zoom and pan commands: 1 shows all of
+// it, x and y are the center of the view as fractions of the picture.
+#define MAX_ZOOM 16
+static struct {
+    double zoom, x, y;
+} view = { 1, 0.5, 0.5 };
+static int kitty_zlib;
+static enum ColorMode color_mode = COLOR_NONE;
+static enum Dither dither = DITHER_NONE;
+static int hysteresis;      // Luma a cell must move before the ascii renderer redraws it
+static int show_stats;
+
+/* Counters printed by --stats when playback ends. */
+typedef struct PlaybackStats {
+    int frames_presented;
+    int frames_dropped;
+    int64_t bytes_written;
+    int64_t bytes_spliced;  // Of those, handed to a pipe with vmsplice()
+    int splice_copied;      // Frames written to the pipe with write() instead
+    int64_t render_ns;      // Turning a filtered frame into terminal output
+    int64_t quant_ns;       // Palette quantization and remapping, summed
+    int64_t quant_max_ns;
+    int palette_changes;
+    int64_t clock_drift;    // Presentation of the last frame behind its deadline, microseconds
+    int64_t ansi_bytes;     // --protocol-out: what the frames would have taken as escapes
+    int64_t rows_drawn, rows_total; // Text renderers, rows not skipped by plan_redraw()
+    int64_t cells_changed, cells_total; // ascii renderer, cells whose glyph changed
+    int64_t cells_held;     // Changes --hysteresis held back
+    int64_t shade_ns;       // Choosing the shades, including dithering and hysteresis
+    int scrolls;
+    int keyframes;
+    int datagrams_lost;     // --protocol-out over UDP, sends that failed
+    int commands;           // Control commands that took effect
+    int64_t command_ns;     // From receiving a command to the frame showing it
+    int64_t command_max_ns;
+    int flow_answers;       // --flow-control status reports answered
+    int64_t flow_rtt, flow_rtt_max; // Their round trips, microseconds
+    int flow_drops;         // Frames late from waiting on the terminal
+    int flow_width;         // Width fitted to the terminal's throughput, 0 if untouched
+    int64_t preroll_ns;     // --preroll: waiting for the queue to fill after a start or seek
+    int64_t queue_fill, queue_gets; // Frames queued when one was taken, summed
+    int underruns;          // The queue was empty when a frame was needed
+    int64_t underrun_ns;
+    int deadline_misses;    // Frames shown more than DEADLINE_SLACK late
+    int64_t deadline_max;   // Latest one, microseconds
+    int pip_shown, pip_dropped; // Frames of the --pip inset
+    int pip_lowres;         // Its decoder's lowres setting
+} PlaybackStats;
+
+static PlaybackStats stats;
+// Where the renderers count, the --pip thread keeps its own
+static _Thread_local PlaybackStats *render_stats = &stats;
+
+static ThreadMetrics main_metrics, pip_metrics;
+static _Thread_local ThreadMetrics *thread_metrics = &main_metrics;
+static ThreadMetrics *const metrics_threads[] = { &main_metrics, &prefetch.metrics, &decoder.metrics, &pip_metrics };
+
+/* Only the owning thread writes, so there is no need for an atomic add. */
+static void metric_add(atomic_uint_least64_t *m, uint64_t v)
+{
+    atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static void metric_time(enum Stage stage, int64_t ns)
+{
+    Histogram *h = &thread_metrics->stages[stage];
+    int i = 0;
+
+    while (i < NB_LATENCY_BUCKETS && ns > latency_buckets[i] * 1000)
+        i++;
+    metric_add(&h->buckets[i], 1);
+    metric_add(&h->sum_ns, ns);
+}
+
+/*
+ * Thread placement. Every thread takes a role when it starts: main
+ * (demuxing unless --preroll, filtering, rendering and writing to the
+ * terminal), decode (prefetch and --preroll threads) or filter (while the
+ * main thread builds a graph). --affinity pins a role to a set of CPUs.
+ * Threads FFmpeg starts inherit the mask of the thread creating them, so
+ * decoder workers follow the decode role and filtergraph workers the
+ * filter role. --realtime runs the main thread, the one the terminal waits
+ * on, under SCHED_FIFO, or failing that at a raised nice level; the other
+ * roles drop what they inherited from it.
+ */
+enum ThreadRole { ROLE_MAIN, ROLE_DECODE, ROLE_FILTER, NB_ROLES };
+
+static const char *const role_names[NB_ROLES] = { "main", "decode", "filter" };
+static cpu_set_t role_cpus[NB_ROLES];
+static const char *role_cpu_list[NB_ROLES]; // As given, NULL if not pinned
+static cpu_set_t process_cpus;               // What roles that are not pinned run on
+static int affinity;                          // Some role is pinned
+static _Thread_local enum ThreadRole thread_role = ROLE_MAIN;
+
+#define REALTIME_PRIORITY 10
+#define REALTIME_NICE 10    // Niceness taken off when SCHED_FIFO is not permitted
+static int realtime;
+static int sched_mode = SCHED_OTHER; // What --realtime got, -1 for a raised nice level
+static int base_nice;
+
+/* Parse a CPU list like "0,2-5". */
+static int parse_cpu_list(const char *s, cpu_set_t *set)
+{
+    char *end;
+    long a, b;
+
+    CPU_ZERO(set);
+    do {
+        a = b = strtol(s, &end, 10);
+        if (end == s || a < 0 || a >= CPU_SETSIZE)
+            return AVERROR(EINVAL);
+        if (*end == '-') {
+            s = end + 1;
+            b = strtol(s, &end, 10);
+            if (end == s || b < a || b >= CPU_SETSIZE)
+                return AVERROR(EINVAL);
+        }
+        for (; a <= b; a++)
+            CPU_SET(a, set);
+        s = end + 1;
+    } while (*end == ',');
+    return *end ? AVERROR(EINVAL) : 0;
+}
+
+/* --affinity=ROLE:CPUS */
+static int parse_affinity(const char *arg)
+{
+    const char *cpus = strchr(arg, ':');
+    int i;
+
+    for (i = 0; cpus && i < NB_ROLES; i++) {
+        if (strlen(role_names[i]) == cpus - arg && !strncmp(arg, role_names[i], cpus - arg)) {
+            if (parse_cpu_list(cpus + 1, &role_cpus[i]) < 0)
+                return AVERROR(EINVAL);
+            role_cpu_list[i] = cpus + 1;
+            return 0;
+        }
+    }
+    return AVERROR(EINVAL);
+}
+
+/* Apply the settings of a role to the calling thread. */
+static void thread_enter(enum ThreadRole role)
+{
+    struct sched_param sp = { .sched_priority = role == ROLE_MAIN ? REALTIME_PRIORITY : 0 };
+    int err;
+
+    thread_role = role;
+    // Roles without CPUs of their own go back to the process's, they may
+    // have inherited another role's from the thread that started them
+    if (affinity &&
+        (err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                      role_cpu_list[role] ? &role_cpus[role] : &process_cpus)))
+        av_log(NULL, AV_LOG_WARNING, "Cannot pin the %s thread to CPUs %s: %s\n", role_names[role],
+               role_cpu_list[role] ? role_cpu_list[role] : "of the process", strerror(err));
+    if (sched_mode == SCHED_FIFO)
+        pthread_setschedparam(pthread_self(), role == ROLE_MAIN ? SCHED_FIFO : SCHED_OTHER, &sp);
+    else if (sched_mode < 0)
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), role == ROLE_MAIN ? base_nice - REALTIME_NICE : base_nice);
+}
+
+/* Called once by the main thread, before any other thread exists. */
+static void sched_init(void)
+{
+    struct sched_param sp = { .sched_priority = REALTIME_PRIORITY };
+
+    errno = 0;
+    base_nice = getpriority(PRIO_PROCESS, 0);
+    affinity = role_cpu_list[ROLE_MAIN] || role_cpu_list[ROLE_DECODE] || role_cpu_list[ROLE_FILTER];
+    if (affinity && pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &process_cpus)) {
+        av_log(NULL, AV_LOG_WARNING, "Cannot read the CPUs of the process, --affinity ignored\n");
+        affinity = 0;
+    }
+    if (realtime) {
+        if (!pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+            sched_mode = SCHED_FIFO;
+        else if (!setpriority(PRIO_PROCESS, syscall(SYS_gettid), base_nice - REALTIME_NICE))
+            sched_mode = -1;
+        else
+            av_log(NULL, AV_LOG_WARNING, "Neither SCHED_FIFO nor a higher priority is permitted, --realtime ignored\n");
+    }
+    thread_enter(ROLE_MAIN);
+}
+
+/* Growable output buffer, a frame is assembled here and written in one go. */
+typedef struct OutBuf {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    int error;
+    int spliced;          // data is a buffer of splice_out, not to be reallocated
+} OutBuf;
+
+static OutBuf out;
+
+/*
+ * A character cell as the terminal shows it: a Unicode code point and
+ * colors CELL_DEFAULT, CELL_INDEXED | index or CELL_RGB | 0xRRGGBB. The
+ * same as a protocol cell, so grids go to --protocol-out as they are.
+ */
+typedef AVPCell Cell;
+
+#define CELL_DEFAULT 0
+#define CELL_INDEXED (AVP_COLOR_INDEXED << 24)
+#define CELL_RGB     (AVP_COLOR_RGB << 24)
+
+/*
+ * Renderers turn a filtered frame into terminal output. Each one states how
+ * many pixels it wants per character cell and in which pixel format, the
+ * filtergraph is built accordingly. Private state lives in priv_data,
+ * allocated with priv_data_size bytes before init() is called.
+ */
+typedef struct RenderContext RenderContext;
+
+typedef struct Renderer {
+    const char *name;
+    const char *description;
+    int cell_w, cell_h;   // Pixels per character cell
+    int graphics;         // Draws with terminal graphics instead of characters
+    int priv_data_size;
+    enum AVPixelFormat (*pix_fmt)(void); // Only depends on options, called from any thread
+    int  (*init)(RenderContext *rc);
+    int  (*render)(RenderContext *rc, const AVFrame *frame, OutBuf *ob);
+    int  (*resize)(RenderContext *rc); // Optional, cols/rows already updated
+    void (*uninit)(RenderContext *rc);
+} Renderer;
+
+struct RenderContext {
+    const Renderer *renderer;
+    void *priv_data;
+    int cols, rows;       // Grid size in cells
+    int initialized;
+    // Text renderers only draw the rows set here, positioning the cursor
+    // themselves. NULL draws the whole frame. A renderer may drop the mask
+    // when the frame needs a full redraw anyway.
+    uint8_t *row_mask;
+    // Scroll detection, see plan_redraw()
+    uint64_t *row_hash, *prev_row_hash;
+    uint8_t *dirty_rows;
+    int shift;            // Rows the old picture was scrolled up (down if < 0) for this frame
+    int hash_rows;        // Rows the arrays are allocated for, 0 if prev_row_hash is stale
+    int since_full;       // Frames since the last full redraw
+    // --verify: text renderers also note here the cells of the rows they draw
+    Cell *grid;
+};
+
+static RenderContext *render_ctx;
+
+static int open_input_file(InputFile *in);
+static int init_filters(InputFile *in, FilterGraph *fg);
 static void display_frame(const AVFrame *frame, AVRational time_base);
+static int64_t now_ns(void);
 
 
-static int open_input_file(const char *filename)
+static int codec_params_match(const AVCodecContext *dec_ctx, const AVCodecParameters *par)
 {
-    int ret;
+    return dec_ctx->codec_id == par->codec_id &&
+           dec_ctx->width == par->width && dec_ctx->height == par->height &&
+           dec_ctx->pix_fmt == par->format &&
+           dec_ctx->profile == par->profile &&
+           dec_ctx->extradata_size == par->extradata_size &&
+           (!par->extradata_size ||
+            !memcmp(dec_ctx->extradata, par->extradata, par->extradata_size));
+}
+
+/* Index of the n-th stream of the given type in s, -1 if there are fewer. */
+static int nth_stream(const AVFormatContext *s, enum AVMediaType type, int n)
+{
+    unsigned i;
+
+    for (i = 0; i < s->nb_streams; i++)
+        if (s->streams[i]->codecpar->codec_type == type && !n--)
+            return i;
+    return -1;
+}
+
+/*
+ * Pick the --audio-stream or --subtitle-stream of in, -1 for none.
+ * Nothing plays them, they are only demuxed.
+ */
+static int select_stream(const InputFile *in, enum AVMediaType type, int n)
+{
+    int idx;
+
+    if (n < 0)
+        return -1;
+    if ((idx = nth_stream(in->fmt_ctx, type, n)) < 0)
+        av_log(NULL, AV_LOG_WARNING, "%s has no %s stream %d\n", in->filename, av_get_media_type_string(type), n);
+    return idx;
+}
+
+static int open_input_file(InputFile *in)
+{
+    int ret, audio, subtitle;
+    unsigned i;
     const AVCodec *dec = NULL; // Initialize dec to NULL
+    AVCodecParameters *par;
+    // --video-stream is meant for the files played, an inset shows its best stream
+    int nth = in->inset_width ? -1 : video_stream;
 
-    if ((ret = avformat_open_input(&fmt_ctx, filename, NULL, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot open input file %s\n", filename);
+    if ((ret = avformat_open_input(&in->fmt_ctx, in->filename, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open input file %s\n", in->filename);
         return ret;
     }
 
-    if ((ret = avformat_find_stream_info(fmt_ctx, NULL)) < 0) {
+    if ((ret = avformat_find_stream_info(in->fmt_ctx, NULL)) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot find stream information\n");
         return ret;
     }
@@ -82,18 +544,57 @@ static int open_input_file(const char *filename)
     /* select the video stream */
     // Explicit cast for av_find_best_stream to satisfy strict compilers.
     // &dec is passed as `const AVCodec **` which `av_find_best_stream` expects.
-    ret = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, (const AVCodec **)&dec, 0);
+    if (nth >= 0 && (ret = nth_stream(in->fmt_ctx, AVMEDIA_TYPE_VIDEO, nth)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "There is no video stream %d in the input file\n", nth);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+    ret = av_find_best_stream(in->fmt_ctx, AVMEDIA_TYPE_VIDEO, nth >= 0 ? ret : -1, -1,
+                              (const AVCodec **)&dec, 0);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot find a video stream in the input file\n");
         return ret;
     }
-    video_stream_index = ret;
-    dec_ctx = avcodec_alloc_context3(dec);
-    if (!dec_ctx)
+    in->video_stream_index = ret;
+    par = in->fmt_ctx->streams[in->video_stream_index]->codecpar;
+
+    // Streams nobody uses are dropped by the demuxer, most formats then
+    // skip their data instead of reading it into packets
+    audio = in->inset_width || in->analytics ? -1 : select_stream(in, AVMEDIA_TYPE_AUDIO, audio_stream);
+    subtitle = in->inset_width || in->analytics ? -1 : select_stream(in, AVMEDIA_TYPE_SUBTITLE, subtitle_stream);
+    for (i = 0; i < in->fmt_ctx->nb_streams; i++)
+        if (i != in->video_stream_index && i != audio && i != subtitle)
+            in->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+    // Same codec parameters as the last finished item: its decoder has been
+    // flushed already and can carry on with the new packets.
+    if (!in->inset_width && !in->analytics && spare_dec_ctx && codec_params_match(spare_dec_ctx, par)) {
+        in->dec_ctx = spare_dec_ctx;
+        spare_dec_ctx = NULL;
+        in->reused_decoder = 1;
+        return 0;
+    }
+
+    in->dec_ctx = avcodec_alloc_context3(dec);
+    if (!in->dec_ctx)
         return AVERROR(ENOMEM);
-    avcodec_parameters_to_context(dec_ctx, fmt_ctx->streams[video_stream_index]->codecpar);
+    avcodec_parameters_to_context(in->dec_ctx, par);
+
+    // An inset needs a fraction of the detail: decode at the lowest
+    // resolution still as wide as the inset where the codec can, without
+    // deblocking and without the frames nothing refers to
+    if (in->inset_width) {
+        while (in->dec_ctx->lowres < dec->max_lowres && par->width >> (in->dec_ctx->lowres + 1) >= in->inset_width)
+            in->dec_ctx->lowres++;
+        in->dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+        in->dec_ctx->skip_frame = AVDISCARD_NONREF;
+        in->dec_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+    }
+    // Statistics are of the exact pixels: skipping deblocking would change
+    // them, with the error building up until the next keyframe
+    if (in->analytics)
+        in->dec_ctx->thread_count = in->dec_threads;
 
-    if ((ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) {
+    if ((ret = avcodec_open2(in->dec_ctx, dec, NULL)) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot open video decoder\n");
         return ret;
     }
@@ -101,7 +602,396 @@ static int open_input_file(const char *filename)
     return 0;
 }
 
-static int init_filters(int input_width, int input_height)
+/*
+ * Output size in characters for the frames of fg: as wide as requested,
+ * with the height following the display aspect ratio.
+ */
+static void output_size(const FilterGraph *fg, int *cols, int *rows, double *display_aspect)
+{
+    double video_width = fg->width;
+    double video_height = fg->height;
+
+    // Account for display aspect ratio if available
+    if (fg->sar.num > 0 && fg->sar.den > 0)
+        video_width = video_width * av_q2d(fg->sar);
+
+    double video_display_aspect_ratio = video_width / video_height;
+    double target_width;
+    double target_height;
+
+    // Adjust for terminal character aspect ratio (characters are typically taller than wide)
+    // This helps the video appear with its correct visual proportions in ASCII characters.
+    double adjusted_aspect_ratio = video_display_aspect_ratio / CHARACTER_ASPECT_RATIO;
+
+    // Prioritize fitting within the requested width
+    target_width = fg->ascii_width;
+    target_height = round(target_width / adjusted_aspect_ratio);
+
+    // Ensure dimensions are positive and even numbers (many filters prefer even dimensions)
+    if (target_height < 1) target_height = 1;
+    target_width = (double)((int)round(target_width / 2.0) * 2); // Make it even
+    target_height = (double)((int)round(target_height / 2.0) * 2); // Make it even
+
+    // Ensure we don't end up with 0 dimensions in case of extremely small calculated values
+    if (target_width == 0) target_width = 2;
+    if (target_height == 0) target_height = 2;
+
+    *cols = target_width;
+    *rows = target_height;
+    *display_aspect = video_display_aspect_ratio;
+}
+
+/*
+ * The part of fg's frames the view shows, in pixels. It keeps the shape of
+ * the frame, so the output size stays the same at any zoom, and is aligned
+ * to the chroma subsampling as crop would. A --pip inset always shows all
+ * of its picture.
+ */
+static void view_rect(const InputFile *in, const FilterGraph *fg, int rect[4])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fg->format);
+    int hsub = desc ? 1 << desc->log2_chroma_w : 1;
+    int vsub = desc ? 1 << desc->log2_chroma_h : 1;
+    double zoom = in->inset_width ? 1 : view.zoom;
+    int w = FFMIN(FFMAX(lrint(fg->width / zoom / hsub), 1) * hsub, fg->width);
+    int h = FFMIN(FFMAX(lrint(fg->height / zoom / vsub), 1) * vsub, fg->height);
+
+    rect[0] = in->inset_width ? 0 : av_clip(lrint(view.x * fg->width - w / 2.0), 0, fg->width - w) / hsub * hsub;
+    rect[1] = in->inset_width ? 0 : av_clip(lrint(view.y * fg->height - h / 2.0), 0, fg->height - h) / vsub * vsub;
+    rect[2] = w;
+    rect[3] = h;
+}
+
+/* Keep the view's center where the whole view fits in the picture. */
+static void view_clamp(void)
+{
+    double half = 0.5 / view.zoom;
+
+    view.x = av_clipd(view.x, half, 1 - half);
+    view.y = av_clipd(view.y, half, 1 - half);
+}
+
+/*
+ * Direct luma path. A gray renderer only needs the Y plane, but frames
+ * with 10 to 16 bits per sample reach format=gray through a slow generic
+ * conversion. Those frames skip the filtergraph: the Y samples are box
+ * averaged straight down to one value per output pixel, which is mapped
+ * to 8 bits through a table with an entry for every sample value. For PQ
+ * (HDR10) and HLG video the table also tone-maps to SDR; converted as is,
+ * such video looks flat and washed out.
+ *
+ * The color modes of the ascii renderer take YUV 4:4:4 at cell resolution.
+ * From planar YUV at any depth the U and V planes are averaged the same
+ * way, over boxes scaled down by the chroma subsampling, so color costs
+ * little more than gray: no full size RGB picture is ever made.
+ */
+#define HDR_REFERENCE_WHITE 203.0 // Nits of SDR white in HDR video (BT.2408)
+#define HDR_DEFAULT_PEAK 1000.0   // Nits, when the stream doesn't say
+
+typedef struct LumaScaler {
+    int depth, shift;     // Significant bits of a sample and their offset in the 16-bit word
+    int bytes;            // Per sample
+    int planes;           // 1 for gray output, 3 for YUV 4:4:4
+    int log2_chroma_w, log2_chroma_h;
+    int width, height;    // Output
+    int *xs[3], *ys[3];   // Box edges per plane, width + 1 and height + 1 of them
+    uint32_t *columns;    // Per source column, the sum of the current box rows
+    uint8_t *lut;         // 8-bit output per sample value
+    enum AVColorTransferCharacteristic trc; // The table was built for
+    enum AVColorRange range;
+    AVFrame *pending;     // Pushed and not pulled yet
+    int eof;
+} LumaScaler;
+
+/* Whether the first planes components of desc can be read by luma_scale(). */
+static int luma_readable(const AVPixFmtDescriptor *desc, int planes)
+{
+    int i;
+
+    if (!desc || desc->nb_components < planes ||
+        desc->flags & (AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL |
+                       AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_FLOAT))
+        return 0;
+    // One plane per component, no interleaved chroma as in NV12
+    for (i = 0; i < planes; i++)
+        if (desc->comp[i].plane != i || desc->comp[i].offset ||
+            desc->comp[i].step != (desc->comp[0].depth > 8 ? 2 : 1))
+            return 0;
+    return 1;
+}
+
+static int luma_direct(const FilterGraph *fg)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fg->format);
+    enum AVPixelFormat out = fg->renderer->pix_fmt();
+
+    if (out == AV_PIX_FMT_YUV444P)
+        return luma_readable(desc, 3);
+    // 8-bit gray is a plain copy of the Y plane in the filtergraph
+    return out == AV_PIX_FMT_GRAY8 && luma_readable(desc, 1) && desc->comp[0].depth > 8;
+}
+
+static void luma_free(LumaScaler **s)
+{
+    int p;
+
+    if (!*s)
+        return;
+    for (p = 0; p < 3; p++) {
+        av_freep(&(*s)->xs[p]);
+        av_freep(&(*s)->ys[p]);
+    }
+    av_freep(&(*s)->columns);
+    av_freep(&(*s)->lut);
+    av_frame_free(&(*s)->pending);
+    av_freep(s);
+}
+
+/* Place the boxes over the rect of the source, see view_rect(). */
+static void luma_set_view(LumaScaler *s, const int rect[4])
+{
+    int i, p;
+
+    for (p = 0; p < s->planes; p++) {
+        // The rect is aligned to the chroma subsampling
+        int sx = p ? s->log2_chroma_w : 0, sy = p ? s->log2_chroma_h : 0;
+        int x = rect[0] >> sx, w = AV_CEIL_RSHIFT(rect[2], sx);
+        int y = rect[1] >> sy, h = AV_CEIL_RSHIFT(rect[3], sy);
+
+        for (i = 0; i <= s->width; i++)
+            s->xs[p][i] = x + (int64_t)i * w / s->width;
+        for (i = 0; i <= s->height; i++)
+            s->ys[p][i] = y + (int64_t)i * h / s->height;
+    }
+}
+
+/* PQ (SMPTE ST 2084) signal to nits. */
+static double pq_eotf(double e)
+{
+    const double m1 = 2610 / 16384.0, m2 = 2523 / 4096.0 * 128;
+    const double c1 = 3424 / 4096.0, c2 = 2413 / 4096.0 * 32, c3 = 2392 / 4096.0 * 32;
+    double p = pow(e, 1 / m2);
+
+    return 10000 * pow(FFMAX(p - c1, 0) / (c2 - c3 * p), 1 / m1);
+}
+
+/* HLG (ARIB STD-B67) signal to nits on a display of the given peak. */
+static double hlg_eotf(double e, double peak)
+{
+    const double a = 0.17883277, b = 1 - 4 * a, c = 0.5 - a * log(4 * a);
+    double scene = e <= 0.5 ? e * e / 3 : (exp((e - c) / a) + b) / 12;
+
+    // The OOTF, applied to luma alone
+    return peak * pow(scene, 1.2);
+}
+
+static double hdr_peak(const AVFrame *frame)
+{
+    const AVFrameSideData *sd;
+
+    if ((sd = av_frame_get_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL))) {
+        const AVContentLightMetadata *cll = (const AVContentLightMetadata *)sd->data;
+        if (cll->MaxCLL)
+            return cll->MaxCLL;
+    }
+    if ((sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA))) {
+        const AVMasteringDisplayMetadata *mdm = (const AVMasteringDisplayMetadata *)sd->data;
+        if (mdm->has_luminance && mdm->max_luminance.num > 0)
+            return av_q2d(mdm->max_luminance);
+    }
+    return HDR_DEFAULT_PEAK;
+}
+
+/*
+ * Fill the sample value to 8-bit table for frame's transfer function and
+ * range. The output keeps the range of the input, as the filtergraph does.
+ */
+static void luma_build_lut(LumaScaler *s, const AVFrame *frame)
+{
+    int limited = frame->color_range != AVCOL_RANGE_JPEG;
+    int max = (1 << s->depth) - 1, hdr = 0, v;
+    double black = limited ? 16 << (s->depth - 8) : 0;
+    double white = limited ? 235 << (s->depth - 8) : max;
+    double peak = HDR_DEFAULT_PEAK, w;
+
+    s->trc = frame->color_trc;
+    s->range = frame->color_range;
+    if (s->trc == AVCOL_TRC_SMPTE2084) {
+        peak = FFMIN(hdr_peak(frame), 10000);
+        hdr = 1;
+    } else if (s->trc == AVCOL_TRC_ARIB_STD_B67) {
+        hdr = 1;
+    }
+    // Peak relative to SDR white, at least a little above it
+    w = FFMAX(peak / HDR_REFERENCE_WHITE, 1.1);
+
+    for (v = 0; v <= max; v++) {
+        double e = av_clipd((v - black) / (white - black), 0, 1), l;
+
+        if (!hdr) {
+            s->lut[v] = av_clip_uint8((v + (1 << s->depth >> 9)) >> (s->depth - 8));
+            continue;
+        }
+        l = (s->trc == AVCOL_TRC_SMPTE2084 ? pq_eotf(e) : hlg_eotf(e, peak)) / HDR_REFERENCE_WHITE;
+        // Extended Reinhard: SDR white stays near the middle, the peak ends at 1
+        l = FFMIN(l * (1 + l / (w * w)) / (1 + l), 1);
+        // BT.1886 display gamma
+        e = pow(l, 1 / 2.4);
+        s->lut[v] = lrint(limited ? 16 + 219 * e : 255 * e);
+    }
+    if (hdr)
+        av_log(NULL, AV_LOG_INFO, "Tone-mapping %s from %.0f nits\n",
+               s->trc == AVCOL_TRC_SMPTE2084 ? "PQ" : "HLG", peak);
+}
+
+/* A scaler of planes planes from src_width wide frames of desc to width x height. */
+static int luma_alloc(LumaScaler **ps, const AVPixFmtDescriptor *desc, int src_width,
+                      int width, int height, int planes)
+{
+    LumaScaler *s;
+    int p;
+
+    if (!(s = *ps = av_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+    s->width = width;
+    s->height = height;
+    s->depth = desc->comp[0].depth;
+    s->shift = desc->comp[0].shift;
+    s->bytes = desc->comp[0].step;
+    s->planes = planes;
+    s->log2_chroma_w = desc->log2_chroma_w;
+    s->log2_chroma_h = desc->log2_chroma_h;
+    for (p = 0; p < s->planes; p++) {
+        if (!(s->xs[p] = av_malloc_array(s->width + 1, sizeof(*s->xs[p]))) ||
+            !(s->ys[p] = av_malloc_array(s->height + 1, sizeof(*s->ys[p]))))
+            return AVERROR(ENOMEM);
+    }
+    s->columns = av_malloc_array(src_width, sizeof(*s->columns));
+    s->lut = av_malloc(1 << s->depth);
+    s->pending = av_frame_alloc();
+    if (!s->columns || !s->lut || !s->pending)
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+static int luma_init(InputFile *in, FilterGraph *fg, const AVFrame *frame)
+{
+    const Renderer *renderer = fg->renderer;
+    double aspect;
+    int cols, rows, ret;
+    LumaScaler *s;
+
+    output_size(fg, &cols, &rows, &aspect);
+    if ((ret = luma_alloc(&fg->luma, av_pix_fmt_desc_get(fg->format), fg->width,
+                          FFMIN(cols * renderer->cell_w, fg->width), FFMIN(rows * renderer->cell_h, fg->height),
+                          renderer->pix_fmt() == AV_PIX_FMT_YUV444P ? 3 : 1)) < 0)
+        return ret;
+    s = fg->luma;
+    view_rect(in, fg, fg->view);
+    luma_set_view(s, fg->view);
+    luma_build_lut(s, frame);
+    fg->time_base = in->fmt_ctx->streams[in->video_stream_index]->time_base;
+
+    av_log(NULL, AV_LOG_INFO, "Input video resolution: %dx%d %s, reading %d-bit %s directly\n",
+           fg->width, fg->height, av_get_pix_fmt_name(fg->format), s->depth,
+           s->planes == 3 ? "Y, U and V" : "luma");
+    av_log(NULL, AV_LOG_INFO, "Output ASCII dimensions (characters): %dx%d\n", cols, rows);
+    return 0;
+}
+
+/*
+ * Average plane p of src over each output pixel's box. Rows are added up
+ * per source column first; that inner loop runs over whole rows of
+ * samples and is vectorized by the compiler. Only the columns and rows in
+ * view are read, and boxes are at least a sample wide and high when zoomed
+ * in further than the output's resolution.
+ */
+static void luma_scale_plane(LumaScaler *s, int p, const AVFrame *src, AVFrame *dst)
+{
+    const int *xs = s->xs[p], *ys = s->ys[p];
+    int x, y, ox, oy, v, max = (1 << s->depth) - 1;
+    int x0 = xs[0], x1 = xs[s->width];
+
+    for (oy = 0; oy < s->height; oy++) {
+        uint32_t *restrict columns = s->columns;
+        const uint8_t *in = src->data[p] + ys[oy] * src->linesize[p];
+        uint8_t *out = dst->data[p] + oy * dst->linesize[p];
+        int y1 = FFMAX(ys[oy + 1], ys[oy] + 1);
+
+        memset(columns + x0, 0, (x1 - x0) * sizeof(*columns));
+        for (y = ys[oy]; y < y1; y++, in += src->linesize[p]) {
+            if (s->bytes == 2) {
+                const uint16_t *restrict row = (const uint16_t *)in;
+                for (x = x0; x < x1; x++)
+                    columns[x] += row[x];
+            } else {
+                const uint8_t *restrict row = in;
+                for (x = x0; x < x1; x++)
+                    columns[x] += row[x];
+            }
+        }
+        for (ox = 0; ox < s->width; ox++) {
+            int bx1 = FFMAX(xs[ox + 1], xs[ox] + 1);
+            uint64_t sum = 0, area = (uint64_t)(bx1 - xs[ox]) * (y1 - ys[oy]);
+            for (x = xs[ox]; x < bx1; x++)
+                sum += columns[x];
+            v = FFMIN((sum + area / 2) / area >> s->shift, max);
+            // Chroma is only brought to 8 bits, it has no transfer function
+            out[ox] = p ? av_clip_uint8((v + (1 << s->depth >> 9)) >> (s->depth - 8)) : s->lut[v];
+        }
+    }
+}
+
+static int luma_scale(LumaScaler *s, const AVFrame *src, AVFrame *dst)
+{
+    int p, ret;
+
+    if (src->color_trc != s->trc || src->color_range != s->range)
+        luma_build_lut(s, src);
+
+    dst->format = s->planes == 3 ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_GRAY8;
+    dst->width = s->width;
+    dst->height = s->height;
+    if ((ret = av_frame_get_buffer(dst, 0)) < 0 || (ret = av_frame_copy_props(dst, src)) < 0)
+        return ret;
+    dst->color_trc = AVCOL_TRC_UNSPECIFIED;
+
+    for (p = 0; p < s->planes; p++)
+        luma_scale_plane(s, p, src, dst);
+    return 0;
+}
+
+/* Feed a frame to fg, NULL at the end of the stream. The caller keeps its reference. */
+static int filter_push(FilterGraph *fg, AVFrame *frame)
+{
+    if (!fg->luma)
+        return av_buffersrc_add_frame_flags(fg->buffersrc_ctx, frame, frame ? AV_BUFFERSRC_FLAG_KEEP_REF : 0);
+    if (!frame) {
+        fg->luma->eof = 1;
+        return 0;
+    }
+    av_frame_unref(fg->luma->pending);
+    return av_frame_ref(fg->luma->pending, frame);
+}
+
+/* Like av_buffersink_get_frame(): AVERROR(EAGAIN) until more is pushed. */
+static int filter_pull(FilterGraph *fg, AVFrame *frame)
+{
+    LumaScaler *s = fg->luma;
+    int ret;
+
+    if (!s)
+        return av_buffersink_get_frame(fg->buffersink_ctx, frame);
+    if (!s->pending->buf[0])
+        return s->eof ? AVERROR_EOF : AVERROR(EAGAIN);
+    ret = luma_scale(s, s->pending, frame);
+    av_frame_unref(s->pending);
+    if (ret < 0)
+        av_frame_unref(frame);
+    return ret;
+}
+
+static int init_filters(InputFile *in, FilterGraph *fg)
 {
     char args[512];
     int ret = 0;
@@ -109,41 +999,44 @@ static int init_filters(int input_width, int input_height)
     const AVFilter *buffersink = avfilter_get_by_name("buffersink");
     AVFilterInOut *outputs = avfilter_inout_alloc();
     AVFilterInOut *inputs = avfilter_inout_alloc();
-    enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_GRAY8, AV_PIX_FMT_NONE }; // Output grayscale
+    // Whatever the renderer consumes, gray or packed RGB
+    const Renderer *renderer = fg->renderer;
+    enum AVPixelFormat pix_fmts[] = { renderer->pix_fmt(), AV_PIX_FMT_NONE };
+    int input_width = fg->width, input_height = fg->height;
 
     // Retrieve the stream's time_base for the buffer source
-    AVRational stream_time_base = fmt_ctx->streams[video_stream_index]->time_base;
+    AVRational stream_time_base = in->fmt_ctx->streams[in->video_stream_index]->time_base;
 
-    filter_graph = avfilter_graph_alloc();
-    if (!outputs || !inputs || !filter_graph) {
+    fg->graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !fg->graph) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
     /* buffer video source: the decoded frames from the decoder will be inserted here. */
-    // Using original frame width/height, pixel format, and time base from stream
+    // Using the decoded frame's width/height, pixel format and aspect, and time base from stream
     snprintf(args, sizeof(args),
              "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-             input_width, input_height, dec_ctx->pix_fmt,
+             input_width, input_height, fg->format,
              stream_time_base.num, stream_time_base.den, // Use stream_time_base
-             dec_ctx->sample_aspect_ratio.num, dec_ctx->sample_aspect_ratio.den);
+             fg->sar.num, fg->sar.den);
 
-    ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-                                       args, NULL, filter_graph);
+    ret = avfilter_graph_create_filter(&fg->buffersrc_ctx, buffersrc, "in",
+                                       args, NULL, fg->graph);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot create buffer source\n");
         goto end;
     }
 
     /* buffer video sink: to terminate the filtergraph. */
-    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-                                       NULL, NULL, filter_graph);
+    ret = avfilter_graph_create_filter(&fg->buffersink_ctx, buffersink, "out",
+                                       NULL, NULL, fg->graph);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
         goto end;
     }
 
-    ret = av_opt_set_int_list(buffersink_ctx, "pix_fmts", pix_fmts,
+    ret = av_opt_set_int_list(fg->buffersink_ctx, "pix_fmts", pix_fmts,
                               AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
@@ -152,74 +1045,53 @@ static int init_filters(int input_width, int input_height)
 
     /* Set the endpoints for the filtergraph. */
     outputs->name       = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx;
+    outputs->filter_ctx = fg->buffersrc_ctx;
     outputs->pad_idx    = 0;
     outputs->next       = NULL;
 
     inputs->name       = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
+    inputs->filter_ctx = fg->buffersink_ctx;
     inputs->pad_idx    = 0;
     inputs->next       = NULL;
 
-    // --- DYNAMIC SCALE CALCULATION ---
-    double video_width = input_width;
-    double video_height = input_height;
-
-    // Account for display aspect ratio if available
-    if (dec_ctx->sample_aspect_ratio.num > 0 && dec_ctx->sample_aspect_ratio.den > 0) {
-        AVRational sar = dec_ctx->sample_aspect_ratio;
-        video_width = video_width * av_q2d(sar);
-    }
-
-    double video_display_aspect_ratio = video_width / video_height;
-    double target_width;
-    double target_height;
-
-    // Adjust for terminal character aspect ratio (characters are typically taller than wide)
-    // This helps the video appear with its correct visual proportions in ASCII characters.
-    double adjusted_aspect_ratio = video_display_aspect_ratio / CHARACTER_ASPECT_RATIO;
-
-    // Prioritize fitting within MAX_ASCII_WIDTH
-    target_width = MAX_ASCII_WIDTH;
-    target_height = round(target_width / adjusted_aspect_ratio);
-
-    // Ensure dimensions are positive and even numbers (many filters prefer even dimensions)
-    if (target_height < 1) target_height = 1;
-    target_width = (double)((int)round(target_width / 2.0) * 2); // Make it even
-    target_height = (double)((int)round(target_height / 2.0) * 2); // Make it even
+    double video_display_aspect_ratio;
+    int target_width, target_height;
 
-    // Ensure we don't end up with 0 dimensions in case of extremely small calculated values
-    if (target_width == 0) target_width = 2;
-    if (target_height == 0) target_height = 2;
+    output_size(fg, &target_width, &target_height, &video_display_aspect_ratio);
 
-    char filters_descr[128]; // Buffer for the generated filter string
+    char filters_descr[256]; // Buffer for the generated filter string
 
-    // Generate the filter string: "scale=W:H,format=gray"
-    snprintf(filters_descr, sizeof(filters_descr), "scale=%d:%d,format=gray",
-             (int)target_width, (int)target_height);
+    // Generate the filter string: "crop@view=W:H:X:Y,scale@view=W:H,format=gray".
+    // Zoom and pan retarget the named filters, see view_apply().
+    view_rect(in, fg, fg->view);
+    snprintf(filters_descr, sizeof(filters_descr), "crop@view=%d:%d:%d:%d,scale@view=%d:%d,format=%s",
+             fg->view[2], fg->view[3], fg->view[0], fg->view[1],
+             target_width * renderer->cell_w, target_height * renderer->cell_h,
+             av_get_pix_fmt_name(pix_fmts[0]));
 
-    av_log(NULL, AV_LOG_INFO, "Input video resolution: %dx%d (Pixel Aspect Ratio: %d:%d, Display Aspect Ratio: %f)\n",
-           input_width, input_height,
-           dec_ctx->sample_aspect_ratio.num, dec_ctx->sample_aspect_ratio.den,
+    av_log(NULL, AV_LOG_INFO, "Input video resolution: %dx%d %s (Pixel Aspect Ratio: %d:%d, Display Aspect Ratio: %f)\n",
+           input_width, input_height, av_get_pix_fmt_name(fg->format),
+           fg->sar.num, fg->sar.den,
            video_display_aspect_ratio);
     av_log(NULL, AV_LOG_INFO, "Terminal character aspect ratio compensation: %f\n", CHARACTER_ASPECT_RATIO);
     av_log(NULL, AV_LOG_INFO, "Applying filter: \"%s\"\n", filters_descr);
     av_log(NULL, AV_LOG_INFO, "Output ASCII dimensions (characters): %dx%d\n",
-           (int)target_width, (int)target_height);
+           target_width, target_height);
 
 
-    ret = avfilter_graph_parse_ptr(filter_graph, filters_descr,
+    ret = avfilter_graph_parse_ptr(fg->graph, filters_descr,
                                    &inputs, &outputs, NULL);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot parse graph description: %s\n", av_err2str(ret));
         goto end;
     }
 
-    ret = avfilter_graph_config(filter_graph, NULL);
+    ret = avfilter_graph_config(fg->graph, NULL);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Cannot configure filter graph: %s\n", av_err2str(ret));
         goto end;
     }
+    fg->time_base = av_buffersink_get_time_base(fg->buffersink_ctx);
 
 end:
     avfilter_inout_free(&outputs);
@@ -227,33 +1099,5811 @@ end:
     return ret;
 }
 
-static void display_frame(const AVFrame *frame, AVRational time_base)
+static void free_filter_graph(FilterGraph *fg)
 {
-    int x, y;
-    uint8_t *p0, *p;
-
-    /* Trivial ASCII grayscale display. */
-    p0 = frame->data[0];
-    printf("\033[H"); // Move cursor to top-left (1;1)
-    for (y = 0; y < frame->height; y++) {
-        p = p0;
-        for (x = 0; x < frame->width; x++)
-            putchar(" .-+#"[*(p++) / 52]); // Use 5 shades of gray (0-51, 52-103, etc.)
-        putchar('\n');
-        p0 += frame->linesize[0];
-    }
-    fflush(stdout); // Ensure the output is immediately displayed
+    avfilter_graph_free(&fg->graph);
+    luma_free(&fg->luma);
+    memset(fg, 0, sizeof(*fg));
 }
 
-int main(int argc, char **argv)
+static int build_filter_graph(InputFile *in, FilterGraph *fg)
 {
+    enum ThreadRole role = thread_role;
     int ret;
+
+    thread_enter(ROLE_FILTER); // For the graph's worker threads to inherit
+    ret = init_filters(in, fg);
+    thread_enter(role);
+    return ret;
+}
+
+/*
+ * Bring fg's crop in line with the view, right before a frame goes in.
+ * The running graph is retargeted with commands: crop takes the new
+ * rectangle, and when its size changed scale is given its (unchanged)
+ * width again, which makes it set up for the new input size. Only if the
+ * filters refuse is the graph rebuilt.
+ */
+static int view_apply(InputFile *in, FilterGraph *fg)
+{
+    static const char *const crop_cmds[4] = { "x", "y", "w", "h" };
+    char arg[16];
+    int rect[4], cols, rows, i, ret = 0;
+    double aspect;
+
+    view_rect(in, fg, rect);
+    if (!memcmp(rect, fg->view, sizeof(rect)))
+        return 0;
+    if (fg->luma) {
+        luma_set_view(fg->luma, rect);
+        memcpy(fg->view, rect, sizeof(rect));
+        return 0;
+    }
+
+    for (i = 0; i < 4 && ret >= 0; i++) {
+        snprintf(arg, sizeof(arg), "%d", rect[i]);
+        ret = avfilter_graph_send_command(fg->graph, "crop@view", crop_cmds[i], arg, NULL, 0, 0);
+    }
+    if (ret >= 0 && (rect[2] != fg->view[2] || rect[3] != fg->view[3])) {
+        output_size(fg, &cols, &rows, &aspect);
+        snprintf(arg, sizeof(arg), "%d", cols * fg->renderer->cell_w);
+        ret = avfilter_graph_send_command(fg->graph, "scale@view", "w", arg, NULL, 0, 0);
+    }
+    if (ret >= 0) {
+        memcpy(fg->view, rect, sizeof(rect));
+        return 0;
+    }
+
+    av_log(NULL, AV_LOG_WARNING, "Cannot change the crop of a running filtergraph (%s), rebuilding it\n",
+           av_err2str(ret));
+    avfilter_graph_free(&fg->graph);
+    return build_filter_graph(in, fg);
+}
+
+/*
+ * Find or build the filtergraph for a decoded frame. A frame whose size,
+ * format or aspect ratio differs from the current graph's switches to a
+ * cached graph if there is one, otherwise the least recently used entry is
+ * replaced. Returns 1 if in->graph changed.
+ */
+static int get_filter_graph(InputFile *in, const AVFrame *frame)
+{
+    AVStream *st = in->fmt_ctx->streams[in->video_stream_index];
+    AVRational sar = av_guess_sample_aspect_ratio(in->fmt_ctx, st, (AVFrame *)frame);
+    FilterGraph *fg = NULL;
+    int i, ret;
+
+    for (i = 0; i < FILTER_CACHE_SIZE; i++) {
+        FilterGraph *e = &in->graphs[i];
+        if ((e->graph || e->luma) && e->width == frame->width && e->height == frame->height &&
+            e->format == frame->format && !av_cmp_q(e->sar, sar) &&
+            e->renderer == in->renderer && e->ascii_width == in->ascii_width) {
+            fg = e;
+            break;
+        }
+    }
+
+    if (!fg) {
+        // Free slot, or the least recently used one
+        fg = &in->graphs[0];
+        for (i = 0; i < FILTER_CACHE_SIZE && (fg->graph || fg->luma); i++)
+            if (!(in->graphs[i].graph || in->graphs[i].luma) || in->graphs[i].last_used < fg->last_used)
+                fg = &in->graphs[i];
+        if (in->graph)
+            av_log(NULL, AV_LOG_INFO, "Stream changed to %dx%d %s, building a new filtergraph\n",
+                   frame->width, frame->height, av_get_pix_fmt_name(frame->format));
+        free_filter_graph(fg);
+        fg->width = frame->width;
+        fg->height = frame->height;
+        fg->format = frame->format;
+        fg->sar = sar;
+        fg->renderer = in->renderer;
+        fg->ascii_width = in->ascii_width;
+        ret = luma_direct(fg) ? luma_init(in, fg, frame) : build_filter_graph(in, fg);
+        if (ret < 0) {
+            free_filter_graph(fg);
+            return ret;
+        }
+    } else if ((ret = view_apply(in, fg)) < 0) {
+        free_filter_graph(fg);
+        return ret;
+    }
+
+    fg->last_used = ++in->graph_clock;
+    if (fg == in->graph)
+        return 0;
+    in->graph = fg;
+    return 1;
+}
+
+/*
+ * Pull the next decoded frame out of in, reading as many packets as the
+ * decoder needs. Once the demuxer is exhausted the decoder is drained, so
+ * AVERROR_EOF is only returned after the last buffered frame.
+ */
+static int decode_next_frame(InputFile *in, AVPacket *packet, AVFrame *frame)
+{
+    int64_t t0 = now_ns();
+    int ret;
+
+    while (1) {
+        ret = avcodec_receive_frame(in->dec_ctx, frame);
+        if (ret >= 0) {
+            frame->pts = frame->best_effort_timestamp;
+            metric_add(&thread_metrics->frames_decoded, 1);
+            metric_time(STAGE_DECODE, now_ns() - t0);
+            return 0;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            if (ret != AVERROR_EOF)
+                av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder: %s\n", av_err2str(ret));
+            return ret;
+        }
+
+        ret = av_read_frame(in->fmt_ctx, packet);
+        if (in->fmt_ctx->pb) {
+            metric_add(&thread_metrics->bytes_demuxed, in->fmt_ctx->pb->bytes_read - in->bytes_read);
+            in->bytes_read = in->fmt_ctx->pb->bytes_read;
+        }
+        if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                av_log(NULL, AV_LOG_ERROR, "Error reading frame from input: %s\n", av_err2str(ret));
+            // Enter draining mode to get the frames still buffered in the decoder
+            in->eof = 1;
+            if ((ret = avcodec_send_packet(in->dec_ctx, NULL)) < 0)
+                return ret;
+            continue;
+        }
+
+        if (packet->stream_index == in->video_stream_index) {
+            metric_add(&thread_metrics->bytes_used, packet->size);
+            ret = avcodec_send_packet(in->dec_ctx, packet);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder: %s\n", av_err2str(ret));
+                // Corrupt packets are skipped, anything else is fatal
+                if (ret != AVERROR_INVALIDDATA) {
+                    av_packet_unref(packet);
+                    return ret;
+                }
+            }
+        }
+        av_packet_unref(packet);
+    }
+}
+
+/*
+ * With --preroll the playing item is decoded ahead on its own thread, up
+ * to --preroll seconds of frames or --preroll-max bytes of them, whichever
+ * comes first. A frame that takes several frame intervals to decode, like
+ * a big keyframe, then eats into the queue instead of stalling playback.
+ * Filtering stays on the main thread, where resize and renderer commands
+ * change the graphs. After a start or a seek the clock only starts once
+ * the queue is full.
+ */
+static void queued_frame_cost(const DecodeQueue *q, const AVFrame *f, int64_t *duration, int64_t *bytes)
+{
+    int i;
+
+    *duration = f->duration > 0 ?
+                av_rescale_q(f->duration, q->in->fmt_ctx->streams[q->in->video_stream_index]->time_base,
+                             AV_TIME_BASE_Q) : q->frame_duration;
+    for (*bytes = 0, i = 0; i < AV_NUM_DATA_POINTERS && f->buf[i]; i++)
+        *bytes += f->buf[i]->size;
+}
+
+/* Publish the queue's fill for --metrics. Called with the lock held. */
+static void decoder_publish(DecodeQueue *q)
+{
+    atomic_store_explicit(&q->metric_count, q->count, memory_order_relaxed);
+    atomic_store_explicit(&q->metric_duration, q->duration, memory_order_relaxed);
+    atomic_store_explicit(&q->metric_bytes, q->bytes, memory_order_relaxed);
+}
+
+static int decoder_full(const DecodeQueue *q)
+{
+    return q->count == DECODE_QUEUE_SIZE ||
+           (q->count && (q->duration >= preroll * AV_TIME_BASE || q->bytes >= preroll_max));
+}
+
+static void *decoder_thread(void *arg)
+{
+    DecodeQueue *q = arg;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = NULL;
+    int64_t duration, bytes;
+    int ret = 0, stop;
+
+    thread_metrics = &q->metrics;
+    thread_enter(ROLE_DECODE);
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        while (!q->stop && decoder_full(q))
+            pthread_cond_wait(&q->cond, &q->lock);
+        stop = q->stop;
+        pthread_mutex_unlock(&q->lock);
+        if (stop)
+            break;
+
+        if (!packet || !(frame = av_frame_alloc())) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        if ((ret = decode_next_frame(q->in, packet, frame)) < 0)
+            break;
+        queued_frame_cost(q, frame, &duration, &bytes);
+
+        pthread_mutex_lock(&q->lock);
+        q->frames[(q->first + q->count++) % DECODE_QUEUE_SIZE] = frame;
+        q->duration += duration;
+        q->bytes += bytes;
+        decoder_publish(q);
+        frame = NULL;
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+
+    pthread_mutex_lock(&q->lock);
+    q->ret = ret;
+    q->done = 1;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static int decoder_start(InputFile *in, AVRational frame_rate)
+{
+    DecodeQueue *q = &decoder;
+    int ret;
+
+    q->in = in;
+    q->frame_duration = frame_rate.num > 0 && frame_rate.den > 0 ?
+                        av_rescale_q(1, av_inv_q(frame_rate), AV_TIME_BASE_Q) : AV_TIME_BASE / 25;
+    q->done = q->stop = q->ret = 0;
+    if ((ret = pthread_create(&q->thread, NULL, decoder_thread, q))) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot start the decoder thread\n");
+        return AVERROR(ret);
+    }
+    q->running = 1;
+    return 0;
+}
+
+/* Stop the thread and drop whatever it decoded, before a seek or closing the item. */
+static void decoder_stop(void)
+{
+    DecodeQueue *q = &decoder;
+
+    if (!q->running)
+        return;
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    q->running = 0;
+    while (q->count) {
+        av_frame_free(&q->frames[q->first]);
+        q->first = (q->first + 1) % DECODE_QUEUE_SIZE;
+        q->count--;
+    }
+    q->first = 0;
+    q->duration = q->bytes = 0;
+    decoder_publish(q);
+}
+
+/* Wait until the queue is full, or the item too short to fill it. */
+static void decoder_prime(void)
+{
+    DecodeQueue *q = &decoder;
+    int64_t t0 = now_ns();
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->done && !decoder_full(q))
+        pthread_cond_wait(&q->cond, &q->lock);
+    pthread_mutex_unlock(&q->lock);
+    stats.preroll_ns += now_ns() - t0;
+}
+
+/* The next frame from the queue, like decode_next_frame(). */
+static int decoder_get(AVFrame *frame)
+{
+    DecodeQueue *q = &decoder;
+    AVFrame *f;
+    int64_t t0 = 0, duration, bytes;
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    stats.queue_fill += q->count;
+    stats.queue_gets++;
+    if (!q->count && !q->done) {
+        // Underrun: decoding fell behind playback
+        stats.underruns++;
+        t0 = now_ns();
+        while (!q->count && !q->done)
+            pthread_cond_wait(&q->cond, &q->lock);
+        stats.underrun_ns += now_ns() - t0;
+    }
+    if (q->count) {
+        f = q->frames[q->first];
+        q->first = (q->first + 1) % DECODE_QUEUE_SIZE;
+        q->count--;
+        queued_frame_cost(q, f, &duration, &bytes);
+        q->duration -= duration;
+        q->bytes -= bytes;
+        decoder_publish(q);
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+        av_frame_move_ref(frame, f);
+        av_frame_free(&f);
+        return 0;
+    }
+    ret = q->ret;
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+static void close_input_file(InputFile *in)
+{
+    int i;
+
+    for (i = 0; i < FILTER_CACHE_SIZE; i++)
+        free_filter_graph(&in->graphs[i]);
+    avcodec_free_context(&in->dec_ctx);
+    avformat_close_input(&in->fmt_ctx);
+    av_frame_free(&in->first_frame);
+    av_free(in->filename);
+    av_free(in);
+}
+
+/* Open the item and decode up to its first frame, so that the switch to it is free. */
+static void *prefetch_thread(void *arg)
+{
+    Prefetch *pf = arg;
+    InputFile *in = pf->in;
+    AVPacket *packet = av_packet_alloc();
+    int ret;
+
+    thread_metrics = &pf->metrics;
+    thread_enter(ROLE_DECODE); // Before avcodec_open2() starts the decoder's threads
+
+    in->first_frame = av_frame_alloc();
+    if (!packet || !in->first_frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = open_input_file(in)) < 0)
+        goto end;
+    if ((ret = decode_next_frame(in, packet, in->first_frame)) < 0)
+        goto end;
+    // The graph is built from what the decoder actually produced
+    ret = get_filter_graph(in, in->first_frame);
+
+end:
+    av_packet_free(&packet);
+    pf->ret = ret;
+    atomic_store(&pf->done, 1);
+    return NULL;
+}
+
+static int prefetch_start(Prefetch *pf, const char *filename)
+{
+    int ret;
+
+    pf->in = av_mallocz(sizeof(*pf->in));
+    if (!pf->in || !(pf->in->filename = av_strdup(filename))) {
+        av_freep(&pf->in);
+        return AVERROR(ENOMEM);
+    }
+    pf->in->video_stream_index = -1;
+    pf->in->seek_pts = AV_NOPTS_VALUE;
+    pf->in->renderer = render_ctx->renderer;
+    pf->in->ascii_width = ascii_width;
+    pf->replace = 0;
+    atomic_store(&pf->done, 0);
+
+    if ((ret = pthread_create(&pf->thread, NULL, prefetch_thread, pf)) != 0) {
+        av_free(pf->in->filename);
+        av_freep(&pf->in);
+        return AVERROR(ret);
+    }
+    pf->running = 1;
+    return 0;
+}
+
+/* Whether prefetch_finish() would return without blocking. */
+static int prefetch_done(Prefetch *pf)
+{
+    return pf->running && atomic_load(&pf->done);
+}
+
+/* Wait for the prefetch to finish and take over its input, NULL if it failed. */
+static InputFile *prefetch_finish(Prefetch *pf)
+{
+    InputFile *in = pf->in;
+
+    if (!pf->running)
+        return NULL;
+    pthread_join(pf->thread, NULL);
+    pf->running = 0;
+    pf->in = NULL;
+    if (pf->ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Skipping %s: %s\n", in->filename, av_err2str(pf->ret));
+        close_input_file(in);
+        return NULL;
+    }
+    return in;
+}
+
+/* Park the decoder of a finished item so the next prefetch may reuse it. */
+static void retire_input_file(InputFile *in)
+{
+    avcodec_free_context(&spare_dec_ctx);
+    avcodec_flush_buffers(in->dec_ctx);
+    spare_dec_ctx = in->dec_ctx;
+    in->dec_ctx = NULL;
+    close_input_file(in);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int ob_reserve(OutBuf *ob, size_t n)
+{
+    if (ob->error)
+        return AVERROR(ENOMEM);
+    if (ob->len + n > ob->size) {
+        size_t size = FFMAX(ob->size * 2, ob->len + n + 4096);
+        // A frame outgrowing a splice buffer continues on the heap
+        uint8_t *data = ob->spliced ? av_malloc(size) : av_realloc(ob->data, size);
+        if (!data) {
+            ob->error = 1;
+            return AVERROR(ENOMEM);
+        }
+        if (ob->spliced)
+            memcpy(data, ob->data, ob->len);
+        ob->data = data;
+        ob->size = size;
+        ob->spliced = 0;
+    }
+    return 0;
+}
+
+static void ob_write(OutBuf *ob, const void *p, size_t n)
+{
+    if (ob_reserve(ob, n) < 0)
+        return;
+    memcpy(ob->data + ob->len, p, n);
+    ob->len += n;
+}
+
+static void ob_putc(OutBuf *ob, int c)
+{
+    if (ob_reserve(ob, 1) < 0)
+        return;
+    ob->data[ob->len++] = c;
+}
+
+static void ob_puts(OutBuf *ob, const char *s)
+{
+    ob_write(ob, s, strlen(s));
+}
+
+static void ob_printf(OutBuf *ob, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (ob_reserve(ob, 64) < 0)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf((char *)ob->data + ob->len, ob->size - ob->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= ob->size - ob->len) {
+        if (ob_reserve(ob, n + 1) < 0)
+            return;
+        va_start(ap, fmt);
+        vsnprintf((char *)ob->data + ob->len, ob->size - ob->len, fmt, ap);
+        va_end(ap);
+    }
+    ob->len += n;
+}
+
+/*
+ * Zero-copy output. When stdout is a pipe (to a recorder, tee or ssh),
+ * frames are assembled right in one of two page-aligned buffers and handed
+ * to the pipe with vmsplice(SPLICE_F_GIFT) instead of being copied by
+ * write(). The pages then belong to the pipe, and to whoever the reader
+ * splices them on to: a gifted buffer is unmapped and replaced by a fresh
+ * mapping, never written into again. When no buffer is mapped, or a frame
+ * doesn't fit, the frame goes through a heap buffer and write().
+ */
+#define SPLICE_BUFFER_SIZE (4 << 20) // Each, only the pages touched take memory
+
+typedef struct SpliceOut {
+    int fd;               // -1 unless stdout is a pipe
+    uint8_t *buf[2];      // NULL where a fresh mapping failed
+    int cur;              // out is filling buf[cur] when out.spliced is set
+} SpliceOut;
+
+static SpliceOut splice_out = { .fd = -1 };
+static int no_vmsplice;
+
+static uint8_t *splice_map(void)
+{
+    uint8_t *buf = mmap(NULL, SPLICE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return buf == MAP_FAILED ? NULL : buf;
+}
+
+/* Hand out the next mapped buffer, or the heap if there is none. */
+static void splice_next(OutBuf *ob)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        int b = (splice_out.cur + 1 + i) % 2;
+        if (!splice_out.buf[b])
+            continue;
+        if (!ob->spliced)
+            av_freep(&ob->data);
+        ob->data = splice_out.buf[b];
+        ob->size = SPLICE_BUFFER_SIZE;
+        ob->spliced = 1;
+        splice_out.cur = b;
+        return;
+    }
+    if (ob->spliced) {
+        ob->data = NULL;
+        ob->size = 0;
+        ob->spliced = 0;
+    }
+}
+
+static void splice_write(OutBuf *ob)
+{
+    struct iovec iov = { ob->data, ob->len };
+    ssize_t ret;
+    int gifted = 0;
+
+    // Whatever went through stdio first
+    fflush(stdout);
+    stats.splice_copied += !ob->spliced;
+    while (ob->spliced && iov.iov_len) {
+        if ((ret = vmsplice(splice_out.fd, &iov, 1, SPLICE_F_GIFT)) < 0) {
+            if (errno == EINTR)
+                continue;
+            av_log(NULL, AV_LOG_WARNING, "vmsplice failed, writing to the pipe instead: %s\n", strerror(errno));
+            break;
+        }
+        iov.iov_base = (uint8_t *)iov.iov_base + ret;
+        iov.iov_len -= ret;
+        stats.bytes_spliced += ret;
+        gifted = 1;
+    }
+    while (iov.iov_len) {
+        if ((ret = write(splice_out.fd, iov.iov_base, iov.iov_len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        iov.iov_base = (uint8_t *)iov.iov_base + ret;
+        iov.iov_len -= ret;
+    }
+    // The pipe keeps the gifted pages, the next frame gets new ones
+    if (gifted) {
+        munmap(splice_out.buf[splice_out.cur], SPLICE_BUFFER_SIZE);
+        splice_out.buf[splice_out.cur] = splice_map();
+        ob->data = NULL;
+        ob->size = 0;
+        ob->spliced = 0;
+    }
+}
+
+static void splice_open(void)
+{
+    struct stat st;
+    int i;
+
+    if (no_vmsplice || fstat(STDOUT_FILENO, &st) < 0 || !S_ISFIFO(st.st_mode))
+        return;
+    for (i = 0; i < 2; i++) {
+        if (!(splice_out.buf[i] = splice_map())) {
+            if (i)
+                munmap(splice_out.buf[0], SPLICE_BUFFER_SIZE);
+            splice_out.buf[0] = NULL;
+            return;
+        }
+    }
+    splice_out.fd = STDOUT_FILENO;
+    splice_out.cur = 1;
+    splice_next(&out);
+}
+
+/* The pipe may still refer to the buffers, unmapping leaves that intact. */
+static void splice_close(void)
+{
+    int i;
+
+    if (out.spliced) {
+        out.data = NULL;
+        out.size = 0;
+        out.spliced = 0;
+    }
+    for (i = 0; i < 2; i++)
+        if (splice_out.buf[i])
+            munmap(splice_out.buf[i], SPLICE_BUFFER_SIZE);
+    memset(&splice_out, 0, sizeof(splice_out));
+    splice_out.fd = -1;
+}
+
+/* Write the assembled frame to the terminal and reset the buffer. */
+static void ob_flush(OutBuf *ob)
+{
+    if (ob->len) {
+        int64_t t0 = now_ns();
+        if (ob == &out && splice_out.fd >= 0) {
+            splice_write(ob);
+        } else {
+            fwrite(ob->data, 1, ob->len, stdout);
+            fflush(stdout); // Ensure the output is immediately displayed
+        }
+        metric_time(STAGE_WRITE, now_ns() - t0);
+        stats.bytes_written += ob->len;
+    }
+    ob->len = 0;
+    ob->error = 0;
+    if (ob == &out && splice_out.fd >= 0)
+        splice_next(ob);
+}
+
+/*
+ * Palette quantization.
+ *
+ * Colors are looked up through a 3D table with LUT_BITS per channel. The
+ * table is cleared when the palette changes and cells are filled in on first
+ * use, so a new palette costs a memset instead of a full nearest-color search
+ * over every cell. The palette itself comes from a median
+ * cut over a histogram of a pixel subsample, refined with a few k-means
+ * passes, and is only recomputed on a scene cut: a coarse histogram of every
+ * frame is compared with the one the palette was built from.
+ */
+#define LUT_BITS 5
+#define LUT_SIZE (1 << (3 * LUT_BITS))
+#define LUT_INDEX(r, g, b) ((((r) >> (8 - LUT_BITS)) << (2 * LUT_BITS)) | \
+                            (((g) >> (8 - LUT_BITS)) << LUT_BITS) | ((b) >> (8 - LUT_BITS)))
+#define LUT_CENTER(v) (((v) & ~((1 << (8 - LUT_BITS)) - 1)) | 1 << (7 - LUT_BITS))
+#define LUT_EMPTY 0xFFFF
+#define SCENE_BINS 64            // 4x4x4 coarse histogram for cut detection
+#define SCENE_CUT_THRESHOLD 0.5f // L1 distance of normalized histograms, 0..2
+#define QUANT_SAMPLES 16384      // Approximate histogram sample count per frame
+#define KMEANS_PASSES 3
+
+typedef struct Palette {
+    int nb_colors;
+    uint8_t rgb[256][3];
+    uint16_t lut[LUT_SIZE]; // Palette index per cell, LUT_EMPTY until first looked up
+} Palette;
+
+typedef struct ColorBin {
+    uint8_t c[3];   // LUT cell center
+    uint32_t count;
+} ColorBin;
+
+typedef struct ColorBox {
+    int start, end; // Range in the bin array
+    uint64_t count;
+    int axis;       // Widest channel
+    int range;
+} ColorBox;
+
+typedef struct Quantizer {
+    Palette pal;
+    int max_colors;
+    int valid;                 // pal holds a palette built for the current scene
+    int changed;               // Palette was replaced by the last quantize_frame()
+    float ref_scene[SCENE_BINS];
+    uint32_t hist[LUT_SIZE];
+    ColorBin bins[LUT_SIZE];
+    ColorBin sorted[LUT_SIZE];
+    uint8_t *indices;          // Palette index per pixel of the last frame
+    unsigned int indices_size;
+} Quantizer;
+
+
+// xterm's default values for the 16 ANSI colors
+static const uint8_t ansi16_rgb[16][3] = {
+    {   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+    {   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+    { 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+    {  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 },
+};
+
+static void palette_reset_lut(Palette *pal)
+{
+    memset(pal->lut, 0xFF, sizeof(pal->lut));
+}
+
+/* Nearest palette entry for a LUT cell, cached in the table. */
+static int palette_lookup(Palette *pal, int cell)
+{
+    int cr = LUT_CENTER((cell >> (2 * LUT_BITS)) << (8 - LUT_BITS));
+    int cg = LUT_CENTER(((cell >> LUT_BITS) & ((1 << LUT_BITS) - 1)) << (8 - LUT_BITS));
+    int cb = LUT_CENTER((cell & ((1 << LUT_BITS) - 1)) << (8 - LUT_BITS));
+    int i, best = 0, best_dist = INT32_MAX;
+
+    for (i = 0; i < pal->nb_colors; i++) {
+        int dr = cr - pal->rgb[i][0];
+        int dg = cg - pal->rgb[i][1];
+        int db = cb - pal->rgb[i][2];
+        int dist = dr * dr * 2 + dg * dg * 4 + db * db * 3; // Rough perceptual weights
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = i;
+        }
+    }
+    pal->lut[cell] = best;
+    return best;
+}
+
+static inline int palette_map(Palette *pal, int r, int g, int b)
+{
+    int cell = LUT_INDEX(r, g, b);
+    int idx = pal->lut[cell];
+    return idx != LUT_EMPTY ? idx : palette_lookup(pal, cell);
+}
+
+static void color_box_update(ColorBox *box, const ColorBin *bins)
+{
+    int i, c, lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+
+    box->count = 0;
+    for (i = box->start; i < box->end; i++) {
+        for (c = 0; c < 3; c++) {
+            lo[c] = FFMIN(lo[c], bins[i].c[c]);
+            hi[c] = FFMAX(hi[c], bins[i].c[c]);
+        }
+        box->count += bins[i].count;
+    }
+    box->axis = 0;
+    for (c = 1; c < 3; c++)
+        if (hi[c] - lo[c] > hi[box->axis] - lo[box->axis])
+            box->axis = c;
+    box->range = hi[box->axis] - lo[box->axis];
+}
+
+/* Split the box at the weighted median of its widest channel, returns 0 if it can't be split. */
+static int color_box_split(ColorBox *box, ColorBox *new_box, ColorBin *bins, ColorBin *tmp)
+{
+    int pos[(1 << LUT_BITS) + 1] = { 0 };
+    int i, axis = box->axis, shift = 8 - LUT_BITS;
+    uint64_t half, acc = 0;
+
+    if (box->end - box->start < 2)
+        return 0;
+
+    // Counting sort on the channel, bins only hold LUT cell centers
+    for (i = box->start; i < box->end; i++)
+        pos[(bins[i].c[axis] >> shift) + 1]++;
+    for (i = 1; i <= 1 << LUT_BITS; i++)
+        pos[i] += pos[i - 1];
+    for (i = box->start; i < box->end; i++)
+        tmp[pos[bins[i].c[axis] >> shift]++] = bins[i];
+    memcpy(bins + box->start, tmp, (box->end - box->start) * sizeof(*bins));
+
+    half = box->count / 2;
+    for (i = box->start; i < box->end - 1; i++) {
+        acc += bins[i].count;
+        if (acc >= half)
+            break;
+    }
+    new_box->start = i + 1;
+    new_box->end = box->end;
+    box->end = i + 1;
+    color_box_update(box, bins);
+    color_box_update(new_box, bins);
+    return 1;
+}
+
+static void quantizer_build_palette(Quantizer *q, int nb_bins)
+{
+    ColorBox boxes[256];
+    int nb_boxes = 1, i, j, c, pass;
+
+    boxes[0].start = 0;
+    boxes[0].end = nb_bins;
+    color_box_update(&boxes[0], q->bins);
+
+    while (nb_boxes < q->max_colors) {
+        // Split the box with the largest spread weighted by population
+        int best = -1;
+        double best_score = 0;
+        for (i = 0; i < nb_boxes; i++) {
+            double score = (double)boxes[i].range * boxes[i].range * boxes[i].count;
+            if (boxes[i].end - boxes[i].start > 1 && score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+        if (best < 0 || !color_box_split(&boxes[best], &boxes[nb_boxes], q->bins, q->sorted))
+            break;
+        nb_boxes++;
+    }
+
+    q->pal.nb_colors = nb_boxes;
+    for (i = 0; i < nb_boxes; i++) {
+        uint64_t sum[3] = { 0 };
+        for (j = boxes[i].start; j < boxes[i].end; j++)
+            for (c = 0; c < 3; c++)
+                sum[c] += (uint64_t)q->bins[j].c[c] * q->bins[j].count;
+        for (c = 0; c < 3; c++)
+            q->pal.rgb[i][c] = boxes[i].count ? sum[c] / boxes[i].count : 0;
+    }
+
+    // Refine the median cut with a few weighted k-means passes over the bins
+    for (pass = 0; pass < KMEANS_PASSES; pass++) {
+        uint64_t sum[256][3] = { { 0 } }, count[256] = { 0 };
+        for (j = 0; j < nb_bins; j++) {
+            const ColorBin *bin = &q->bins[j];
+            int best = 0, best_dist = INT32_MAX;
+            for (i = 0; i < nb_boxes; i++) {
+                int dr = bin->c[0] - q->pal.rgb[i][0];
+                int dg = bin->c[1] - q->pal.rgb[i][1];
+                int db = bin->c[2] - q->pal.rgb[i][2];
+                int dist = dr * dr * 2 + dg * dg * 4 + db * db * 3;
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = i;
+                }
+            }
+            for (c = 0; c < 3; c++)
+                sum[best][c] += (uint64_t)bin->c[c] * bin->count;
+            count[best] += bin->count;
+        }
+        for (i = 0; i < nb_boxes; i++)
+            if (count[i])
+                for (c = 0; c < 3; c++)
+                    q->pal.rgb[i][c] = sum[i][c] / count[i];
+    }
+
+    palette_reset_lut(&q->pal);
+}
+
+static Quantizer *quantizer_alloc(int max_colors, const uint8_t (*fixed)[3])
+{
+    Quantizer *q = av_mallocz(sizeof(*q));
+
+    if (!q)
+        return NULL;
+    q->max_colors = max_colors;
+    if (fixed) {
+        // Fixed palette: never rebuilt, scene cuts are ignored
+        q->pal.nb_colors = max_colors;
+        memcpy(q->pal.rgb, fixed, max_colors * sizeof(*fixed));
+        palette_reset_lut(&q->pal);
+        q->valid = -1;
+    }
+    return q;
+}
+
+static void quantizer_free(Quantizer **q)
+{
+    if (*q)
+        av_freep(&(*q)->indices);
+    av_freep(q);
+}
+
+/*
+ * Map every pixel of an RGB24 frame to a palette index in q->indices,
+ * rebuilding the palette first if the frame starts a new scene.
+ */
+static int quantize_frame(Quantizer *q, const AVFrame *frame)
+{
+    float scene[SCENE_BINS] = { 0 }, dist = 0;
+    int x, y, i, step, nb_samples = 0, nb_bins = 0;
+    int64_t t0 = now_ns(), t;
+    const uint8_t *p;
+    uint8_t *dst;
+
+    av_fast_malloc(&q->indices, &q->indices_size, (size_t)frame->width * frame->height);
+    if (!q->indices)
+        return AVERROR(ENOMEM);
+
+    // Subsample on a regular grid so large frames stay within the time budget
+    step = FFMAX(1, (int)sqrt((double)frame->width * frame->height / QUANT_SAMPLES));
+    q->changed = 0;
+
+    if (q->valid >= 0) {
+        for (y = 0; y < frame->height; y += step) {
+            p = frame->data[0] + y * frame->linesize[0];
+            for (x = 0; x < frame->width; x += step, p += 3 * step) {
+                scene[(p[0] >> 6) << 4 | (p[1] >> 6) << 2 | p[2] >> 6]++;
+                nb_samples++;
+            }
+        }
+        for (i = 0; i < SCENE_BINS; i++) {
+            scene[i] /= nb_samples;
+            dist += fabsf(scene[i] - q->ref_scene[i]);
+        }
+
+        if (!q->valid || dist > SCENE_CUT_THRESHOLD) {
+            for (y = 0; y < frame->height; y += step) {
+                p = frame->data[0] + y * frame->linesize[0];
+                for (x = 0; x < frame->width; x += step, p += 3 * step) {
+                    int idx = LUT_INDEX(p[0], p[1], p[2]);
+                    if (!q->hist[idx]++) {
+                        q->bins[nb_bins].c[0] = LUT_CENTER(p[0]);
+                        q->bins[nb_bins].c[1] = LUT_CENTER(p[1]);
+                        q->bins[nb_bins].c[2] = LUT_CENTER(p[2]);
+                        nb_bins++;
+                    }
+                }
+            }
+            // Collect the counts and clear only the touched histogram cells
+            for (i = 0; i < nb_bins; i++) {
+                int idx = LUT_INDEX(q->bins[i].c[0], q->bins[i].c[1], q->bins[i].c[2]);
+                q->bins[i].count = q->hist[idx];
+                q->hist[idx] = 0;
+            }
+            quantizer_build_palette(q, nb_bins);
+            memcpy(q->ref_scene, scene, sizeof(scene));
+            q->valid = 1;
+            q->changed = 1;
+            render_stats->palette_changes++;
+        }
+    }
+
+    dst = q->indices;
+    for (y = 0; y < frame->height; y++) {
+        p = frame->data[0] + y * frame->linesize[0];
+        for (x = 0; x < frame->width; x++, p += 3)
+            *dst++ = palette_map(&q->pal, p[0], p[1], p[2]);
+    }
+
+    t = now_ns() - t0;
+    render_stats->quant_ns += t;
+    render_stats->quant_max_ns = FFMAX(render_stats->quant_max_ns, t);
+    return 0;
+}
+
+static const char ascii_ramp[] = " .-+#"; // 5 shades of gray (0-51, 52-103, etc.)
+
+/*
+ * Thresholds for --dither: the ranks of a 16x16 void-and-cluster blue noise
+ * pattern. Neighbouring thresholds are far apart, so a dithered area looks
+ * like fine grain instead of the cross-hatch of a Bayer matrix.
+ */
+static const uint8_t blue_noise[16][16] = {
+    { 234,  50, 188,  19,  58, 171, 121,  47, 163,   0, 247, 104,  22, 132,  14,  65 },
+    { 209,   8, 118,  97, 240, 205,  23, 228, 138,  64, 123, 170,  72, 224,  99, 149 },
+    { 85, 139, 229, 165,  78, 146, 111,  84, 176, 216,  30, 231, 153, 201,  42, 180 },
+    { 25,  62, 195,  29,  43, 185,   7, 249,  41, 100, 191,  48,  87,   5, 128, 243 },
+    { 221, 152, 101, 253, 130, 220,  59, 200, 156,  12, 136, 112, 255, 174,  69, 109 },
+    { 46, 189,   1,  73, 172,  90, 142, 116,  80, 237, 210,  61, 147,  33, 206, 160 },
+    { 81, 124, 217, 113, 208,  15, 241,  27, 168,  45, 178,  20, 193,  96, 225,  18 },
+    { 242, 164,  60,  35, 157,  53, 181,  68, 223, 105, 125,  83, 236, 131,  55, 141 },
+    { 197,  10, 227, 134, 246,  95, 126, 198, 148,   2, 244, 161,  71,   9, 182, 106 },
+    { 40,  93, 179,  75, 192,   6, 218,  36,  91,  57, 202,  34, 215, 155, 233,  74 },
+    { 252, 120, 150,  24, 110,  63, 166, 119, 232, 183, 133, 103,  49, 117,  31, 167 },
+    { 16, 212,  51, 238, 207, 137, 254,  21,  76, 151,  13, 250, 190,  88, 203, 135 },
+    { 102, 184,  82, 169,  38,  89, 187,  52, 204,  98, 173,  67, 129,   4, 222,  56 },
+    { 230, 144,   3, 127, 226,  11, 154, 114, 239,  39, 219,  28, 235, 145, 175,  77 },
+    { 196,  37, 248,  70, 107, 199,  66, 177,  17, 143, 115, 159,  86,  44, 108,  26 },
+    { 122,  92, 158, 214, 140,  32, 245,  94, 213,  79, 194,  54, 211, 186, 251, 162 },
+};
+
+/* Switch foreground and/or background to a palette slot, -1 leaves one alone. */
+static void put_sgr_index(OutBuf *ob, int fg, int bg)
+{
+    if (fg >= 0 && bg >= 0)
+        ob_printf(ob, "\033[%d;%dm", fg < 8 ? 30 + fg : 90 + fg - 8, bg < 8 ? 40 + bg : 100 + bg - 8);
+    else if (fg >= 0)
+        ob_printf(ob, "\033[%dm", fg < 8 ? 30 + fg : 90 + fg - 8);
+    else if (bg >= 0)
+        ob_printf(ob, "\033[%dm", bg < 8 ? 40 + bg : 100 + bg - 8);
+}
+
+// Decimal 0..255 without going through printf, colors are on the hot path
+static void ob_put_u8(OutBuf *ob, int v)
+{
+    if (v >= 100)
+        ob_putc(ob, '0' + v / 100);
+    if (v >= 10)
+        ob_putc(ob, '0' + v / 10 % 10);
+    ob_putc(ob, '0' + v % 10);
+}
+
+/* Truecolor SGR for the given foreground and/or background, NULL to leave one alone. */
+static void put_sgr_rgb(OutBuf *ob, const uint8_t *fg, const uint8_t *bg)
+{
+    int c;
+
+    ob_puts(ob, "\033[");
+    if (fg) {
+        ob_puts(ob, "38;2");
+        for (c = 0; c < 3; c++) {
+            ob_putc(ob, ';');
+            ob_put_u8(ob, fg[c]);
+        }
+    }
+    if (bg) {
+        ob_puts(ob, fg ? ";48;2" : "48;2");
+        for (c = 0; c < 3; c++) {
+            ob_putc(ob, ';');
+            ob_put_u8(ob, bg[c]);
+        }
+    }
+    ob_putc(ob, 'm');
+}
+
+/* Cursor to the start of cell row y, for renderers drawing only some rows. */
+static void put_row_start(OutBuf *ob, int y)
+{
+    ob_printf(ob, "\033[%dH", y + 1);
+}
+
+static void ob_put_utf8(OutBuf *ob, uint32_t c)
+{
+    if (c < 0x80) {
+        ob_putc(ob, c);
+    } else if (c < 0x800) {
+        ob_putc(ob, 0xC0 | c >> 6);
+        ob_putc(ob, 0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        ob_putc(ob, 0xE0 | c >> 12);
+        ob_putc(ob, 0x80 | ((c >> 6) & 0x3F));
+        ob_putc(ob, 0x80 | (c & 0x3F));
+    } else {
+        ob_putc(ob, 0xF0 | c >> 18);
+        ob_putc(ob, 0x80 | ((c >> 12) & 0x3F));
+        ob_putc(ob, 0x80 | ((c >> 6) & 0x3F));
+        ob_putc(ob, 0x80 | (c & 0x3F));
+    }
+}
+
+/* Load a freshly fitted scene palette into the terminal's 16 color slots. */
+static void put_scene_palette(OutBuf *ob, const Quantizer *q)
+{
+    int i;
+
+    if (color_mode != COLOR_ADAPTIVE16 || !q->changed)
+        return;
+    for (i = 0; i < q->pal.nb_colors; i++)
+        ob_printf(ob, "\033]4;%d;rgb:%02x/%02x/%02x\033\\", i,
+                  q->pal.rgb[i][0], q->pal.rgb[i][1], q->pal.rgb[i][2]);
+}
+
+/* The 16 color modes share one quantizer setup. */
+static int color_quantizer_init(Quantizer **q)
+{
+    if (color_mode != COLOR_ANSI16 && color_mode != COLOR_ADAPTIVE16)
+        return 0;
+    *q = quantizer_alloc(16, color_mode == COLOR_ANSI16 ? ansi16_rgb : NULL);
+    return *q ? 0 : AVERROR(ENOMEM);
+}
+
+/* ASCII ramp: one pixel per cell, glyph from luma. */
+typedef struct RampContext {
+    Quantizer *quant;
+    uint8_t *levels;      // Ramp index on screen per cell, 0xFF if unknown
+    uint8_t *committed;   // Luma that chose each of those
+    uint8_t *luma;        // One row, color modes
+    uint32_t *yuv_lut;    // See ramp_build_yuv_lut()
+    enum AVColorSpace lut_space;
+    enum AVColorRange lut_range;
+    unsigned frame;
+} RampContext;
+
+static enum AVPixelFormat ramp_pix_fmt(void)
+{
+    if (color_mode == COLOR_NONE)
+        return AV_PIX_FMT_GRAY8;
+    // Cell colors straight from averaged Y, U and V, see luma_direct()
+    if (color_mode == COLOR_ANSI256 || color_mode == COLOR_TRUECOLOR)
+        return AV_PIX_FMT_YUV444P;
+    return AV_PIX_FMT_RGB24;
+}
+
+static int ramp_resize(RenderContext *rc)
+{
+    RampContext *s = rc->priv_data;
+
+    av_freep(&s->levels);
+    av_freep(&s->committed);
+    av_freep(&s->luma);
+    if (!(s->levels = av_malloc_array(rc->rows, rc->cols)) ||
+        !(s->committed = av_malloc_array(rc->rows, rc->cols)) || !(s->luma = av_malloc(rc->cols)))
+        return AVERROR(ENOMEM);
+    memset(s->levels, 0xFF, (size_t)rc->rows * rc->cols);
+    return 0;
+}
+
+static int ramp_init(RenderContext *rc)
+{
+    RampContext *s = rc->priv_data;
+    int ret;
+
+    if ((ret = color_quantizer_init(&s->quant)) < 0)
+        return ret;
+    return ramp_resize(rc);
+}
+
+/*
+ * Turn row y of luma into ramp indices in place of the previous ones and
+ * return how many changed. Dithered, a value between two shades takes
+ * the upper one where it is above the noise threshold, but a cell keeps
+ * its previous shade while that is still one of the two. Otherwise every
+ * frame of noisy video (or moving noise) would flip cells back and forth.
+ *
+ * With --hysteresis a cell isn't even looked at again until its luma is
+ * more than the margin away from the value its shade was chosen for, which
+ * catches compression noise on values right at a shade boundary.
+ */
+static int ramp_row(const RampContext *s, const uint8_t *luma, int width, int y, int *held)
+{
+    uint8_t *levels = s->levels + y * width, *committed = s->committed + y * width;
+    const uint8_t *noise = blue_noise[y & 15];
+    int x, v, level, changed = 0;
+    // Golden ratio steps through the thresholds, so each frame's pattern differs most from the last
+    int offset = dither == DITHER_TEMPORAL ? (s->frame * 159) & 255 : 0;
+
+    for (x = 0; x < width; x++) {
+        if (dither == DITHER_NONE) {
+            level = luma[x] / 52;
+        } else {
+            v = luma[x] * 1028 >> 8; // 0..1024, 256 per shade
+            level = levels[x];
+            if (level != v >> 8 && level != (v + 255) >> 8)
+                level = FFMIN((v + ((noise[x & 15] + offset) & 255)) >> 8, 4);
+        }
+        if (hysteresis && levels[x] != 0xFF && FFABS(luma[x] - committed[x]) <= hysteresis) {
+            *held += level != levels[x];
+            continue;
+        }
+        committed[x] = luma[x];
+        changed += level != levels[x];
+        levels[x] = level;
+    }
+    return changed;
+}
+
+/* The terminal scrolled the picture, move what we know about the cells along. */
+static void ramp_scroll(RenderContext *rc)
+{
+    RampContext *s = rc->priv_data;
+    uint8_t *planes[] = { s->levels, s->committed };
+    int n = FFABS(rc->shift), w = rc->cols, i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(planes); i++) {
+        if (rc->shift > 0)
+            memmove(planes[i], planes[i] + n * w, (size_t)(rc->rows - n) * w);
+        else
+            memmove(planes[i] + n * w, planes[i], (size_t)(rc->rows - n) * w);
+    }
+    memset(s->levels + (rc->shift > 0 ? rc->rows - n : 0) * w, 0xFF, (size_t)n * w);
+}
+
+/*
+ * The ansi256 and truecolor modes look a cell's Y, U and V up in a table
+ * holding the xterm palette index or 0xRRGGBB for the frame's matrix and
+ * range. 6 bits of Y and 5 of U and V are plenty for one color per cell;
+ * the bins are centered on their values, so that neutral gray stays gray.
+ */
+#define YUV_LUT_INDEX(y, u, v) ((((y) + 2) >> 2) * 33 * 33 + (((u) + 4) >> 3) * 33 + (((v) + 4) >> 3))
+
+/* Nearest color of the 6x6x6 cube or the gray ramp of the 256 color palette. */
+static int xterm256_nearest(const int rgb[3])
+{
+    static const uint8_t cube[6] = { 0, 95, 135, 175, 215, 255 };
+    int level[3], gray, c, d, dist_cube = 0, dist_gray = 0;
+
+    gray = av_clip(((rgb[0] + rgb[1] + rgb[2]) / 3 - 3) / 10, 0, 23);
+    for (c = 0; c < 3; c++) {
+        level[c] = rgb[c] < 48 ? 0 : rgb[c] < 115 ? 1 : (rgb[c] - 35) / 40;
+        d = rgb[c] - cube[level[c]];
+        dist_cube += d * d;
+        d = rgb[c] - (8 + 10 * gray);
+        dist_gray += d * d;
+    }
+    return dist_gray < dist_cube ? 232 + gray : 16 + 36 * level[0] + 6 * level[1] + level[2];
+}
+
+static int ramp_build_yuv_lut(RampContext *s, const AVFrame *frame)
+{
+    int limited = frame->color_range != AVCOL_RANGE_JPEG, y, u, v, c, rgb[3];
+    double kr = 0.2126, kb = 0.0722; // BT.709, also when the frame doesn't say
+
+    if (!s->yuv_lut && !(s->yuv_lut = av_malloc_array(65 * 33 * 33, sizeof(*s->yuv_lut))))
+        return AVERROR(ENOMEM);
+    s->lut_space = frame->colorspace;
+    s->lut_range = frame->color_range;
+    if (s->lut_space == AVCOL_SPC_BT470BG || s->lut_space == AVCOL_SPC_SMPTE170M) {
+        kr = 0.299;
+        kb = 0.114;
+    } else if (s->lut_space == AVCOL_SPC_BT2020_NCL || s->lut_space == AVCOL_SPC_BT2020_CL) {
+        kr = 0.2627;
+        kb = 0.0593;
+    }
+
+    for (y = 0; y <= 256; y += 4) {
+        for (u = 0; u <= 256; u += 8) {
+            for (v = 0; v <= 256; v += 8) {
+                double l = limited ? (y - 16) / 219.0 : y / 255.0;
+                double cb = (u - 128) / (limited ? 224.0 : 255.0);
+                double cr = (v - 128) / (limited ? 224.0 : 255.0);
+                double r = l + 2 * (1 - kr) * cr, b = l + 2 * (1 - kb) * cb;
+                double e[3] = { r, (l - kr * r - kb * b) / (1 - kr - kb), b };
+
+                for (c = 0; c < 3; c++)
+                    rgb[c] = lrint(av_clipd(e[c], 0, 1) * 255);
+                s->yuv_lut[YUV_LUT_INDEX(y, u, v)] = color_mode == COLOR_ANSI256 ? xterm256_nearest(rgb) :
+                                                     rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+            }
+        }
+    }
+    return 0;
+}
+
+static int ramp_render(RenderContext *rc, const AVFrame *frame, OutBuf *ob)
+{
+    RampContext *s = rc->priv_data;
+    int x, y, fg = -1, ret, held = 0;
+    int64_t t0;
+    uint8_t *p0, *p, *levels;
+
+    if (rc->shift)
+        ramp_scroll(rc);
+    s->frame++;
+    render_stats->cells_total += frame->width * frame->height;
+
+    if (frame->format == AV_PIX_FMT_GRAY8) {
+        /* Trivial ASCII grayscale display. */
+        p0 = frame->data[0];
+        for (y = 0; y < frame->height; y++, p0 += frame->linesize[0]) {
+            if (rc->row_mask && !rc->row_mask[y])
+                continue;
+            if (rc->row_mask)
+                put_row_start(ob, y);
+            t0 = now_ns();
+            render_stats->cells_changed += ramp_row(s, p0, frame->width, y, &held);
+            render_stats->shade_ns += now_ns() - t0;
+            levels = s->levels + y * frame->width;
+            for (x = 0; x < frame->width; x++)
+                ob_putc(ob, ascii_ramp[levels[x]]);
+            if (rc->grid)
+                for (x = 0; x < frame->width; x++)
+                    rc->grid[y * rc->cols + x] = (Cell){ ascii_ramp[levels[x]], CELL_DEFAULT, CELL_DEFAULT };
+            if (!rc->row_mask)
+                ob_putc(ob, '\n');
+        }
+        render_stats->cells_held += held;
+        return 0;
+    }
+
+    if (frame->format == AV_PIX_FMT_YUV444P) {
+        uint32_t color = ~0u;
+
+        if ((!s->yuv_lut || frame->colorspace != s->lut_space || frame->color_range != s->lut_range) &&
+            (ret = ramp_build_yuv_lut(s, frame)) < 0)
+            return ret;
+
+        /* Glyph from Y, foreground color from the table. */
+        for (y = 0; y < frame->height; y++) {
+            const uint8_t *py = frame->data[0] + y * frame->linesize[0];
+            const uint8_t *pu = frame->data[1] + y * frame->linesize[1];
+            const uint8_t *pv = frame->data[2] + y * frame->linesize[2];
+            if (rc->row_mask && !rc->row_mask[y])
+                continue;
+            if (rc->row_mask) {
+                put_row_start(ob, y);
+                color = ~0u;
+            }
+            t0 = now_ns();
+            render_stats->cells_changed += ramp_row(s, py, frame->width, y, &held);
+            render_stats->shade_ns += now_ns() - t0;
+            levels = s->levels + y * frame->width;
+            for (x = 0; x < frame->width; x++) {
+                uint32_t c = s->yuv_lut[YUV_LUT_INDEX(py[x], pu[x], pv[x])];
+                if (rc->grid)
+                    rc->grid[y * rc->cols + x] = (Cell){ ascii_ramp[levels[x]],
+                        (color_mode == COLOR_ANSI256 ? CELL_INDEXED : CELL_RGB) | c, CELL_DEFAULT };
+                if (c != color) {
+                    color = c;
+                    if (color_mode == COLOR_ANSI256) {
+                        ob_puts(ob, "\033[38;5;");
+                        ob_put_u8(ob, c);
+                        ob_putc(ob, 'm');
+                    } else {
+                        const uint8_t rgb[3] = { c >> 16, c >> 8, c };
+                        put_sgr_rgb(ob, rgb, NULL);
+                    }
+                }
+                ob_putc(ob, ascii_ramp[levels[x]]);
+            }
+            if (!rc->row_mask)
+                ob_putc(ob, '\n');
+        }
+        ob_puts(ob, "\033[0m");
+        render_stats->cells_held += held;
+        return 0;
+    }
+
+    if ((ret = quantize_frame(s->quant, frame)) < 0)
+        return ret;
+    put_scene_palette(ob, s->quant);
+    if (s->quant->changed)
+        rc->row_mask = NULL; // Other indices everywhere
+
+    /* Glyph from luma, foreground color from the palette index. */
+    p0 = frame->data[0];
+    for (y = 0; y < frame->height; y++) {
+        const uint8_t *idx = s->quant->indices + y * frame->width;
+        if (rc->row_mask && !rc->row_mask[y]) {
+            p0 += frame->linesize[0];
+            continue;
+        }
+        if (rc->row_mask) {
+            put_row_start(ob, y);
+            fg = -1;
+        }
+        p = p0;
+        for (x = 0; x < frame->width; x++, p += 3)
+            s->luma[x] = (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+        t0 = now_ns();
+        render_stats->cells_changed += ramp_row(s, s->luma, frame->width, y, &held);
+        render_stats->shade_ns += now_ns() - t0;
+        levels = s->levels + y * frame->width;
+        for (x = 0; x < frame->width; x++) {
+            if (idx[x] != fg) {
+                fg = idx[x];
+                put_sgr_index(ob, fg, -1);
+            }
+            ob_putc(ob, ascii_ramp[levels[x]]);
+        }
+        if (rc->grid)
+            for (x = 0; x < frame->width; x++)
+                rc->grid[y * rc->cols + x] = (Cell){ ascii_ramp[levels[x]], CELL_INDEXED | idx[x], CELL_DEFAULT };
+        if (!rc->row_mask)
+            ob_putc(ob, '\n');
+        p0 += frame->linesize[0];
+    }
+    ob_puts(ob, "\033[0m");
+    render_stats->cells_held += held;
+    return 0;
+}
+
+static void ramp_uninit(RenderContext *rc)
+{
+    RampContext *s = rc->priv_data;
+    quantizer_free(&s->quant);
+    av_freep(&s->levels);
+    av_freep(&s->committed);
+    av_freep(&s->luma);
+    av_freep(&s->yuv_lut);
+}
+
+/*
+ * Quadrant blocks: every cell covers 2x2 pixels. Bit i of a mask selects
+ * pixel i (top-left, top-right, bottom-left, bottom-right) as foreground.
+ */
+static const uint32_t quadrant_glyphs[16] = {
+    0x0020, 0x2598, 0x259D, 0x2580, 0x2596, 0x258C, 0x259E, 0x259B,
+    0x2597, 0x259A, 0x2590, 0x259C, 0x2584, 0x2599, 0x259F, 0x2588,
+};
+
+// Per mask membership of each pixel and 1/size of both sets, laid out as
+// separate arrays so the search over all 16 masks vectorizes.
+static const int32_t quad_bit[4][16] = {
+    { 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1 },
+    { 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1, 0, 0, 1, 1 },
+    { 0, 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 1 },
+    { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 },
+};
+static const float quad_inv_fg[16] = {
+    0, 1, 1, 1.f/2, 1, 1.f/2, 1.f/2, 1.f/3, 1, 1.f/2, 1.f/2, 1.f/3, 1.f/2, 1.f/3, 1.f/3, 1.f/4,
+};
+static const float quad_inv_bg[16] = {
+    1.f/4, 1.f/3, 1.f/3, 1.f/2, 1.f/3, 1.f/2, 1.f/2, 1, 1.f/3, 1.f/2, 1.f/2, 1, 1.f/2, 1, 1, 0,
+};
+
+/*
+ * Best two color fit of a 2x2 block. Minimizing the squared error of both
+ * sets around their means is the same as maximizing |S_fg|^2/n_fg + |S_bg|^2/n_bg,
+ * which only needs the per mask channel sums.
+ */
+static int quad_fit(const uint8_t *px[4], uint8_t fg[3], uint8_t bg[3])
+{
+    int32_t sfg[3][16], total[3];
+    float score[16];
+    int m, c, best = 0;
+
+    for (c = 0; c < 3; c++) {
+        total[c] = px[0][c] + px[1][c] + px[2][c] + px[3][c];
+        for (m = 0; m < 16; m++)
+            sfg[c][m] = quad_bit[0][m] * px[0][c] + quad_bit[1][m] * px[1][c] +
+                        quad_bit[2][m] * px[2][c] + quad_bit[3][m] * px[3][c];
+    }
+    for (m = 0; m < 16; m++) {
+        float f = (float)sfg[0][m] * sfg[0][m] + (float)sfg[1][m] * sfg[1][m] +
+                  (float)sfg[2][m] * sfg[2][m];
+        float b0 = total[0] - sfg[0][m], b1 = total[1] - sfg[1][m], b2 = total[2] - sfg[2][m];
+        score[m] = f * quad_inv_fg[m] + (b0 * b0 + b1 * b1 + b2 * b2) * quad_inv_bg[m];
+    }
+    for (m = 1; m < 16; m++)
+        if (score[m] > score[best])
+            best = m;
+
+    for (c = 0; c < 3; c++) {
+        fg[c] = quad_inv_fg[best] ? (int)(sfg[c][best] * quad_inv_fg[best] + 0.5f) : 0;
+        bg[c] = quad_inv_bg[best] ? (int)((total[c] - sfg[c][best]) * quad_inv_bg[best] + 0.5f) : 0;
+    }
+    return best;
+}
+
+typedef struct QuadContext {
+    Quantizer *quant;
+} QuadContext;
+
+static enum AVPixelFormat rgb24_pix_fmt(void)
+{
+    return AV_PIX_FMT_RGB24;
+}
+
+static int quad_init(RenderContext *rc)
+{
+    QuadContext *s = rc->priv_data;
+    return color_quantizer_init(&s->quant);
+}
+
+static int quad_render(RenderContext *rc, const AVFrame *frame, OutBuf *ob)
+{
+    QuadContext *s = rc->priv_data;
+    int x, y, c, ret;
+    int cur_fg = -1, cur_bg = -1;      // Palette modes
+    uint32_t cur_rgb[2] = { ~0u, ~0u }; // Truecolor fg, bg
+
+    if (s->quant) {
+        if ((ret = quantize_frame(s->quant, frame)) < 0)
+            return ret;
+        put_scene_palette(ob, s->quant);
+        if (s->quant->changed)
+            rc->row_mask = NULL;
+    }
+
+    for (y = 0; y + 1 < frame->height; y += 2) {
+        const uint8_t *row0 = frame->data[0] + y * frame->linesize[0];
+        const uint8_t *row1 = row0 + frame->linesize[0];
+
+        if (rc->row_mask && !rc->row_mask[y / 2])
+            continue;
+        if (rc->row_mask)
+            put_row_start(ob, y / 2);
+        for (x = 0; x + 1 < frame->width; x += 2) {
+            const uint8_t *px[4] = { row0 + 3 * x, row0 + 3 * x + 3, row1 + 3 * x, row1 + 3 * x + 3 };
+            uint8_t fg[3], bg[3];
+            int mask = quad_fit(px, fg, bg);
+
+            if (s->quant) {
+                int f = palette_map(&s->quant->pal, fg[0], fg[1], fg[2]);
+                int b = palette_map(&s->quant->pal, bg[0], bg[1], bg[2]);
+                // The inverted mask with swapped colors is the same picture,
+                // pick whichever needs fewer attribute changes
+                if (mask == 15 || (f == cur_bg && b == cur_fg) || f == b) {
+                    int t = f; f = b; b = t;
+                    mask ^= 15;
+                }
+                if (f == b)
+                    mask = 0;
+                put_sgr_index(ob, mask && f != cur_fg ? f : -1, b != cur_bg ? b : -1);
+                if (mask)
+                    cur_fg = f;
+                cur_bg = b;
+                if (rc->grid)
+                    rc->grid[y / 2 * rc->cols + x / 2] = (Cell){ quadrant_glyphs[mask], CELL_INDEXED | f,
+                                                                 CELL_INDEXED | b };
+            } else {
+                uint32_t f = fg[0] << 16 | fg[1] << 8 | fg[2];
+                uint32_t b = bg[0] << 16 | bg[1] << 8 | bg[2];
+                if (mask == 15 || (f == cur_rgb[1] && b == cur_rgb[0])) {
+                    uint32_t t = f; f = b; b = t;
+                    mask ^= 15;
+                    for (c = 0; c < 3; c++) {
+                        uint8_t v = fg[c]; fg[c] = bg[c]; bg[c] = v;
+                    }
+                }
+                if ((mask && f != cur_rgb[0]) || b != cur_rgb[1])
+                    put_sgr_rgb(ob, mask && f != cur_rgb[0] ? fg : NULL, b != cur_rgb[1] ? bg : NULL);
+                if (mask)
+                    cur_rgb[0] = f;
+                cur_rgb[1] = b;
+                if (rc->grid)
+                    rc->grid[y / 2 * rc->cols + x / 2] = (Cell){ quadrant_glyphs[mask], CELL_RGB | f, CELL_RGB | b };
+            }
+            ob_put_utf8(ob, quadrant_glyphs[mask]);
+        }
+        // Reset before the newline so the background doesn't bleed into the margin
+        ob_puts(ob, rc->row_mask ? "\033[0m" : "\033[0m\n");
+        cur_fg = cur_bg = -1;
+        cur_rgb[0] = cur_rgb[1] = ~0u;
+    }
+    return 0;
+}
+
+static void quad_uninit(RenderContext *rc)
+{
+    QuadContext *s = rc->priv_data;
+    quantizer_free(&s->quant);
+}
+
+/*
+ * Sixel output. Pixels go through the 256 color quantizer, then every band
+ * of six rows is written color by color: for each color present in the band
+ * one line of sixel characters covering the columns it touches, run-length
+ * encoded with '!'.
+ */
+typedef struct SixelContext {
+    Quantizer *quant;
+    uint8_t *bits;      // Sixel bit pattern per color and column, [256][width]
+    int width;
+    int min_x[256], max_x[256];
+    uint8_t used[256];
+    uint8_t order[256]; // Colors present in the band, in order of appearance
+} SixelContext;
+
+static int sixel_init(RenderContext *rc)
+{
+    SixelContext *s = rc->priv_data;
+
+    // Up to 256 registers, unless one of the 16 color modes was asked for
+    if (color_mode != COLOR_ANSI16 && color_mode != COLOR_ADAPTIVE16)
+        s->quant = quantizer_alloc(256, NULL);
+    else
+        s->quant = quantizer_alloc(16, color_mode == COLOR_ANSI16 ? ansi16_rgb : NULL);
+    if (!s->quant)
+        return AVERROR(ENOMEM);
+
+    s->width = rc->cols * SIXEL_CELL_W;
+    s->bits = av_mallocz(256 * s->width);
+    return s->bits ? 0 : AVERROR(ENOMEM);
+}
+
+static int sixel_resize(RenderContext *rc)
+{
+    SixelContext *s = rc->priv_data;
+
+    if (rc->cols * SIXEL_CELL_W <= s->width)
+        return 0;
+    av_freep(&s->bits);
+    s->width = rc->cols * SIXEL_CELL_W;
+    s->bits = av_mallocz(256 * s->width);
+    return s->bits ? 0 : AVERROR(ENOMEM);
+}
+
+static void sixel_put_run(OutBuf *ob, int ch, int n)
+{
+    if (n >= 4) {
+        ob_printf(ob, "!%d%c", n, ch);
+    } else {
+        while (n--)
+            ob_putc(ob, ch);
+    }
+}
+
+static int sixel_render(RenderContext *rc, const AVFrame *frame, OutBuf *ob)
+{
+    SixelContext *s = rc->priv_data;
+    Quantizer *quant = s->quant;
+    int x, y, r, i, c, nb_used, ret;
+    const uint8_t *idx;
+
+    if (frame->width > s->width)
+        return AVERROR(EINVAL);
+    if ((ret = quantize_frame(quant, frame)) < 0)
+        return ret;
+
+    // DCS with 1:1 pixel aspect and background left alone, then raster size
+    ob_printf(ob, "\033P0;1;0q\"1;1;%d;%d", frame->width, frame->height);
+    for (i = 0; i < quant->pal.nb_colors; i++)
+        ob_printf(ob, "#%d;2;%d;%d;%d", i,
+                  quant->pal.rgb[i][0] * 100 / 255, quant->pal.rgb[i][1] * 100 / 255,
+                  quant->pal.rgb[i][2] * 100 / 255);
+
+    for (y = 0; y < frame->height; y += 6) {
+        int rows = FFMIN(6, frame->height - y);
+
+        nb_used = 0;
+        for (r = 0; r < rows; r++) {
+            idx = quant->indices + (y + r) * frame->width;
+            for (x = 0; x < frame->width; x++) {
+                c = idx[x];
+                if (!s->used[c]) {
+                    s->used[c] = 1;
+                    s->order[nb_used++] = c;
+                    s->min_x[c] = x;
+                    s->max_x[c] = x;
+                }
+                s->bits[c * s->width + x] |= 1 << r;
+                s->min_x[c] = FFMIN(s->min_x[c], x);
+                s->max_x[c] = FFMAX(s->max_x[c], x);
+            }
+        }
+
+        for (i = 0; i < nb_used; i++) {
+            uint8_t *bits;
+            int run_ch, run = 0;
+
+            c = s->order[i];
+            bits = s->bits + c * s->width;
+            ob_printf(ob, "#%d", c);
+            sixel_put_run(ob, '?', s->min_x[c]);
+            run_ch = 63 + bits[s->min_x[c]];
+            for (x = s->min_x[c]; x <= s->max_x[c]; x++) {
+                int ch = 63 + bits[x];
+                bits[x] = 0;
+                if (ch != run_ch) {
+                    sixel_put_run(ob, run_ch, run);
+                    run_ch = ch;
+                    run = 0;
+                }
+                run++;
+            }
+            sixel_put_run(ob, run_ch, run);
+            s->used[c] = 0;
+            // Carriage return to overlay the next color, the last one ends the band
+            ob_putc(ob, i + 1 < nb_used ? '$' : '-');
+        }
+    }
+    ob_puts(ob, "\033\\");
+    return 0;
+}
+
+static void sixel_uninit(RenderContext *rc)
+{
+    SixelContext *s = rc->priv_data;
+    quantizer_free(&s->quant);
+    av_freep(&s->bits);
+}
+
+/*
+ * kitty graphics protocol: the frame is sent as raw or zlib compressed RGB,
+ * base64 encoded in chunks of at most 4096 bytes. Image and placement ids
+ * stay the same so every frame replaces the previous one in place.
+ */
+#define KITTY_CHUNK 4096
+
+typedef struct KittyContext {
+    uint8_t *buf;       // Packed RGB, then compressed data
+    unsigned int buf_size;
+    char *b64;
+    unsigned int b64_size;
+} KittyContext;
+
+static int kitty_render(RenderContext *rc, const AVFrame *frame, OutBuf *ob)
+{
+    KittyContext *s = rc->priv_data;
+    size_t row = (size_t)frame->width * 3, size = row * frame->height, pos;
+    const uint8_t *payload = frame->data[0];
+    int y;
+
+    if (frame->linesize[0] != (int)row || kitty_zlib) {
+        uLongf zsize = compressBound(size);
+        av_fast_malloc(&s->buf, &s->buf_size, size + (kitty_zlib ? zsize : 0));
+        if (!s->buf)
+            return AVERROR(ENOMEM);
+        for (y = 0; y < frame->height; y++)
+            memcpy(s->buf + y * row, frame->data[0] + y * frame->linesize[0], row);
+        payload = s->buf;
+        if (kitty_zlib) {
+            if (compress2(s->buf + size, &zsize, s->buf, size, 1) != Z_OK)
+                return AVERROR_EXTERNAL;
+            payload = s->buf + size;
+            size = zsize;
+        }
+    }
+
+    av_fast_malloc(&s->b64, &s->b64_size, AV_BASE64_SIZE(size));
+    if (!s->b64)
+        return AVERROR(ENOMEM);
+    av_base64_encode(s->b64, s->b64_size, payload, size);
+    size = strlen(s->b64);
+
+    for (pos = 0; pos < size; pos += KITTY_CHUNK) {
+        size_t n = FFMIN(KITTY_CHUNK, size - pos);
+        int more = pos + n < size;
+        if (!pos)
+            ob_printf(ob, "\033_Ga=T,f=24,s=%d,v=%d,i=1,p=1,q=2,C=1%s,m=%d;",
+                      frame->width, frame->height, kitty_zlib ? ",o=z" : "", more);
+        else
+            ob_printf(ob, "\033_Gm=%d;", more);
+        ob_write(ob, s->b64 + pos, n);
+        ob_puts(ob, "\033\\");
+    }
+    return 0;
+}
+
+static void kitty_uninit(RenderContext *rc)
+{
+    KittyContext *s = rc->priv_data;
+    av_freep(&s->buf);
+    av_freep(&s->b64);
+}
+
+static const Renderer ramp_renderer = {
+    .name           = "ascii",
+    .description    = "luma ramp, one pixel per cell",
+    .cell_w         = 1,
+    .cell_h         = 1,
+    .priv_data_size = sizeof(RampContext),
+    .pix_fmt        = ramp_pix_fmt,
+    .init           = ramp_init,
+    .render         = ramp_render,
+    .resize         = ramp_resize,
+    .uninit         = ramp_uninit,
+};
+
+static const Renderer quad_renderer = {
+    .name           = "quad",
+    .description    = "quadrant blocks, 2x2 pixels per cell in two colors",
+    .cell_w         = 2,
+    .cell_h         = 2,
+    .priv_data_size = sizeof(QuadContext),
+    .pix_fmt        = rgb24_pix_fmt,
+    .init           = quad_init,
+    .render         = quad_render,
+    .uninit         = quad_uninit,
+};
+
+static const Renderer sixel_renderer = {
+    .name           = "sixel",
+    .description    = "Sixel inline graphics",
+    .cell_w         = SIXEL_CELL_W,
+    .cell_h         = SIXEL_CELL_H,
+    .graphics       = 1,
+    .priv_data_size = sizeof(SixelContext),
+    .pix_fmt        = rgb24_pix_fmt,
+    .init           = sixel_init,
+    .render         = sixel_render,
+    .resize         = sixel_resize,
+    .uninit         = sixel_uninit,
+};
+
+static const Renderer kitty_renderer = {
+    .name           = "kitty",
+    .description    = "kitty graphics protocol",
+    .cell_w         = SIXEL_CELL_W,
+    .cell_h         = SIXEL_CELL_H,
+    .graphics       = 1,
+    .priv_data_size = sizeof(KittyContext),
+    .pix_fmt        = rgb24_pix_fmt,
+    .render         = kitty_render,
+    .uninit         = kitty_uninit,
+};
+
+/*
+ * A minimal virtual terminal: enough of VT100/xterm to follow what the
+ * renderers emit (cursor positioning, erase, scroll regions, SGR colors,
+ * UTF-8), with everything else parsed and ignored. Replay uses it to
+ * capture screen snapshots. Its Cell is declared with the renderers.
+ */
+enum VTState { VT_GROUND, VT_ESC, VT_CSI, VT_OSC, VT_OSC_ESC, VT_STRING, VT_STRING_ESC };
+
+#define VT_MAX_PARAMS 16
+
+typedef struct VTerm {
+    int cols, rows;
+    Cell *cells;
+    int x, y;
+    int wrap_pending;     // Cursor sits past the last column
+    int onlcr;            // A newline also returns the carriage, as the tty driver does for our output
+    int64_t escapes;      // Sequences started, for --verify
+    int top, bottom;      // Scroll region, inclusive
+    uint32_t fg, bg;
+    int saved_x, saved_y;
+    uint32_t palette[256]; // CELL_RGB for colors redefined with OSC 4, else 0
+    // Parser
+    enum VTState state;
+    int params[VT_MAX_PARAMS];
+    int nb_params;
+    int private_mode;     // CSI with a ? > = or < prefix
+    uint32_t utf8;
+    int utf8_left;
+    char osc[64];
+    int osc_len;
+} VTerm;
+
+static int vt_init(VTerm *vt, int cols, int rows)
+{
+    int i;
+
+    memset(vt, 0, sizeof(*vt));
+    if (!(vt->cells = av_malloc_array((size_t)cols * rows, sizeof(*vt->cells))))
+        return AVERROR(ENOMEM);
+    vt->cols = cols;
+    vt->rows = rows;
+    vt->bottom = rows - 1;
+    for (i = 0; i < cols * rows; i++)
+        vt->cells[i] = (Cell){ ' ', CELL_DEFAULT, CELL_DEFAULT };
+    return 0;
+}
+
+static void vt_free(VTerm *vt)
+{
+    av_freep(&vt->cells);
+}
+
+/*
+ * Size a terminal to follow renderer output of cols x rows. It gets one
+ * spare line, as the renderers end their last row with a newline, and
+ * turns newlines into CRLF like the tty driver does for our output.
+ * Returns 1 if it was (re)allocated, 0 if it already fit.
+ */
+static int vt_fit(VTerm *vt, int cols, int rows)
+{
+    int ret;
+
+    if (vt->cells && vt->cols == cols && vt->rows == rows + 1)
+        return 0;
+    vt_free(vt);
+    if ((ret = vt_init(vt, cols, rows + 1)) < 0)
+        return ret;
+    vt->onlcr = 1;
+    return 1;
+}
+
+static int vt_resize(VTerm *vt, int cols, int rows)
+{
+    VTerm n;
+    int x, y, ret;
+
+    if ((ret = vt_init(&n, cols, rows)) < 0)
+        return ret;
+    for (y = 0; y < FFMIN(rows, vt->rows); y++)
+        for (x = 0; x < FFMIN(cols, vt->cols); x++)
+            n.cells[y * cols + x] = vt->cells[y * vt->cols + x];
+    n.x = FFMIN(vt->x, cols - 1);
+    n.y = FFMIN(vt->y, rows - 1);
+    n.fg = vt->fg;
+    n.bg = vt->bg;
+    n.onlcr = vt->onlcr;
+    vt_free(vt);
+    *vt = n;
+    return 0;
+}
+
+/* Copy of the screen without the parser state, for snapshots. */
+static int vt_copy(VTerm *dst, const VTerm *src)
+{
+    *dst = *src;
+    if (!(dst->cells = av_malloc_array((size_t)src->cols * src->rows, sizeof(*dst->cells))))
+        return AVERROR(ENOMEM);
+    memcpy(dst->cells, src->cells, (size_t)src->cols * src->rows * sizeof(*dst->cells));
+    dst->state = VT_GROUND;
+    dst->utf8_left = 0;
+    return 0;
+}
+
+static void vt_erase(VTerm *vt, int from, int to)
+{
+    for (; from < to; from++)
+        vt->cells[from] = (Cell){ ' ', vt->fg, vt->bg };
+}
+
+/* Move lines top..bottom up by n (down if n < 0), blanking what is exposed. */
+static void vt_scroll(VTerm *vt, int top, int bottom, int n)
+{
+    int lines = bottom - top + 1, cols = vt->cols;
+
+    n = av_clip(n, -lines, lines);
+    if (n > 0) {
+        memmove(vt->cells + top * cols, vt->cells + (top + n) * cols, (size_t)(lines - n) * cols * sizeof(Cell));
+        vt_erase(vt, (bottom + 1 - n) * cols, (bottom + 1) * cols);
+    } else if (n < 0) {
+        memmove(vt->cells + (top - n) * cols, vt->cells + top * cols, (size_t)(lines + n) * cols * sizeof(Cell));
+        vt_erase(vt, top * cols, (top - n) * cols);
+    }
+}
+
+static void vt_linefeed(VTerm *vt)
+{
+    if (vt->y == vt->bottom)
+        vt_scroll(vt, vt->top, vt->bottom, 1);
+    else if (vt->y < vt->rows - 1)
+        vt->y++;
+}
+
+static void vt_put(VTerm *vt, uint32_t c)
+{
+    if (vt->wrap_pending) {
+        vt->x = 0;
+        vt_linefeed(vt);
+        vt->wrap_pending = 0;
+    }
+    vt->cells[vt->y * vt->cols + vt->x] = (Cell){ c, vt->fg, vt->bg };
+    if (vt->x == vt->cols - 1)
+        vt->wrap_pending = 1;
+    else
+        vt->x++;
+}
+
+static int vt_param(const VTerm *vt, int i, int def)
+{
+    return i < vt->nb_params && vt->params[i] > 0 ? vt->params[i] : def;
+}
+
+static void vt_sgr(VTerm *vt)
+{
+    int i, p;
+
+    if (!vt->nb_params)
+        vt->fg = vt->bg = CELL_DEFAULT;
+    for (i = 0; i < vt->nb_params; i++) {
+        uint32_t *color;
+
+        p = vt->params[i];
+        if (p == 0) {
+            vt->fg = vt->bg = CELL_DEFAULT;
+        } else if (p >= 30 && p <= 37) {
+            vt->fg = CELL_INDEXED | (p - 30);
+        } else if (p >= 90 && p <= 97) {
+            vt->fg = CELL_INDEXED | (p - 90 + 8);
+        } else if (p >= 40 && p <= 47) {
+            vt->bg = CELL_INDEXED | (p - 40);
+        } else if (p >= 100 && p <= 107) {
+            vt->bg = CELL_INDEXED | (p - 100 + 8);
+        } else if (p == 39) {
+            vt->fg = CELL_DEFAULT;
+        } else if (p == 49) {
+            vt->bg = CELL_DEFAULT;
+        } else if (p == 38 || p == 48) {
+            color = p == 38 ? &vt->fg : &vt->bg;
+            if (i + 2 < vt->nb_params && vt->params[i + 1] == 5) {
+                *color = CELL_INDEXED | (vt->params[i + 2] & 0xFF);
+                i += 2;
+            } else if (i + 4 < vt->nb_params && vt->params[i + 1] == 2) {
+                *color = CELL_RGB | (vt->params[i + 2] & 0xFF) << 16 |
+                         (vt->params[i + 3] & 0xFF) << 8 | (vt->params[i + 4] & 0xFF);
+                i += 4;
+            } else {
+                break;
+            }
+        }
+        // Bold, underline and friends don't affect the cell contents we track
+    }
+}
+
+static void vt_csi(VTerm *vt, int final)
+{
+    int cols = vt->cols, n = vt_param(vt, 0, 1);
+
+    if (vt->private_mode)
+        return; // Mode switches like ?25l
+    vt->wrap_pending = 0;
+    switch (final) {
+    case 'A': vt->y = FFMAX(vt->y - n, 0); break;
+    case 'B': vt->y = FFMIN(vt->y + n, vt->rows - 1); break;
+    case 'C': vt->x = FFMIN(vt->x + n, cols - 1); break;
+    case 'D': vt->x = FFMAX(vt->x - n, 0); break;
+    case 'E': vt->y = FFMIN(vt->y + n, vt->rows - 1); vt->x = 0; break;
+    case 'F': vt->y = FFMAX(vt->y - n, 0); vt->x = 0; break;
+    case 'G': vt->x = av_clip(n - 1, 0, cols - 1); break;
+    case 'd': vt->y = av_clip(n - 1, 0, vt->rows - 1); break;
+    case 'H':
+    case 'f':
+        vt->y = av_clip(vt_param(vt, 0, 1) - 1, 0, vt->rows - 1);
+        vt->x = av_clip(vt_param(vt, 1, 1) - 1, 0, cols - 1);
+        break;
+    case 'J':
+        switch (vt->nb_params ? vt->params[0] : 0) {
+        case 0: vt_erase(vt, vt->y * cols + vt->x, vt->rows * cols); break;
+        case 1: vt_erase(vt, 0, vt->y * cols + vt->x + 1); break;
+        case 2:
+        case 3: vt_erase(vt, 0, vt->rows * cols); break;
+        }
+        break;
+    case 'K':
+        switch (vt->nb_params ? vt->params[0] : 0) {
+        case 0: vt_erase(vt, vt->y * cols + vt->x, (vt->y + 1) * cols); break;
+        case 1: vt_erase(vt, vt->y * cols, vt->y * cols + vt->x + 1); break;
+        case 2: vt_erase(vt, vt->y * cols, (vt->y + 1) * cols); break;
+        }
+        break;
+    case 'S': vt_scroll(vt, vt->top, vt->bottom, n); break;
+    case 'T': vt_scroll(vt, vt->top, vt->bottom, -n); break;
+    case 'r':
+        vt->top = av_clip(vt_param(vt, 0, 1) - 1, 0, vt->rows - 1);
+        vt->bottom = av_clip(vt_param(vt, 1, vt->rows) - 1, vt->top, vt->rows - 1);
+        vt->x = vt->y = 0;
+        break;
+    case 'm': vt_sgr(vt); break;
+    }
+}
+
+/* The palette commands are the only OSC that change what cells look like. */
+static void vt_osc(VTerm *vt)
+{
+    const char *p = vt->osc;
+    unsigned i, r, g, b;
+    int n;
+
+    vt->osc[vt->osc_len] = 0;
+    if (!strcmp(p, "104")) {
+        memset(vt->palette, 0, sizeof(vt->palette));
+        return;
+    }
+    if (strncmp(p, "4;", 2))
+        return;
+    for (p += 2; sscanf(p, "%u;rgb:%2x/%2x/%2x%n", &i, &r, &g, &b, &n) == 4 && i < 256; p++) {
+        vt->palette[i] = CELL_RGB | r << 16 | g << 8 | b;
+        p += n;
+        if (*p != ';')
+            break;
+    }
+}
+
+/* A cell color as the terminal shows it, with the palette applied. */
+static uint32_t vt_color(const VTerm *vt, uint32_t color)
+{
+    return color & CELL_INDEXED && vt->palette[color & 0xFF] ? vt->palette[color & 0xFF] : color;
+}
+
+static void vt_feed(VTerm *vt, const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+
+    for (; p < end; p++) {
+        int c = *p;
+
+        switch (vt->state) {
+        case VT_GROUND:
+            if (vt->utf8_left && (c & 0xC0) == 0x80) {
+                vt->utf8 = vt->utf8 << 6 | (c & 0x3F);
+                if (!--vt->utf8_left)
+                    vt_put(vt, vt->utf8);
+                continue;
+            }
+            vt->utf8_left = 0;
+            if (c == 0x1B) {
+                vt->state = VT_ESC;
+                vt->escapes++;
+            } else if (c == '\r') {
+                vt->x = 0;
+                vt->wrap_pending = 0;
+            } else if (c == '\n' || c == '\v' || c == '\f') {
+                vt_linefeed(vt);
+                vt->wrap_pending = 0;
+                if (c == '\n' && vt->onlcr)
+                    vt->x = 0;
+            } else if (c == '\b') {
+                vt->x = FFMAX(vt->x - 1, 0);
+                vt->wrap_pending = 0;
+            } else if (c == '\t') {
+                vt->x = FFMIN((vt->x / 8 + 1) * 8, vt->cols - 1);
+            } else if (c >= 0xF0) {
+                vt->utf8 = c & 0x07;
+                vt->utf8_left = 3;
+            } else if (c >= 0xE0) {
+                vt->utf8 = c & 0x0F;
+                vt->utf8_left = 2;
+            } else if (c >= 0xC0) {
+                vt->utf8 = c & 0x1F;
+                vt->utf8_left = 1;
+            } else if (c >= 0x20 && c != 0x7F && c < 0x80) {
+                vt_put(vt, c);
+            }
+            break;
+        case VT_ESC:
+            vt->state = VT_GROUND;
+            switch (c) {
+            case '[':
+                vt->state = VT_CSI;
+                vt->nb_params = 0;
+                vt->private_mode = 0;
+                memset(vt->params, 0, sizeof(vt->params));
+                break;
+            case ']': vt->state = VT_OSC; vt->osc_len = 0; break;
+            case 'P': case '_': case '^': case 'X': vt->state = VT_STRING; break;
+            case '7': vt->saved_x = vt->x; vt->saved_y = vt->y; break;
+            case '8': vt->x = vt->saved_x; vt->y = vt->saved_y; vt->wrap_pending = 0; break;
+            case 'D': vt_linefeed(vt); break;
+            case 'E': vt->x = 0; vt_linefeed(vt); break;
+            case 'M':
+                if (vt->y == vt->top)
+                    vt_scroll(vt, vt->top, vt->bottom, -1);
+                else if (vt->y > 0)
+                    vt->y--;
+                break;
+            case 'c': {
+                int cols = vt->cols, rows = vt->rows, onlcr = vt->onlcr;
+                vt_free(vt);
+                vt_init(vt, cols, rows);
+                vt->onlcr = onlcr;
+                break;
+            }
+            }
+            break;
+        case VT_CSI:
+            if (c >= '0' && c <= '9') {
+                if (!vt->nb_params)
+                    vt->nb_params = 1;
+                if (vt->nb_params <= VT_MAX_PARAMS)
+                    vt->params[vt->nb_params - 1] = FFMIN(vt->params[vt->nb_params - 1] * 10 + c - '0', 65535);
+            } else if (c == ';' || c == ':') {
+                if (!vt->nb_params)
+                    vt->nb_params = 1;
+                vt->nb_params++;
+            } else if (c >= '<' && c <= '?') {
+                vt->private_mode = 1;
+            } else if (c >= 0x40 && c <= 0x7E) {
+                vt->nb_params = FFMIN(vt->nb_params, VT_MAX_PARAMS);
+                vt_csi(vt, c);
+                vt->state = VT_GROUND;
+            }
+            break;
+        case VT_OSC:
+            if (c == 0x07) {
+                vt_osc(vt);
+                vt->state = VT_GROUND;
+            } else if (c == 0x1B) {
+                vt->state = VT_OSC_ESC;
+            } else if (vt->osc_len < sizeof(vt->osc) - 1) {
+                vt->osc[vt->osc_len++] = c;
+            }
+            break;
+        case VT_OSC_ESC:
+            vt_osc(vt);
+            vt->state = VT_GROUND;
+            break;
+        case VT_STRING:
+            if (c == 0x1B)
+                vt->state = VT_STRING_ESC;
+            break;
+        case VT_STRING_ESC:
+            // Only ESC \ ends the string, image payloads never contain ESC
+            vt->state = c == '\\' ? VT_GROUND : VT_STRING;
+            break;
+        }
+    }
+}
+
+/* One color of an SGR sequence, the first 16 in the codes a 16 color terminal knows. */
+static void put_cell_color(OutBuf *ob, uint32_t color, int bg)
+{
+    if (color == CELL_DEFAULT) {
+        ob_puts(ob, bg ? ";49" : ";39");
+    } else if (color & CELL_INDEXED && (color & 0xFF) < 16) {
+        ob_putc(ob, ';');
+        ob_put_u8(ob, (color & 0xFF) < 8 ? (bg ? 40 : 30) + (color & 0xFF) : (bg ? 100 : 90) + (color & 0xFF) - 8);
+    } else if (color & CELL_INDEXED) {
+        ob_puts(ob, bg ? ";48;5;" : ";38;5;");
+        ob_put_u8(ob, color & 0xFF);
+    } else {
+        ob_puts(ob, bg ? ";48;2;" : ";38;2;");
+        ob_put_u8(ob, color >> 16 & 0xFF);
+        ob_putc(ob, ';');
+        ob_put_u8(ob, color >> 8 & 0xFF);
+        ob_putc(ob, ';');
+        ob_put_u8(ob, color & 0xFF);
+    }
+}
+
+/* Draw the whole screen from scratch, cursor and colors included. */
+static void vt_draw(const VTerm *vt, OutBuf *ob)
+{
+    uint32_t fg = CELL_DEFAULT, bg = CELL_DEFAULT;
+    int x, y;
+
+    ob_puts(ob, "\033[0m\033[r\033[2J");
+    for (x = 0; x < 256; x++)
+        if (vt->palette[x])
+            ob_printf(ob, "\033]4;%d;rgb:%02x/%02x/%02x\033\\", x, vt->palette[x] >> 16 & 0xFF,
+                      vt->palette[x] >> 8 & 0xFF, vt->palette[x] & 0xFF);
+    for (y = 0; y < vt->rows; y++) {
+        ob_printf(ob, "\033[%dH", y + 1);
+        for (x = 0; x < vt->cols; x++) {
+            const Cell *c = &vt->cells[y * vt->cols + x];
+            if (c->fg != fg || c->bg != bg) {
+                ob_puts(ob, "\033[0");
+                put_cell_color(ob, c->fg, 0);
+                put_cell_color(ob, c->bg, 1);
+                ob_putc(ob, 'm');
+                fg = c->fg;
+                bg = c->bg;
+            }
+            ob_put_utf8(ob, c->ch);
+        }
+    }
+    if (vt->top || vt->bottom != vt->rows - 1)
+        ob_printf(ob, "\033[%d;%dr", vt->top + 1, vt->bottom + 1);
+    ob_puts(ob, "\033[0");
+    put_cell_color(ob, vt->fg, 0);
+    put_cell_color(ob, vt->bg, 1);
+    ob_printf(ob, "m\033[%d;%dH", vt->y + 1, vt->x + 1);
+}
+
+/*
+ * --protocol-out sends the picture in the binary protocol described in
+ * ascii-protocol.h instead of writing escapes to the terminal. The
+ * renderer's output is played into a VTerm and the grid it leaves behind
+ * is diffed against the previous frame's.
+ */
+typedef struct ProtoSink {
+    FILE *file;           // Stream output
+    int udp_fd;           // or one datagram per frame
+    VTerm vt;
+    Cell *prev, *cur;     // Grids of the last frame sent and of this one
+    uint32_t seq;
+    int since_keyframe;   // Frames since the last keyframe, < 0 forces one
+    int send_errno;       // Last send error reported
+    OutBuf ob;
+} ProtoSink;
+
+static ProtoSink *proto;
+static int proto_keyint = 50;
+
+static int proto_open(const char *dest)
+{
+    int ret = 0;
+
+    if (!(proto = av_mallocz(sizeof(*proto))))
+        return AVERROR(ENOMEM);
+    proto->udp_fd = -1;
+    proto->since_keyframe = -1;
+
+    if (!strncmp(dest, "udp://", 6)) {
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM,
+                                  .ai_flags = AI_NUMERICSERV };
+        struct addrinfo *res = NULL;
+        const char *port = strrchr(dest + 6, ':');
+        char host[256];
+        int err;
+
+        if (!port) {
+            av_log(NULL, AV_LOG_ERROR, "Missing port in %s\n", dest);
+            return AVERROR(EINVAL);
+        }
+        snprintf(host, sizeof(host), "%.*s", (int)(port - dest - 6), dest + 6);
+        if ((err = getaddrinfo(host, port + 1, &hints, &res))) {
+            av_log(NULL, AV_LOG_ERROR, "Invalid address %s: %s\n", dest, gai_strerror(err));
+            return AVERROR(EINVAL);
+        }
+        if ((proto->udp_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0 ||
+            connect(proto->udp_fd, res->ai_addr, res->ai_addrlen) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Cannot send to %s: %s\n", dest, strerror(errno));
+            ret = AVERROR(errno);
+        }
+        freeaddrinfo(res);
+    } else if (!strcmp(dest, "-")) {
+        proto->file = stdout;
+    } else if (!(proto->file = fopen(dest, "wb"))) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open %s: %s\n", dest, strerror(errno));
+        ret = AVERROR(errno);
+    }
+    return ret;
+}
+
+static void proto_close(void)
+{
+    if (!proto)
+        return;
+    if (proto->file && proto->file != stdout)
+        fclose(proto->file);
+    if (proto->udp_fd >= 0)
+        close(proto->udp_fd);
+    vt_free(&proto->vt);
+    av_freep(&proto->prev);
+    av_freep(&proto->cur);
+    av_freep(&proto->ob.data);
+    av_freep(&proto);
+}
+
+/* Send one datagram, reporting each kind of error once. */
+static void proto_send_datagram(const uint8_t *data, size_t len)
+{
+    if (send(proto->udp_fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0)
+        return;
+    // Lost or refused datagrams are what keyframes are for
+    stats.datagrams_lost++;
+    if (errno != proto->send_errno)
+        av_log(NULL, AV_LOG_WARNING, "Cannot send a protocol frame: %s\n", strerror(errno));
+    proto->send_errno = errno;
+}
+
+/* Turn one frame of renderer output into a protocol frame and send it. */
+static void proto_send(const RenderContext *rc, OutBuf *ansi)
+{
+    int cols = rc->cols, rows = rc->rows, n = cols * rows, i, keyframe, ret;
+    AVPHeader h = { 0 };
+
+    if ((ret = vt_fit(&proto->vt, cols, rows)) > 0) {
+        av_freep(&proto->prev);
+        av_freep(&proto->cur);
+        if (!(proto->prev = av_malloc_array(n, sizeof(*proto->prev))) ||
+            !(proto->cur = av_malloc_array(n, sizeof(*proto->cur))))
+            ret = AVERROR(ENOMEM);
+        proto->since_keyframe = -1;
+    }
+    if (ret < 0) {
+        vt_free(&proto->vt);
+        av_log(NULL, AV_LOG_ERROR, "Cannot allocate the protocol grid\n");
+        ansi->len = 0;
+        return;
+    }
+    vt_feed(&proto->vt, ansi->data, ansi->len);
+    stats.ansi_bytes += ansi->len;
+    ansi->len = 0;
+    ansi->error = 0;
+
+    // Cells as they look, after whatever palette the renderer loaded
+    for (i = 0; i < n; i++) {
+        proto->cur[i] = proto->vt.cells[i];
+        proto->cur[i].fg = vt_color(&proto->vt, proto->cur[i].fg);
+        proto->cur[i].bg = vt_color(&proto->vt, proto->cur[i].bg);
+    }
+
+    keyframe = proto->since_keyframe < 0 || proto->since_keyframe + 1 >= proto_keyint;
+    proto->ob.len = 0;
+    if (ob_reserve(&proto->ob, AVP_HEADER_SIZE + (size_t)n * AVP_MAX_CELL_SIZE) < 0)
+        return;
+    h.keyframe = keyframe;
+    h.seq = proto->seq++;
+    h.cols = cols;
+    h.rows = rows;
+    proto->ob.len = avp_encode_frame(proto->ob.data, &h, proto->cur, proto->prev, 0, n);
+
+    if (proto->udp_fd >= 0 && proto->ob.len > AVP_MAX_DATAGRAM) {
+        // Too big for one datagram: re-encoded as consecutive frames of
+        // a range of cells each, see ascii-protocol.h
+        proto->seq--;
+        for (i = 0; i < n; i += AVP_DATAGRAM_CELLS) {
+            h.keyframe = keyframe && !i;
+            h.seq = proto->seq++;
+            proto->ob.len = avp_encode_frame(proto->ob.data, &h, proto->cur, proto->prev,
+                                             i, FFMIN(AVP_DATAGRAM_CELLS, n - i));
+            proto_send_datagram(proto->ob.data, proto->ob.len);
+            stats.bytes_written += proto->ob.len;
+        }
+    } else if (proto->udp_fd >= 0) {
+        proto_send_datagram(proto->ob.data, proto->ob.len);
+        stats.bytes_written += proto->ob.len;
+    } else {
+        fwrite(proto->ob.data, 1, proto->ob.len, proto->file);
+        fflush(proto->file);
+        stats.bytes_written += proto->ob.len;
+    }
+    stats.keyframes += keyframe;
+    proto->since_keyframe = keyframe ? 0 : proto->since_keyframe + 1;
+    FFSWAP(Cell *, proto->prev, proto->cur);
+}
+
+/*
+ * --export=FILE renders into a video file instead of the terminal, as fast
+ * as frames decode. Like --protocol-out, the escapes of every frame are
+ * played into a VTerm; the grid it leaves is then drawn with a built-in
+ * 8x16 font into YUV 4:2:0 pictures for libx264, or mpeg4 when that is all
+ * there is. Drawing runs on a pool of threads and encoding on one more,
+ * so the two overlap. Jobs go around a ring:
+ *
+ *   main: FREE -> QUEUED, drawing threads: QUEUED -> DRAWN, encoder: DRAWN -> FREE
+ *
+ * The encoder takes them in ring order however the drawing threads finish.
+ * The threads take the filter role of --affinity.
+ */
+#define EXPORT_CELL_W 8
+#define EXPORT_CELL_H 16
+#define EXPORT_QUEUE_SIZE 16
+#define EXPORT_MAX_THREADS 8
+#define EXPORT_GLYPHS (128 + 32) // ASCII, then the block elements U+2580..U+259F
+
+enum ExportState { EXPORT_FREE, EXPORT_QUEUED, EXPORT_DRAWING, EXPORT_DRAWN };
+
+typedef struct ExportGlyph {
+    uint8_t rows[EXPORT_CELL_H];                         // Bit 7 is the leftmost pixel
+    uint8_t cover[EXPORT_CELL_H / 2][EXPORT_CELL_W / 2]; // Pixels set of each 2x2 block, for chroma
+} ExportGlyph;
+
+typedef struct ExportJob {
+    enum ExportState state;
+    Cell *cells;          // Colors resolved to 0xRRGGBB
+    int cols, rows;
+    int64_t pts;
+    AVFrame *frame;
+} ExportJob;
+
+typedef struct Exporter {
+    const char *filename;
+    VTerm vt;
+    AVFormatContext *oc;
+    AVCodecContext *enc;
+    AVPacket *pkt;
+    int header_written;
+    pthread_t threads[EXPORT_MAX_THREADS], encoder;
+    int nb_threads, encoder_running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ExportJob jobs[EXPORT_QUEUE_SIZE];
+    unsigned head, tail;  // Jobs queued and encoded so far
+    int closing;          // No more jobs, the threads finish the queue and exit
+    int ret;              // First error of any thread
+    int failed;           // Copy of ret the main thread checks between frames
+    int64_t t;            // Position of the frame being exported, AV_TIME_BASE
+    int64_t first_t, last_t, last_pts;
+    int64_t start_ns, draw_ns, encode_ns;
+    int frames;
+} Exporter;
+
+static Exporter *exporter;
+static ExportGlyph export_font[EXPORT_GLYPHS];
+static uint64_t export_spread[256]; // A row of glyph bits as 8 bytes of 0x00 or 0xFF
+
+// What the text renderers print, VGA style
+static const struct {
+    char ch;
+    uint8_t rows[EXPORT_CELL_H];
+} export_ascii[] = {
+    { '.', { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x18, 0x18, 0, 0, 0, 0 } },
+    { '-', { 0, 0, 0, 0, 0, 0, 0, 0xFE, 0, 0, 0, 0, 0, 0, 0, 0 } },
+    { '+', { 0, 0, 0, 0, 0, 0x18, 0x18, 0x7E, 0x18, 0x18, 0, 0, 0, 0, 0, 0 } },
+    { '#', { 0, 0, 0, 0x6C, 0x6C, 0xFE, 0x6C, 0x6C, 0x6C, 0xFE, 0x6C, 0x6C, 0, 0, 0, 0 } },
+    { '?', { 0, 0, 0x7C, 0xC6, 0xC6, 0x0C, 0x18, 0x18, 0x18, 0, 0x18, 0x18, 0, 0, 0, 0 } },
+};
+
+static void export_font_init(void)
+{
+    // Quadrant masks of U+2580..U+259F, bit 0 upper left, 1 upper right, 2 lower left, 3 lower right
+    static const uint8_t quadrants[32] = { [0x00] = 3, [0x04] = 12, [0x08] = 15, [0x0C] = 5, [0x10] = 10,
+                                           [0x16] = 4, 8, 1, 13, 9, 7, 11, 2, 6, 14 };
+    static const uint8_t shades[3][2] = { { 0x88, 0x22 }, { 0xAA, 0x55 }, { 0xEE, 0xBB } };
+    int i, j, x, y;
+
+    for (i = 0; i < 256; i++) {
+        uint8_t b[8];
+        for (x = 0; x < 8; x++)
+            b[x] = i >> (7 - x) & 1 ? 0xFF : 0;
+        memcpy(&export_spread[i], b, 8);
+    }
+
+    for (i = 0; i < 128; i++) {
+        ExportGlyph *g = &export_font[i];
+        if (i == ' ')
+            continue;
+        // Anything else the renderers don't print shows up as '?'
+        for (j = 0; j < FF_ARRAY_ELEMS(export_ascii) - 1 && export_ascii[j].ch != i; j++)
+            ;
+        memcpy(g->rows, export_ascii[j].rows, EXPORT_CELL_H);
+    }
+    for (i = 0; i < 32; i++) {
+        uint8_t *rows = export_font[128 + i].rows;
+        int q = quadrants[i];
+
+        for (y = 0; y < EXPORT_CELL_H; y++) {
+            if (q)
+                rows[y] = (q >> (y < 8 ? 0 : 2) & 1 ? 0xF0 : 0) | (q >> (y < 8 ? 1 : 3) & 1 ? 0x0F : 0);
+            else if (i >= 0x01 && i <= 0x07) // Lower eighths
+                rows[y] = y >= EXPORT_CELL_H - 2 * i ? 0xFF : 0;
+            else if (i >= 0x09 && i <= 0x0F) // Left eighths, 7/8 down to 1/8
+                rows[y] = 0xFF << (i - 8);
+            else if (i >= 0x11 && i <= 0x13) // Light, medium and dark shade
+                rows[y] = shades[i - 0x11][y & 1];
+            else if (i == 0x14)              // Upper eighth
+                rows[y] = y < 2 ? 0xFF : 0;
+            else if (i == 0x15)              // Right eighth
+                rows[y] = 0x01;
+        }
+    }
+
+    for (i = 0; i < EXPORT_GLYPHS; i++) {
+        ExportGlyph *g = &export_font[i];
+        for (y = 0; y < EXPORT_CELL_H / 2; y++)
+            for (x = 0; x < EXPORT_CELL_W / 2; x++) {
+                int m = 0xC0 >> 2 * x;
+                g->cover[y][x] = av_popcount(g->rows[2 * y] & m) + av_popcount(g->rows[2 * y + 1] & m);
+            }
+    }
+}
+
+static const ExportGlyph *export_glyph(uint32_t ch)
+{
+    if (ch < 128)
+        return &export_font[ch];
+    if (ch >= 0x2580 && ch <= 0x259F)
+        return &export_font[128 + ch - 0x2580];
+    return &export_font['?'];
+}
+
+/* A cell color as 0xRRGGBB, default colors are light gray on black. */
+static uint32_t export_rgb(uint32_t color, int bg)
+{
+    static const uint8_t cube[6] = { 0, 95, 135, 175, 215, 255 };
+    int i;
+
+    if (color & CELL_RGB)
+        return color & 0xFFFFFF;
+    if (!(color & CELL_INDEXED)) {
+        if (bg)
+            return 0;
+        i = 7;
+    } else if ((i = color & 0xFF) >= 232) {
+        i = 8 + 10 * (i - 232);
+        return i << 16 | i << 8 | i;
+    } else if (i >= 16) {
+        i -= 16;
+        return cube[i / 36] << 16 | cube[i / 6 % 6] << 8 | cube[i % 6];
+    }
+    return ansi16_rgb[i][0] << 16 | ansi16_rgb[i][1] << 8 | ansi16_rgb[i][2];
+}
+
+/* BT.709, limited range, as the encoder is told. */
+static void export_yuv(uint32_t rgb, int *y, int *u, int *v)
+{
+    int r = rgb >> 16, g = rgb >> 8 & 0xFF, b = rgb & 0xFF;
+
+    *y = 16 + ((47 * r + 157 * g + 16 * b + 128) >> 8);
+    *u = 128 + ((-26 * r - 87 * g + 112 * b + 128) >> 8);
+    *v = 128 + ((112 * r - 102 * g - 10 * b + 128) >> 8);
+}
+
+static int export_frame_alloc(AVFrame *f, int width, int height)
+{
+    f->format = AV_PIX_FMT_YUV420P;
+    f->width = width;
+    f->height = height;
+    f->color_range = AVCOL_RANGE_MPEG;
+    f->colorspace = AVCOL_SPC_BT709;
+    return av_frame_get_buffer(f, 0);
+}
+
+/*
+ * Draw a job's grid into its frame. Luma takes one 64-bit store per glyph
+ * row: the row's bits spread to a byte mask choose between the foreground
+ * and background value replicated across the word. Chroma is blended by
+ * how much of each 2x2 block the glyph covers.
+ */
+static int export_draw(const Exporter *e, ExportJob *job)
+{
+    AVFrame *f = job->frame;
+    int cols = FFMIN(job->cols, e->enc->width / EXPORT_CELL_W);
+    int rows = FFMIN(job->rows, e->enc->height / EXPORT_CELL_H);
+    int ret, cx, cy, x, y;
+
+    // The encoder may still hold the last picture, which is not worth copying
+    if (!av_frame_is_writable(f)) {
+        av_frame_unref(f);
+        if ((ret = export_frame_alloc(f, e->enc->width, e->enc->height)) < 0)
+            return ret;
+    }
+    f->pts = job->pts;
+    if (cols * EXPORT_CELL_W < f->width || rows * EXPORT_CELL_H < f->height) {
+        // A grid smaller than the first one, the rest stays black
+        for (y = 0; y < f->height; y++)
+            memset(f->data[0] + y * f->linesize[0], 16, f->width);
+        for (y = 0; y < f->height / 2; y++) {
+            memset(f->data[1] + y * f->linesize[1], 128, f->width / 2);
+            memset(f->data[2] + y * f->linesize[2], 128, f->width / 2);
+        }
+    }
+
+    for (cy = 0; cy < rows; cy++) {
+        for (cx = 0; cx < cols; cx++) {
+            const Cell *c = &job->cells[cy * job->cols + cx];
+            const ExportGlyph *g = export_glyph(c->ch);
+            uint8_t *dy = f->data[0] + cy * EXPORT_CELL_H * f->linesize[0] + cx * EXPORT_CELL_W;
+            uint8_t *du = f->data[1] + cy * EXPORT_CELL_H / 2 * f->linesize[1] + cx * EXPORT_CELL_W / 2;
+            uint8_t *dv = f->data[2] + cy * EXPORT_CELL_H / 2 * f->linesize[2] + cx * EXPORT_CELL_W / 2;
+            int fy, fu, fv, by, bu, bv;
+            uint64_t wf, wb;
+
+            export_yuv(c->fg, &fy, &fu, &fv);
+            export_yuv(c->bg, &by, &bu, &bv);
+            wf = fy * 0x0101010101010101ULL;
+            wb = by * 0x0101010101010101ULL;
+            for (y = 0; y < EXPORT_CELL_H; y++) {
+                uint64_t m = export_spread[g->rows[y]], w = (wf & m) | (wb & ~m);
+                memcpy(dy + y * f->linesize[0], &w, 8);
+            }
+            for (y = 0; y < EXPORT_CELL_H / 2; y++) {
+                for (x = 0; x < EXPORT_CELL_W / 2; x++) {
+                    int n = g->cover[y][x];
+                    du[x] = (fu * n + bu * (4 - n) + 2) >> 2;
+                    dv[x] = (fv * n + bv * (4 - n) + 2) >> 2;
+                }
+                du += f->linesize[1];
+                dv += f->linesize[2];
+            }
+        }
+    }
+    return 0;
+}
+
+/* Send a frame to the encoder (NULL drains it) and mux what comes out. */
+static int export_encode(Exporter *e, AVFrame *frame)
+{
+    int ret = avcodec_send_frame(e->enc, frame);
+
+    while (ret >= 0) {
+        if ((ret = avcodec_receive_packet(e->enc, e->pkt)) < 0)
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+        av_packet_rescale_ts(e->pkt, e->enc->time_base, e->oc->streams[0]->time_base);
+        e->pkt->stream_index = 0;
+        ret = av_interleaved_write_frame(e->oc, e->pkt);
+    }
+    return ret;
+}
+
+/* Keep the first error. Called with e->lock held once the threads run. */
+static void export_fail(Exporter *e, int ret)
+{
+    if (ret < 0 && !e->ret) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot export to %s: %s\n", e->filename, av_err2str(ret));
+        e->ret = ret;
+    }
+}
+
+/* An error on the main thread: export_send() takes no more frames. */
+static void export_abort(Exporter *e, int ret)
+{
+    pthread_mutex_lock(&e->lock);
+    export_fail(e, ret);
+    e->failed = e->ret;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void *export_draw_thread(void *arg)
+{
+    Exporter *e = arg;
+    ExportJob *job;
+    unsigned i;
+    int64_t t0;
+    int ret;
+
+    thread_enter(ROLE_FILTER);
+    pthread_mutex_lock(&e->lock);
+    while (1) {
+        for (job = NULL, i = e->tail; i != e->head && !job; i++)
+            if (e->jobs[i % EXPORT_QUEUE_SIZE].state == EXPORT_QUEUED)
+                job = &e->jobs[i % EXPORT_QUEUE_SIZE];
+        if (!job) {
+            if (e->closing)
+                break;
+            pthread_cond_wait(&e->cond, &e->lock);
+            continue;
+        }
+        job->state = EXPORT_DRAWING;
+        pthread_mutex_unlock(&e->lock);
+
+        t0 = now_ns();
+        ret = export_draw(e, job);
+
+        pthread_mutex_lock(&e->lock);
+        e->draw_ns += now_ns() - t0;
+        export_fail(e, ret);
+        job->state = EXPORT_DRAWN;
+        pthread_cond_broadcast(&e->cond);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+static void *export_encode_thread(void *arg)
+{
+    Exporter *e = arg;
+    int64_t t0;
+    int ret;
+
+    thread_enter(ROLE_FILTER);
+    pthread_mutex_lock(&e->lock);
+    while (1) {
+        ExportJob *job = &e->jobs[e->tail % EXPORT_QUEUE_SIZE];
+
+        if (e->tail == e->head && e->closing)
+            break;
+        if (e->tail == e->head || job->state != EXPORT_DRAWN) {
+            pthread_cond_wait(&e->cond, &e->lock);
+            continue;
+        }
+        ret = e->ret;
+        pthread_mutex_unlock(&e->lock);
+
+        // After an error the queue is only emptied
+        t0 = now_ns();
+        if (!ret)
+            ret = export_encode(e, job->frame);
+
+        pthread_mutex_lock(&e->lock);
+        e->encode_ns += now_ns() - t0;
+        export_fail(e, ret);
+        e->frames += !ret;
+        job->state = EXPORT_FREE;
+        e->tail++;
+        pthread_cond_broadcast(&e->cond);
+    }
+    ret = e->ret;
+    pthread_mutex_unlock(&e->lock);
+
+    if (!ret) {
+        t0 = now_ns();
+        ret = export_encode(e, NULL);
+        pthread_mutex_lock(&e->lock);
+        e->encode_ns += now_ns() - t0;
+        export_fail(e, ret);
+        pthread_mutex_unlock(&e->lock);
+    }
+    return NULL;
+}
+
+static int export_open(const char *filename)
+{
+    if (!(exporter = av_mallocz(sizeof(*exporter))))
+        return AVERROR(ENOMEM);
+    exporter->filename = filename;
+    exporter->last_pts = AV_NOPTS_VALUE;
+    exporter->first_t = AV_NOPTS_VALUE;
+    pthread_mutex_init(&exporter->lock, NULL);
+    pthread_cond_init(&exporter->cond, NULL);
+    export_font_init();
+    return 0;
+}
+
+/* Set up the encoder, muxer and threads for pictures of width x height. */
+static int export_start(Exporter *e, int width, int height)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    AVStream *st;
+    int ret, i;
+
+    if (!codec && !(codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4))) {
+        av_log(NULL, AV_LOG_ERROR, "Neither libx264 nor mpeg4 encoder found\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    if ((ret = avformat_alloc_output_context2(&e->oc, NULL, NULL, e->filename)) < 0)
+        return ret;
+    if (!(st = avformat_new_stream(e->oc, NULL)) || !(e->enc = avcodec_alloc_context3(codec)) ||
+        !(e->pkt = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+
+    e->enc->width = width;
+    e->enc->height = height;
+    e->enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    e->enc->sample_aspect_ratio = (AVRational){ 1, 1 };
+    e->enc->time_base = (AVRational){ 1, 1000 }; // Frames keep their own timing, not a fixed rate
+    e->enc->color_range = AVCOL_RANGE_MPEG;
+    e->enc->colorspace = AVCOL_SPC_BT709;
+    e->enc->color_primaries = AVCOL_PRI_BT709;
+    e->enc->color_trc = AVCOL_TRC_BT709;
+    if (codec->id == AV_CODEC_ID_H264) {
+        av_opt_set(e->enc->priv_data, "preset", "veryfast", 0);
+        av_opt_set(e->enc->priv_data, "crf", "20", 0);
+    } else {
+        e->enc->flags |= AV_CODEC_FLAG_QSCALE;
+        e->enc->global_quality = FF_QP2LAMBDA * 3;
+    }
+    if (e->oc->oformat->flags & AVFMT_GLOBALHEADER)
+        e->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if ((ret = avcodec_open2(e->enc, codec, NULL)) < 0 ||
+        (ret = avcodec_parameters_from_context(st->codecpar, e->enc)) < 0)
+        return ret;
+    st->time_base = e->enc->time_base;
+
+    if (!(e->oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&e->oc->pb, e->filename, AVIO_FLAG_WRITE)) < 0)
+        return ret;
+    if ((ret = avformat_write_header(e->oc, NULL)) < 0)
+        return ret;
+    e->header_written = 1;
+
+    for (i = 0; i < EXPORT_QUEUE_SIZE; i++) {
+        if (!(e->jobs[i].frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        if ((ret = export_frame_alloc(e->jobs[i].frame, width, height)) < 0)
+            return ret;
+    }
+
+    // The encoder has threads of its own, drawing needs only a few
+    e->nb_threads = av_clip(av_cpu_count() / 4, 1, EXPORT_MAX_THREADS);
+    if ((ret = pthread_create(&e->encoder, NULL, export_encode_thread, e)))
+        return AVERROR(ret);
+    e->encoder_running = 1;
+    for (i = 0; i < e->nb_threads; i++)
+        if ((ret = pthread_create(&e->threads[i], NULL, export_draw_thread, e))) {
+            e->nb_threads = i;
+            return AVERROR(ret);
+        }
+    av_log(NULL, AV_LOG_INFO, "Exporting %dx%d %s to %s\n", width, height, codec->name, e->filename);
+    e->start_ns = now_ns();
+    return 0;
+}
+
+/* Queue one frame of renderer output for the file. */
+static void export_send(const RenderContext *rc, OutBuf *ansi)
+{
+    Exporter *e = exporter;
+    int cols = rc->cols, rows = rc->rows, n = cols * rows, i, ret;
+    int64_t pts;
+    ExportJob *job;
+
+    if (e->failed) {
+        ansi->len = 0;
+        return;
+    }
+    if ((ret = vt_fit(&e->vt, cols, rows)) < 0) {
+        export_abort(e, ret);
+        return;
+    }
+    vt_feed(&e->vt, ansi->data, ansi->len);
+    stats.bytes_written += ansi->len;
+    ansi->len = 0;
+    ansi->error = 0;
+
+    // The first grid sets the picture size for the whole file
+    if (!e->enc && (ret = export_start(e, cols * EXPORT_CELL_W, rows * EXPORT_CELL_H)) < 0) {
+        export_abort(e, ret);
+        return;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    job = &e->jobs[e->head % EXPORT_QUEUE_SIZE];
+    while (job->state != EXPORT_FREE && !e->ret)
+        pthread_cond_wait(&e->cond, &e->lock);
+    e->failed = e->ret;
+    pthread_mutex_unlock(&e->lock);
+    if (e->failed)
+        return;
+
+    // Free jobs belong to the main thread
+    if (job->cols * job->rows != n) {
+        av_freep(&job->cells);
+        if (!(job->cells = av_malloc_array(n, sizeof(*job->cells)))) {
+            job->cols = job->rows = 0;
+            export_abort(e, AVERROR(ENOMEM));
+            return;
+        }
+    }
+    job->cols = cols;
+    job->rows = rows;
+    for (i = 0; i < n; i++) {
+        job->cells[i].ch = e->vt.cells[i].ch;
+        job->cells[i].fg = export_rgb(vt_color(&e->vt, e->vt.cells[i].fg), 0);
+        job->cells[i].bg = export_rgb(vt_color(&e->vt, e->vt.cells[i].bg), 1);
+    }
+    // Timestamps have to increase even across a seek back
+    pts = av_rescale_q(e->t, AV_TIME_BASE_Q, e->enc->time_base);
+    if (e->last_pts != AV_NOPTS_VALUE && pts <= e->last_pts)
+        pts = e->last_pts + 1;
+    e->last_pts = job->pts = pts;
+    if (e->first_t == AV_NOPTS_VALUE)
+        e->first_t = e->t;
+    e->last_t = e->t;
+
+    pthread_mutex_lock(&e->lock);
+    job->state = EXPORT_QUEUED;
+    e->head++;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+}
+
+/* Finish the file. Returns the first error of the export, if any. */
+static int export_close(void)
+{
+    Exporter *e = exporter;
+    int64_t ns;
+    int ret, i;
+
+    if (!e)
+        return 0;
+    pthread_mutex_lock(&e->lock);
+    e->closing = 1;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+    for (i = 0; i < e->nb_threads; i++)
+        pthread_join(e->threads[i], NULL);
+    if (e->encoder_running)
+        pthread_join(e->encoder, NULL);
+
+    if (e->header_written)
+        export_fail(e, av_write_trailer(e->oc));
+    ret = e->ret;
+    if (e->frames) {
+        ns = FFMAX(now_ns() - e->start_ns, 1);
+        fprintf(stderr, "Export: %d frames in %.1f s (%.1fx real time), %.2f ms/frame drawing on %d threads, "
+                "%.2f ms/frame encoding with %s\n", e->frames, ns / 1e9,
+                (e->last_t - e->first_t) * 1e3 / ns, e->draw_ns / 1e6 / e->frames, e->nb_threads,
+                e->encode_ns / 1e6 / e->frames, e->enc->codec->name);
+    }
+
+    for (i = 0; i < EXPORT_QUEUE_SIZE; i++) {
+        av_freep(&e->jobs[i].cells);
+        av_frame_free(&e->jobs[i].frame);
+    }
+    if (e->oc && !(e->oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&e->oc->pb);
+    avformat_free_context(e->oc);
+    avcodec_free_context(&e->enc);
+    av_packet_free(&e->pkt);
+    vt_free(&e->vt);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->cond);
+    av_freep(&exporter);
+    return ret;
+}
+
+static const Renderer *const renderers[] = {
+    &ramp_renderer,
+    &quad_renderer,
+    &sixel_renderer,
+    &kitty_renderer,
+    NULL,
+};
+
+static const Renderer *find_renderer(const char *name)
+{
+    int i;
+
+    for (i = 0; renderers[i]; i++)
+        if (!strcmp(renderers[i]->name, name))
+            return renderers[i];
+    return NULL;
+}
+
+static RenderContext *renderer_alloc(const Renderer *renderer)
+{
+    RenderContext *rc = av_mallocz(sizeof(*rc));
+
+    if (!rc)
+        return NULL;
+    rc->renderer = renderer;
+    if (renderer->priv_data_size && !(rc->priv_data = av_mallocz(renderer->priv_data_size)))
+        av_freep(&rc);
+    return rc;
+}
+
+static void renderer_free(RenderContext **rc)
+{
+    if (!*rc)
+        return;
+    if ((*rc)->initialized && (*rc)->renderer->uninit)
+        (*rc)->renderer->uninit(*rc);
+    av_freep(&(*rc)->priv_data);
+    av_freep(&(*rc)->row_hash);
+    av_freep(&(*rc)->prev_row_hash);
+    av_freep(&(*rc)->dirty_rows);
+    av_freep(rc);
+}
+
+/*
+ * Make sure the renderer is set up for the grid the frame covers: the first
+ * frame initializes it, a new aspect ratio (another playlist item, or a
+ * resolution change mid-stream) resizes it. Returns 1 if the grid changed.
+ */
+static int renderer_configure(RenderContext *rc, const AVFrame *frame)
+{
+    const Renderer *r = rc->renderer;
+    int cols = frame->width / r->cell_w, rows = frame->height / r->cell_h, ret;
+
+    if (rc->initialized && cols == rc->cols && rows == rc->rows)
+        return 0;
+    rc->cols = cols;
+    rc->rows = rows;
+    if (!rc->initialized) {
+        if (r->init && (ret = r->init(rc)) < 0)
+            return ret;
+        rc->initialized = 1;
+    } else if (r->resize && (ret = r->resize(rc)) < 0) {
+        return ret;
+    }
+    return 1;
+}
+
+/*
+ * --pip=FILE shows a second video as an inset in the bottom right corner.
+ * It has a thread of its own that demuxes, decodes with as little effort
+ * as an inset allows (see open_input_file()), scales and renders it to
+ * cells, all on its own clock: it plays from when it was started and
+ * drops frames it is late for before they are filtered, whatever the main
+ * picture does. The inset is handed over as finished escape sequences,
+ * one run per row, through a triple buffer: the thread fills the back
+ * buffer and swaps it with the latest one, display_frame() swaps the
+ * latest one for its front buffer. Neither waits for the other, and all
+ * the main picture pays is copying the rows into its output. An input
+ * that ends starts over.
+ */
+#define PIP_FRESH 4 // Set in Pip.latest until display_frame() took it
+
+typedef struct PipInset {
+    OutBuf ob;            // The rows, each one sets its own colors
+    int *row_end;         // Offset in ob after each row
+    Cell *cells;          // What they draw, for --verify
+    int cols, rows;
+} PipInset;
+
+typedef struct Pip {
+    pthread_t thread;
+    int running;
+    atomic_int stop;
+    InputFile *in;
+    RenderContext *rc;
+    OutBuf ob;            // Renderer output, positioned by the VTerm
+    VTerm vt;
+    PipInset insets[3];
+    int back, front;      // Owned by the thread and by display_frame()
+    atomic_int latest;    // The other one, | PIP_FRESH if not displayed yet
+    PlaybackStats render_stats;
+    atomic_int shown, dropped;
+    int ret;
+} Pip;
+
+static Pip *pip;
+static int pip_width;     // Columns, 0 for a quarter of the main picture
+
+/* Turn the VTerm's cells into the back inset. */
+static int pip_serialize(Pip *p, PipInset *inset, int cols, int rows)
+{
+    uint32_t fg, bg;
+    int x, y;
+
+    if (inset->rows != rows || inset->cols != cols) {
+        inset->rows = 0;
+        av_freep(&inset->row_end);
+        av_freep(&inset->cells);
+        if (!(inset->row_end = av_malloc_array(rows, sizeof(*inset->row_end))) ||
+            !(inset->cells = av_malloc_array((size_t)rows * cols, sizeof(*inset->cells))))
+            return AVERROR(ENOMEM);
+    }
+    inset->cols = cols;
+    inset->rows = rows;
+    inset->ob.len = 0;
+    for (y = 0; y < rows; y++) {
+        // Colors the renderer's palette gave cells, not the terminal's. The
+        // first 16 only come from ansi16, whose palette is the terminal's own
+        for (x = 0, fg = bg = ~0u; x < cols; x++) {
+            const Cell *c = &p->vt.cells[y * cols + x];
+            uint32_t cf = vt_color(&p->vt, c->fg), cb = vt_color(&p->vt, c->bg);
+
+            if (cf != fg || cb != bg) {
+                ob_puts(&inset->ob, "\033[0");
+                put_cell_color(&inset->ob, cf, 0);
+                put_cell_color(&inset->ob, cb, 1);
+                ob_putc(&inset->ob, 'm');
+                fg = cf;
+                bg = cb;
+            }
+            ob_put_utf8(&inset->ob, c->ch);
+            inset->cells[y * cols + x] = (Cell){ c->ch, cf, cb };
+        }
+        inset->row_end[y] = inset->ob.len;
+    }
+    return inset->ob.error ? AVERROR(ENOMEM) : 0;
+}
+
+/* Render a scaled frame into the back inset and publish it. */
+static int pip_show(Pip *p, const AVFrame *frame)
+{
+    PipInset *inset = &p->insets[p->back];
+    int ret;
+
+    if ((ret = renderer_configure(p->rc, frame)) < 0)
+        return ret;
+    p->ob.len = 0;
+    ob_puts(&p->ob, "\033[H");
+    if ((ret = p->rc->renderer->render(p->rc, frame, &p->ob)) < 0)
+        return ret;
+    if ((ret = vt_fit(&p->vt, p->rc->cols, p->rc->rows)) < 0)
+        return ret;
+    vt_feed(&p->vt, p->ob.data, p->ob.len);
+    if ((ret = pip_serialize(p, inset, p->rc->cols, p->rc->rows)) < 0)
+        return ret;
+    p->back = atomic_exchange(&p->latest, p->back | PIP_FRESH) & ~PIP_FRESH;
+    return 0;
+}
+
+/* Sleep until the deadline on the relative clock, or until asked to stop. */
+static void pip_wait(Pip *p, int64_t deadline)
+{
+    int64_t left;
+
+    while (!atomic_load(&p->stop) && (left = deadline - av_gettime_relative()) > 0)
+        av_usleep(FFMIN(left, 20000));
+}
+
+static void *pip_thread(void *arg)
+{
+    Pip *p = arg;
+    InputFile *in = p->in;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc(), *filt_frame = av_frame_alloc();
+    AVStream *st;
+    int64_t anchor = AV_NOPTS_VALUE, first_pts = AV_NOPTS_VALUE, t, duration;
+    int ret, decoded = 0;
+
+    thread_metrics = &pip_metrics;
+    render_stats = &p->render_stats;
+    thread_enter(ROLE_DECODE);
+    if (!packet || !frame || !filt_frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = open_input_file(in)) < 0)
+        goto end;
+    st = in->fmt_ctx->streams[in->video_stream_index];
+    duration = av_rescale_q(1, av_inv_q(av_guess_frame_rate(in->fmt_ctx, st, NULL)), AV_TIME_BASE_Q);
+    if (duration <= 0)
+        duration = AV_TIME_BASE / 25;
+
+    while (!atomic_load(&p->stop)) {
+        if ((ret = decode_next_frame(in, packet, frame)) == AVERROR_EOF && decoded) {
+            // Start over, on a clock starting over too
+            av_seek_frame(in->fmt_ctx, -1, in->fmt_ctx->start_time != AV_NOPTS_VALUE ? in->fmt_ctx->start_time : 0,
+                          AVSEEK_FLAG_BACKWARD);
+            avcodec_flush_buffers(in->dec_ctx);
+            in->eof = 0;
+            anchor = first_pts = AV_NOPTS_VALUE;
+            decoded = 0;
+            continue;
+        }
+        if (ret < 0)
+            break;
+        decoded++;
+
+        if (frame->pts != AV_NOPTS_VALUE && first_pts == AV_NOPTS_VALUE)
+            first_pts = frame->pts;
+        t = frame->pts == AV_NOPTS_VALUE ? 0 : av_rescale_q(frame->pts - first_pts, st->time_base, AV_TIME_BASE_Q);
+        if (anchor == AV_NOPTS_VALUE)
+            anchor = av_gettime_relative() - t;
+        if (av_gettime_relative() > anchor + t + duration) {
+            // Late by a frame: drop it before it costs anything more
+            atomic_fetch_add(&p->dropped, 1);
+            av_frame_unref(frame);
+            continue;
+        }
+
+        if ((ret = get_filter_graph(in, frame)) < 0 || (ret = filter_push(in->graph, frame)) < 0)
+            break;
+        av_frame_unref(frame);
+        while ((ret = filter_pull(in->graph, filt_frame)) >= 0) {
+            pip_wait(p, anchor + t);
+            ret = pip_show(p, filt_frame);
+            av_frame_unref(filt_frame);
+            if (ret < 0)
+                goto end;
+            atomic_fetch_add(&p->shown, 1);
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            break;
+        ret = 0;
+    }
+
+end:
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Picture-in-picture %s stopped: %s\n", in->filename, av_err2str(ret));
+    p->ret = ret;
+    av_frame_free(&frame);
+    av_frame_free(&filt_frame);
+    av_packet_free(&packet);
+    return NULL;
+}
+
+static int pip_start(const char *filename, const Renderer *renderer)
+{
+    int ret;
+
+    if (!(pip = av_mallocz(sizeof(*pip))) || !(pip->in = av_mallocz(sizeof(*pip->in))) ||
+        !(pip->in->filename = av_strdup(filename)) || !(pip->rc = renderer_alloc(renderer)))
+        return AVERROR(ENOMEM);
+    pip->in->video_stream_index = -1;
+    pip->in->seek_pts = AV_NOPTS_VALUE;
+    pip->in->renderer = renderer;
+    pip->in->ascii_width = pip_width ? pip_width : FFMAX(ascii_width / 4, 8);
+    pip->in->inset_width = pip->in->ascii_width * renderer->cell_w;
+    // Buffer 0 is the front one, 1 the latest (empty so far) and 2 the back one
+    pip->front = 0;
+    atomic_init(&pip->latest, 1);
+    pip->back = 2;
+
+    if ((ret = pthread_create(&pip->thread, NULL, pip_thread, pip))) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot start the picture-in-picture thread\n");
+        return AVERROR(ret);
+    }
+    pip->running = 1;
+    return 0;
+}
+
+static void pip_stop(void)
+{
+    int i;
+
+    if (!pip)
+        return;
+    if (pip->running) {
+        atomic_store(&pip->stop, 1);
+        pthread_join(pip->thread, NULL);
+        stats.pip_shown = atomic_load(&pip->shown);
+        stats.pip_dropped = atomic_load(&pip->dropped);
+        stats.pip_lowres = pip->in->dec_ctx ? pip->in->dec_ctx->lowres : 0;
+    }
+    if (pip->in)
+        close_input_file(pip->in);
+    renderer_free(&pip->rc);
+    vt_free(&pip->vt);
+    av_freep(&pip->ob.data);
+    for (i = 0; i < 3; i++) {
+        av_freep(&pip->insets[i].ob.data);
+        av_freep(&pip->insets[i].row_end);
+        av_freep(&pip->insets[i].cells);
+    }
+    av_freep(&pip);
+}
+
+/* Draw the latest inset over the frame in ob, in the bottom right corner with a cell of margin. */
+static void pip_overlay(RenderContext *rc, OutBuf *ob)
+{
+    const PipInset *inset;
+    int top, left, y;
+
+    if (rc->renderer->graphics)
+        return;
+    if (atomic_load(&pip->latest) & PIP_FRESH)
+        pip->front = atomic_exchange(&pip->latest, pip->front) & ~PIP_FRESH;
+    inset = &pip->insets[pip->front];
+    top = rc->rows - inset->rows - 1;
+    left = rc->cols - inset->cols - 1;
+    if (!inset->rows || top < 0 || left < 0)
+        return;
+    for (y = 0; y < inset->rows; y++) {
+        int start = y ? inset->row_end[y - 1] : 0;
+        ob_printf(ob, "\033[%d;%dH", top + y + 1, left + 1);
+        ob_write(ob, inset->ob.data + start, inset->row_end[y] - start);
+        if (rc->grid)
+            memcpy(rc->grid + (top + y) * rc->cols + left, inset->cells + y * inset->cols,
+                   inset->cols * sizeof(*inset->cells));
+    }
+    ob_puts(ob, "\033[0m");
+}
+
+/*
+ * Partial redraws for the text renderers. Every row of cells gets a hash
+ * of the pixels behind it. When most rows of a frame match the previous
+ * frame's rows shifted by the same amount, the content scrolled: the
+ * terminal moves it with a scroll region and only rows without a match
+ * are drawn. Without a shift, rows that didn't change are skipped.
+ */
+#define FULL_REDRAW_INTERVAL 100 // Frames, repairs whatever else wrote to the terminal
+
+static uint64_t row_hash(const uint8_t *p, int linesize, int bytes, int lines)
+{
+    static const uint64_t k = 0x9E3779B97F4A7C15ULL;
+    uint64_t h[4] = { 1, 2, 3, 4 }, v;
+    int l, i, j;
+
+    for (l = 0; l < lines; l++, p += linesize) {
+        // Four independent lanes, so the multiplies overlap
+        for (i = 0; i + 32 <= bytes; i += 32) {
+            for (j = 0; j < 4; j++) {
+                memcpy(&v, p + i + 8 * j, 8);
+                h[j] = (h[j] ^ v) * k;
+                h[j] ^= h[j] >> 32;
+            }
+        }
+        for (; i < bytes; i++)
+            h[0] = (h[0] ^ p[i]) * k;
+    }
+    return h[0] ^ (h[1] << 16 | h[1] >> 48) ^ (h[2] << 32 | h[2] >> 32) ^ (h[3] << 48 | h[3] >> 16);
+}
+
+/* Decide which rows of the frame need drawing, emitting a scroll if that saves work. */
+static void plan_redraw(RenderContext *rc, const AVFrame *frame, int full)
+{
+    int rows = rc->rows, cell_h = rc->renderer->cell_h;
+    int bytes = rc->cols * rc->renderer->cell_w * (frame->format == AV_PIX_FMT_RGB24 ? 3 : 1);
+    int planes = frame->format == AV_PIX_FMT_YUV444P ? 3 : 1;
+    int y, s, p, shift = 0, matches, best = -1;
+
+    rc->row_mask = NULL;
+    rc->shift = 0;
+    if (rc->hash_rows != rows) {
+        av_freep(&rc->row_hash);
+        av_freep(&rc->prev_row_hash);
+        av_freep(&rc->dirty_rows);
+        rc->hash_rows = 0;
+        if (!(rc->row_hash = av_malloc_array(rows, sizeof(*rc->row_hash))) ||
+            !(rc->prev_row_hash = av_malloc_array(rows, sizeof(*rc->prev_row_hash))) ||
+            !(rc->dirty_rows = av_malloc(rows)))
+            return;
+        full = 1;
+    }
+    for (y = 0; y < rows; y++) {
+        rc->row_hash[y] = 0;
+        for (p = 0; p < planes; p++)
+            rc->row_hash[y] = (rc->row_hash[y] << 1 | rc->row_hash[y] >> 63) ^
+                              row_hash(frame->data[p] + y * cell_h * frame->linesize[p],
+                                       frame->linesize[p], bytes, cell_h);
+    }
+
+    if (!full && ++rc->since_full >= FULL_REDRAW_INTERVAL)
+        full = 1;
+    if (!full) {
+        // Content moving up by s rows shows the old row y + s at row y
+        for (s = -rows / 2; s <= rows / 2; s++) {
+            for (matches = 0, y = FFMAX(0, -s); y < FFMIN(rows, rows - s); y++)
+                matches += rc->row_hash[y] == rc->prev_row_hash[y + s];
+            if (matches > best || (matches == best && !s)) {
+                best = matches;
+                shift = s;
+            }
+        }
+        // Only a near pure scroll is worth it, otherwise just skip unchanged rows.
+        // A --pip inset would be scrolled along over rows we consider intact.
+        if (shift && (best * 10 < (rows - FFABS(shift)) * 9 || pip))
+            shift = 0;
+        for (y = 0; y < rows; y++)
+            rc->dirty_rows[y] = y + shift < 0 || y + shift >= rows ||
+                                rc->row_hash[y] != rc->prev_row_hash[y + shift];
+        if (shift) {
+            ob_printf(&out, "\033[1;%dr\033[%d%c\033[r", rows, FFABS(shift), shift > 0 ? 'S' : 'T');
+            stats.scrolls++;
+        }
+        rc->shift = shift;
+        rc->row_mask = rc->dirty_rows;
+    } else {
+        rc->since_full = 0;
+    }
+    rc->hash_rows = rows;
+    FFSWAP(uint64_t *, rc->row_hash, rc->prev_row_hash);
+}
+
+/*
+ * --verify checks the escape output against what it is supposed to show.
+ * Every frame is fed to a VTerm standing in for the terminal. While they
+ * draw, the text renderers note the cells they chose (glyph, palette
+ * index or RGB) in a grid of their own, without going through any escape
+ * sequence; rows skipped by a partial redraw keep what they had, moved
+ * along with a scroll, and a --pip inset is laid over it. Both have to
+ * end up with the same cells, anything else is a bug in the partial
+ * redraw, scroll or color encodings. The foreground of a blank cell
+ * doesn't show and isn't compared. No terminal is needed for this, the
+ * output can go to /dev/null; --stats then still shows the bytes and
+ * escape sequences per frame.
+ */
+#define VERIFY_MAX_REPORTS 10 // Differing frames logged in detail
+
+typedef struct Verify {
+    VTerm vt;             // What the terminal shows
+    Cell *expected;       // What it should show, RenderContext.grid
+    int cols, rows;
+    int frames, bad_frames;
+    int64_t bad_cells;
+    int64_t bytes, escapes;
+} Verify;
+
+static Verify *verify;
+
+static int verify_open(void)
+{
+    if (!(verify = av_mallocz(sizeof(*verify))))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+/* Print the summary. Returns the number of frames that didn't match. */
+static int verify_close(void)
+{
+    int bad;
+
+    if (!verify)
+        return 0;
+    fprintf(stderr, "Verify: %d frames, %d differed from the intended picture (%"PRId64" cells), "
+            "%"PRId64" bytes and %"PRId64" escape sequences per frame\n",
+            verify->frames, verify->bad_frames, verify->bad_cells,
+            verify->bytes / FFMAX(verify->frames, 1), verify->escapes / FFMAX(verify->frames, 1));
+    vt_free(&verify->vt);
+    av_freep(&verify->expected);
+    bad = verify->bad_frames;
+    av_freep(&verify);
+    return bad;
+}
+
+/*
+ * Before the renderer draws: bring the expected picture to where the
+ * terminal's will be once the screen was cleared (clear) or scrolled by
+ * rc->shift, and have the renderer note its cells there.
+ */
+static void verify_prepare(RenderContext *rc, int clear)
+{
+    int cols = rc->cols, rows = rc->rows, n = FFABS(rc->shift), i;
+
+    rc->grid = NULL;
+    if (rc->renderer->graphics)
+        return;
+    if (verify->cols != cols || verify->rows != rows) {
+        av_freep(&verify->expected);
+        if (!(verify->expected = av_malloc_array((size_t)cols * rows, sizeof(*verify->expected))))
+            return;
+        verify->cols = cols;
+        verify->rows = rows;
+        clear = 1;
+    }
+    if (clear) {
+        n = rows;
+    } else if (rc->shift > 0) {
+        memmove(verify->expected, verify->expected + n * cols, (size_t)(rows - n) * cols * sizeof(Cell));
+    } else if (rc->shift < 0) {
+        memmove(verify->expected + n * cols, verify->expected, (size_t)(rows - n) * cols * sizeof(Cell));
+    }
+    // Rows the scroll brought in are blank
+    for (i = 0; i < n * cols; i++)
+        verify->expected[(rc->shift > 0 && !clear ? rows - n : 0) * cols + i] =
+            (Cell){ ' ', CELL_DEFAULT, CELL_DEFAULT };
+    rc->grid = verify->expected;
+}
+
+static int cell_shows_same(const Cell *a, const Cell *b)
+{
+    return a->ch == b->ch && a->bg == b->bg && (a->fg == b->fg || a->ch == ' ');
+}
+
+/* Check the output of a frame, as it goes to the terminal, against the expected picture. */
+static void verify_frame(RenderContext *rc, const OutBuf *ob)
+{
+    int cols = rc->cols, rows = rc->rows, x, y, bad = 0;
+    int64_t escapes;
+
+    if (!rc->grid)
+        return;
+    rc->grid = NULL;
+    verify->frames++;
+    if (vt_fit(&verify->vt, cols, rows) < 0) {
+        // A frame that wasn't checked can't pass
+        if (verify->bad_frames++ < VERIFY_MAX_REPORTS)
+            av_log(NULL, AV_LOG_WARNING, "Frame %d could not be checked: out of memory\n", verify->frames);
+        return;
+    }
+
+    escapes = verify->vt.escapes;
+    vt_feed(&verify->vt, ob->data, ob->len);
+    verify->escapes += verify->vt.escapes - escapes;
+    verify->bytes += ob->len;
+
+    for (y = 0; y < rows; y++) {
+        for (x = 0; x < cols; x++) {
+            const Cell *got = &verify->vt.cells[y * cols + x], *want = &verify->expected[y * cols + x];
+
+            if (cell_shows_same(got, want))
+                continue;
+            if (!bad++ && verify->bad_frames < VERIFY_MAX_REPORTS)
+                av_log(NULL, AV_LOG_WARNING, "Frame %d differs at row %d, column %d: U+%04X %07X/%07X, "
+                       "should be U+%04X %07X/%07X\n", verify->frames, y + 1, x + 1,
+                       got->ch, got->fg, got->bg, want->ch, want->fg, want->bg);
+        }
+    }
+    if (bad) {
+        verify->bad_frames++;
+        verify->bad_cells += bad;
+        // Carry on from the intended picture, one bug shouldn't flag every later frame
+        memcpy(verify->vt.cells, verify->expected, (size_t)rows * cols * sizeof(Cell));
+    }
+}
+
+/*
+ * Flow control against the terminal. With --flow-control=N every frame
+ * ends in a Device Status Report request (CSI 6n). The terminal answers
+ * with the cursor position once it has worked through everything before
+ * the request, so the unanswered requests are the frames still sitting in
+ * kernel, SSH and terminal buffers. No frame is written while N of them
+ * are out; a frame that gets late waiting is dropped like any late frame.
+ *
+ * At startup a burst of blank screens followed by a request estimates the
+ * bytes per second the terminal keeps up with. Once the first frames show
+ * what a frame costs, the width is reduced to fit, unless -w was given.
+ */
+#define FLOW_MAX_IN_FLIGHT 16
+#define FLOW_TIMEOUT 2000000        // Microseconds until an answer is given up on
+#define FLOW_CALIBRATION_BYTES (64 << 10)
+#define FLOW_FIT_FRAMES 25          // Frames averaged before fitting the width
+#define FLOW_HEADROOM 0.8           // Share of the terminal's throughput frames may take
+
+typedef struct FlowControl {
+    int fd;               // Terminal input, -1 if off
+    struct termios saved;
+    int max_in_flight;
+    int64_t sent[FLOW_MAX_IN_FLIGHT]; // av_gettime_relative() of the open requests, oldest first
+    int in_flight;
+    int reply_len;        // Bytes of an answer seen so far, keystrokes are skipped
+    double bytes_per_sec; // Calibration result
+    int fitted;
+} FlowControl;
+
+static FlowControl flow = { .fd = -1 };
+static int width_set;     // -w was given, flow control leaves the width alone
+
+static void flow_pop(void)
+{
+    memmove(flow.sent, flow.sent + 1, --flow.in_flight * sizeof(*flow.sent));
+}
+
+/* Append a status request to the frame about to be written. */
+static void flow_request(OutBuf *ob)
+{
+    if (flow.fd < 0 || flow.in_flight == FLOW_MAX_IN_FLIGHT)
+        return;
+    ob_puts(ob, "\033[6n");
+    flow.sent[flow.in_flight++] = av_gettime_relative();
+}
+
+/* Consume terminal input, answers look like ESC [ row ; col R. */
+static void flow_read(void)
+{
+    uint8_t buf[256];
+    ssize_t n, i;
+    int64_t rtt;
+
+    while ((n = read(flow.fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            int c = buf[i];
+
+            if (c == 0x1B) {
+                flow.reply_len = 1;
+            } else if (flow.reply_len == 1) {
+                flow.reply_len = c == '[' ? 2 : 0;
+            } else if (flow.reply_len >= 2 && ((c >= '0' && c <= '9') || c == ';')) {
+                flow.reply_len++;
+            } else if (flow.reply_len > 2 && c == 'R') {
+                flow.reply_len = 0;
+                if (!flow.in_flight)
+                    continue;
+                rtt = av_gettime_relative() - flow.sent[0];
+                flow_pop();
+                stats.flow_answers++;
+                stats.flow_rtt += rtt;
+                stats.flow_rtt_max = FFMAX(stats.flow_rtt_max, rtt);
+            } else {
+                flow.reply_len = 0;
+            }
+        }
+    }
+}
+
+/* Wait up to timeout microseconds for every request to be answered. */
+static int flow_drain(int64_t timeout)
+{
+    int64_t end = av_gettime_relative() + timeout, left;
+    struct pollfd pfd = { .fd = flow.fd, .events = POLLIN };
+
+    while (flow.in_flight) {
+        if ((left = end - av_gettime_relative()) <= 0)
+            return AVERROR(ETIMEDOUT);
+        if (poll(&pfd, 1, left / 1000 + 1) > 0)
+            flow_read();
+    }
+    return 0;
+}
+
+/* Whether another frame may be written, forgetting answers that never came. */
+static int flow_ready(void)
+{
+    if (flow.fd < 0 || flow.in_flight < flow.max_in_flight)
+        return 1;
+    if (av_gettime_relative() - flow.sent[0] < FLOW_TIMEOUT)
+        return 0;
+    flow_pop(); // Lost, maybe broken up by a keystroke
+    return 1;
+}
+
+/* Microseconds until flow_ready() gives up on the oldest request. */
+static int64_t flow_timeout(void)
+{
+    return FFMAX(flow.sent[0] + FLOW_TIMEOUT - av_gettime_relative(), 0);
+}
+
+static void flow_signal(int sig)
+{
+    tcsetattr(flow.fd, TCSANOW, &flow.saved);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void flow_close(void)
+{
+    if (flow.fd < 0)
+        return;
+    // Late answers would end up on the shell's command line
+    flow_drain(FLOW_TIMEOUT / 10);
+    tcflush(flow.fd, TCIFLUSH);
+    tcsetattr(flow.fd, TCSANOW, &flow.saved);
+    close(flow.fd);
+    flow.fd = -1;
+}
+
+static int flow_open(int max_in_flight)
+{
+    struct termios raw;
+    char *burst;
+    int64_t t0, rtt;
+    int i;
+
+    if (!isatty(STDOUT_FILENO)) {
+        av_log(NULL, AV_LOG_WARNING, "Output is not a terminal, no flow control\n");
+        return 0;
+    }
+    if ((flow.fd = open("/dev/tty", O_RDONLY | O_NONBLOCK)) < 0 ||
+        tcgetattr(flow.fd, &flow.saved) < 0) {
+        int ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Cannot open the terminal: %s\n", av_err2str(ret));
+        if (flow.fd >= 0)
+            close(flow.fd);
+        flow.fd = -1;
+        return ret;
+    }
+    // Answers must neither wait for a newline nor show up on screen
+    raw = flow.saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(flow.fd, TCSANOW, &raw);
+    signal(SIGINT, flow_signal);
+    signal(SIGTERM, flow_signal);
+    flow.max_in_flight = max_in_flight;
+
+    // Round trip of a bare request, then of one behind a burst of output
+    fputs("\033[6n", stdout);
+    fflush(stdout);
+    t0 = av_gettime_relative();
+    flow.sent[flow.in_flight++] = t0;
+    if (flow_drain(FLOW_TIMEOUT) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "The terminal doesn't answer status reports, no flow control\n");
+        flow_close();
+        return 0;
+    }
+    rtt = av_gettime_relative() - t0;
+
+    if (!(burst = av_malloc(FLOW_CALIBRATION_BYTES)))
+        return AVERROR(ENOMEM);
+    // Blank screens, each starting at the top so nothing scrolls
+    for (i = 0; i < FLOW_CALIBRATION_BYTES; i += 1024) {
+        memset(burst + i, ' ', 1024);
+        memcpy(burst + i, "\033[H", 3);
+    }
+    t0 = av_gettime_relative();
+    fwrite(burst, 1, FLOW_CALIBRATION_BYTES, stdout);
+    fputs("\033[6n", stdout);
+    fflush(stdout);
+    av_free(burst);
+    flow.sent[flow.in_flight++] = t0;
+    if (flow_drain(10 * FLOW_TIMEOUT) >= 0)
+        flow.bytes_per_sec = FLOW_CALIBRATION_BYTES * 1e6 / FFMAX(av_gettime_relative() - t0 - rtt, 1000);
+    else
+        flow.in_flight = 0;
+    stats.flow_answers = stats.flow_rtt = stats.flow_rtt_max = 0;
+    fputs("\033[2J", stdout);
+    return 0;
+}
+
+static int flow_fds(struct pollfd *fds)
+{
+    if (flow.fd < 0)
+        return 0;
+    fds[0] = (struct pollfd){ .fd = flow.fd, .events = POLLIN };
+    return 1;
+}
+
+static void flow_handle(const struct pollfd *fds)
+{
+    if (flow.fd >= 0 && fds[0].revents)
+        flow_read();
+}
+
+static void display_frame(const AVFrame *frame, AVRational time_base)
+{
+    int64_t t0 = now_ns(), ns;
+    int ret, i;
+
+    if ((ret = renderer_configure(render_ctx, frame)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot set up renderer: %s\n", av_err2str(ret));
+        return;
+    }
+    if (ret > 0)
+        ob_puts(&out, "\033[2J"); // New grid size, don't leave the old picture's edges around
+    ob_puts(&out, "\033[H"); // Move cursor to top-left (1;1)
+    if (!render_ctx->renderer->graphics)
+        plan_redraw(render_ctx, frame, ret > 0);
+    if (verify)
+        verify_prepare(render_ctx, ret > 0);
+    if ((ret = render_ctx->renderer->render(render_ctx, frame, &out)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot render frame: %s\n", av_err2str(ret));
+        render_ctx->hash_rows = 0; // Don't build on a picture we don't know
+        render_ctx->grid = NULL;
+    }
+    for (i = 0; i < render_ctx->rows; i++)
+        stats.rows_drawn += !render_ctx->row_mask || render_ctx->row_mask[i];
+    stats.rows_total += render_ctx->rows;
+    ns = now_ns() - t0;
+    stats.render_ns += ns;
+    metric_time(STAGE_RENDER, ns);
+    if (pip)
+        pip_overlay(render_ctx, &out);
+    if (verify)
+        verify_frame(render_ctx, &out);
+    if (proto) {
+        proto_send(render_ctx, &out);
+    } else if (exporter) {
+        export_send(render_ctx, &out);
+    } else {
+        flow_request(&out);
+        ob_flush(&out);
+    }
+}
+
+/*
+ * Control channel. --control=PATH listens on a Unix-domain socket for
+ * line-based commands from another process:
+ *
+ *   load FILE        switch to FILE, the playlist continues after it
+ *   seek [+|-]SECS   absolute position in the current item, or relative to it
+ *   pause [on|off]   toggle or set pause
+ *   speed FACTOR     playback rate, 1 is normal
+ *   resize COLS      output width in characters
+ *   renderer NAME    switch output renderer
+ *   zoom FACTOR      magnify the picture, 1 shows all of it
+ *   pan [+|-]X [+|-]Y  center the view on X, Y (fractions of the picture),
+ *                    or move it by fractions of the view
+ *
+ * Every command is answered with "ok" or "error: reason". The socket is
+ * only served while the main thread waits for a frame deadline, so
+ * commands land between frames and need no locking: seek and load are
+ * left for the playback loop to pick up, the rest takes effect with the
+ * next frame.
+ */
+#define MAX_CONTROL_CLIENTS 8
+#define CONTROL_LINE_SIZE 1024
+
+typedef struct ControlClient {
+    int fd;
+    int len;
+    char line[CONTROL_LINE_SIZE];
+} ControlClient;
+
+typedef struct Control {
+    int listen_fd;
+    char *path;
+    ControlClient clients[MAX_CONTROL_CLIENTS];
+    int nb_clients;
+    // Picked up by the playback loop
+    char *load;
+    int seek;              // seek_to is pending
+    const Renderer *renderer; // Switch to it, NULL if no switch is pending
+    int seek_relative;
+    int64_t seek_to;       // AV_TIME_BASE units
+    int paused;
+    int64_t pause_start;
+    double speed;
+    int64_t position;      // Stream time of the last presented frame, AV_TIME_BASE units
+    int64_t pending_since; // now_ns() of the oldest command not yet on screen, 0 if none
+} Control;
+
+static Control control = { .listen_fd = -1, .speed = 1.0 };
+
+/*
+ * Presentation clock. The timeline runs across the whole playlist: every
+ * item starts where the previous one ended (its last pts plus duration),
+ * so switching items never adds a gap or a jump. Wall clock and timeline
+ * meet at an anchor, which moves whenever the speed changes or playback
+ * resumes; seek and load drop it, the next frame is shown right away.
+ */
+static int64_t clock_anchor = AV_NOPTS_VALUE; // av_gettime_relative() when the timeline was at anchor_t
+static int64_t anchor_t;
+static int64_t item_offset;                   // Timeline position of the current item's first pts
+static int64_t item_start_pts = AV_NOPTS_VALUE;
+static int64_t timeline_end;                  // End of the last presented frame
+
+static int64_t clock_deadline(int64_t t)
+{
+    return clock_anchor + (int64_t)((t - anchor_t) / control.speed);
+}
+
+static void clock_set_speed(double speed)
+{
+    int64_t now = av_gettime_relative();
+
+    if (clock_anchor != AV_NOPTS_VALUE) {
+        anchor_t += (int64_t)((now - clock_anchor) * control.speed);
+        clock_anchor = now;
+    }
+    control.speed = speed;
+}
+
+static void clock_set_paused(int paused)
+{
+    int64_t now = av_gettime_relative();
+
+    if (paused == control.paused)
+        return;
+    if (paused)
+        control.pause_start = now;
+    else if (clock_anchor != AV_NOPTS_VALUE)
+        clock_anchor += now - control.pause_start;
+    control.paused = paused;
+}
+
+/* Count a command as done once its result is visible. */
+static void control_effect(void)
+{
+    int64_t ns;
+
+    if (!control.pending_since)
+        return;
+    ns = now_ns() - control.pending_since;
+    control.pending_since = 0;
+    stats.commands++;
+    stats.command_ns += ns;
+    stats.command_max_ns = FFMAX(stats.command_max_ns, ns);
+}
+
+static int control_open(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        av_log(NULL, AV_LOG_ERROR, "Control socket path too long: %s\n", path);
+        return AVERROR(EINVAL);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        goto fail;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            av_log(NULL, AV_LOG_ERROR, "Cannot listen on %s: not a socket\n", path);
+            close(fd);
+            return AVERROR(EEXIST);
+        }
+        unlink(path); // Left behind by an earlier run
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, MAX_CONTROL_CLIENTS) < 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+        goto fail;
+    if (!(control.path = av_strdup(path))) {
+        close(fd);
+        unlink(path);
+        return AVERROR(ENOMEM);
+    }
+    control.listen_fd = fd;
+    return 0;
+
+fail:
+    av_log(NULL, AV_LOG_ERROR, "Cannot listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    return AVERROR(errno);
+}
+
+static void control_close(void)
+{
+    while (control.nb_clients)
+        close(control.clients[--control.nb_clients].fd);
+    if (control.listen_fd >= 0) {
+        close(control.listen_fd);
+        unlink(control.path);
+        control.listen_fd = -1;
+    }
+    av_freep(&control.path);
+    av_freep(&control.load);
+}
+
+static void control_reply(ControlClient *c, const char *fmt, ...)
+{
+    char buf[256];
+    va_list vl;
+    int len;
+
+    va_start(vl, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, vl);
+    va_end(vl);
+    // Clients that don't read their replies lose them, playback never waits
+    if (len > 0)
+        send(c->fd, buf, FFMIN(len, sizeof(buf) - 1), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void control_command(ControlClient *c, char *line)
+{
+    char *cmd = line, *arg, *endp;
+    const Renderer *r;
+    double d;
+
+    cmd += strspn(cmd, " \t");
+    arg = cmd + strcspn(cmd, " \t");
+    if (*arg)
+        *arg++ = 0;
+    arg += strspn(arg, " \t");
+    if (!*cmd)
+        return;
+
+    if (!strcmp(cmd, "load")) {
+        if (!*arg)
+            return control_reply(c, "error: missing file name\n");
+        av_free(control.load);
+        if (!(control.load = av_strdup(arg)))
+            return control_reply(c, "error: out of memory\n");
+    } else if (!strcmp(cmd, "seek")) {
+        d = strtod(arg, &endp);
+        if (endp == arg || *endp)
+            return control_reply(c, "error: bad position: %s\n", arg);
+        control.seek = 1;
+        control.seek_relative = *arg == '+' || *arg == '-';
+        control.seek_to = (int64_t)(d * AV_TIME_BASE);
+    } else if (!strcmp(cmd, "pause")) {
+        if (!*arg)
+            clock_set_paused(!control.paused);
+        else if (!strcmp(arg, "on") || !strcmp(arg, "off"))
+            clock_set_paused(!strcmp(arg, "on"));
+        else
+            return control_reply(c, "error: pause takes on or off\n");
+        // Pausing takes effect right here, resuming with the next frame
+        if (control.paused) {
+            stats.commands++;
+            return control_reply(c, "ok\n");
+        }
+    } else if (!strcmp(cmd, "speed")) {
+        d = strtod(arg, &endp);
+        if (endp == arg || *endp || !(d >= 1.0 / 16 && d <= 16))
+            return control_reply(c, "error: speed must be between 1/16 and 16\n");
+        clock_set_speed(d);
+    } else if (!strcmp(cmd, "resize")) {
+        long cols = strtol(arg, &endp, 10);
+        if (endp == arg || *endp || cols < 2 || cols > 4096)
+            return control_reply(c, "error: bad width: %s\n", arg);
+        ascii_width = cols; // The graph is rebuilt for the next frame
+    } else if (!strcmp(cmd, "zoom")) {
+        d = strtod(arg, &endp);
+        if (endp == arg || *endp || !(d >= 1 && d <= MAX_ZOOM))
+            return control_reply(c, "error: zoom must be between 1 and %d\n", MAX_ZOOM);
+        view.zoom = d;
+        view_clamp(); // The next frame is cropped to it, see view_apply()
+    } else if (!strcmp(cmd, "pan")) {
+        char *y, *endy;
+        double dx = strtod(arg, &endp), dy;
+
+        y = endp + strspn(endp, " \t");
+        dy = strtod(y, &endy);
+        if (endp == arg || endy == y || *endy || !isfinite(dx) || !isfinite(dy))
+            return control_reply(c, "error: pan takes X and Y\n");
+        view.x = *arg == '+' || *arg == '-' ? view.x + dx / view.zoom : dx;
+        view.y = *y == '+' || *y == '-' ? view.y + dy / view.zoom : dy;
+        view_clamp();
+    } else if (!strcmp(cmd, "renderer")) {
+        if (!(r = find_renderer(arg)))
+            return control_reply(c, "error: unknown renderer: %s\n", arg);
+        if (proto && r->graphics)
+            return control_reply(c, "error: %s can't be sent with --protocol-out\n", arg);
+        // Frames already filtered are made for the current renderer, it
+        // is only replaced between frames, see control_switch_renderer()
+        control.renderer = r != render_ctx->renderer ? r : NULL;
+    } else {
+        return control_reply(c, "error: unknown command: %s\n", cmd);
+    }
+    if (!control.pending_since)
+        control.pending_since = now_ns();
+    control_reply(c, "ok\n");
+}
+
+/* Read what a client sent and run every complete line. Returns < 0 once the client is gone. */
+static int control_read(ControlClient *c)
+{
+    char *start, *nl;
+    ssize_t n;
+
+    n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0)
+        return -1;
+    c->len += n;
+    c->line[c->len] = 0;
+
+    start = c->line;
+    while ((nl = strchr(start, '\n'))) {
+        *nl = 0;
+        if (nl > start && nl[-1] == '\r')
+            nl[-1] = 0;
+        control_command(c, start);
+        start = nl + 1;
+    }
+    c->len -= start - c->line;
+    memmove(c->line, start, c->len);
+    if (c->len == sizeof(c->line) - 1) {
+        control_reply(c, "error: line too long\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int control_fds(struct pollfd *fds)
+{
+    int nb_fds = 0, i;
+
+    if (control.listen_fd < 0)
+        return 0;
+    fds[nb_fds++] = (struct pollfd){ .fd = control.listen_fd, .events = POLLIN };
+    for (i = 0; i < control.nb_clients; i++)
+        fds[nb_fds++] = (struct pollfd){ .fd = control.clients[i].fd, .events = POLLIN };
+    return nb_fds;
+}
+
+static void control_handle(const struct pollfd *fds)
+{
+    int i;
+
+    if (control.listen_fd < 0)
+        return;
+    // Clients first, the indices shift as they disconnect
+    for (i = control.nb_clients - 1; i >= 0; i--) {
+        if (!fds[i + 1].revents)
+            continue;
+        if (control_read(&control.clients[i]) < 0) {
+            close(control.clients[i].fd);
+            control.clients[i] = control.clients[--control.nb_clients];
+        }
+    }
+    if (fds[0].revents & POLLIN) {
+        int fd = accept(control.listen_fd, NULL, NULL);
+        if (fd >= 0 && (control.nb_clients == MAX_CONTROL_CLIENTS ||
+                        fcntl(fd, F_SETFL, O_NONBLOCK) < 0)) {
+            close(fd);
+        } else if (fd >= 0) {
+            control.clients[control.nb_clients].fd = fd;
+            control.clients[control.nb_clients].len = 0;
+            control.nb_clients++;
+        }
+    }
+}
+
+/*
+ * --metrics=[HOST:]PORT serves Prometheus text metrics over HTTP. Like the
+ * control socket it is served from the event loop on the main thread, so
+ * the main thread's own counters are read directly and those of other
+ * threads through their ThreadMetrics.
+ */
+#define MAX_METRICS_CLIENTS 4
+
+typedef struct MetricsClient {
+    int fd;
+    int len;
+    char request[1024];
+    OutBuf response;      // Still to be sent from offset sent on, once the request is complete
+    size_t sent;
+} MetricsClient;
+
+typedef struct MetricsServer {
+    int listen_fd;
+    MetricsClient clients[MAX_METRICS_CLIENTS];
+    int nb_clients;
+    OutBuf ob;
+} MetricsServer;
+
+static MetricsServer metrics = { .listen_fd = -1 };
+
+static int metrics_open(const char *arg)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+                              .ai_flags = AI_PASSIVE | AI_NUMERICSERV };
+    struct addrinfo *res = NULL, *ai;
+    const char *port = strrchr(arg, ':');
+    char host[256] = "127.0.0.1"; // Local only unless asked otherwise
+    int fd = -1, one = 1, err;
+
+    if (port) {
+        snprintf(host, sizeof(host), "%.*s", (int)(port - arg), arg);
+        port++;
+    } else {
+        port = arg;
+    }
+    if ((err = getaddrinfo(host, port, &hints, &res))) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid metrics address %s: %s\n", arg, gai_strerror(err));
+        return AVERROR(EINVAL);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, MAX_METRICS_CLIENTS) &&
+            fcntl(fd, F_SETFL, O_NONBLOCK) >= 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot listen on %s: %s\n", arg, strerror(errno));
+        return AVERROR(errno);
+    }
+    metrics.listen_fd = fd;
+    return 0;
+}
+
+static void metrics_drop_client(int i)
+{
+    MetricsClient *c = &metrics.clients[i];
+
+    close(c->fd);
+    av_free(c->response.data);
+    *c = metrics.clients[--metrics.nb_clients];
+}
+
+static void metrics_close(void)
+{
+    while (metrics.nb_clients)
+        metrics_drop_client(metrics.nb_clients - 1);
+    if (metrics.listen_fd >= 0)
+        close(metrics.listen_fd);
+    metrics.listen_fd = -1;
+    av_freep(&metrics.ob.data);
+}
+
+static uint64_t metric_sum(const atomic_uint_least64_t *m)
+{
+    // Every entry of metrics_threads has the same layout, so one offset fits all
+    size_t offset = (const char *)m - (const char *)&main_metrics;
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(metrics_threads); i++)
+        sum += atomic_load_explicit((const atomic_uint_least64_t *)((const char *)metrics_threads[i] + offset),
+                                    memory_order_relaxed);
+    return sum;
+}
+
+static void metrics_header(OutBuf *ob, const char *name, const char *type, const char *help)
+{
+    ob_printf(ob, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_format(OutBuf *ob)
+{
+    long pages = 0;
+    FILE *f;
+    int s, i;
+
+    metrics_header(ob, "ascii_video_frames_decoded_total", "counter", "Frames returned by the decoders.");
+    ob_printf(ob, "ascii_video_frames_decoded_total %"PRIu64"\n", metric_sum(&main_metrics.frames_decoded));
+    metrics_header(ob, "ascii_video_input_bytes_total", "counter", "Bytes read by the demuxers.");
+    ob_printf(ob, "ascii_video_input_bytes_total %"PRIu64"\n", metric_sum(&main_metrics.bytes_demuxed));
+    metrics_header(ob, "ascii_video_decoder_input_bytes_total", "counter", "Bytes of the packets sent to the decoders.");
+    ob_printf(ob, "ascii_video_decoder_input_bytes_total %"PRIu64"\n", metric_sum(&main_metrics.bytes_used));
+    metrics_header(ob, "ascii_video_frames_presented_total", "counter", "Frames written to the terminal.");
+    ob_printf(ob, "ascii_video_frames_presented_total %d\n", stats.frames_presented);
+    metrics_header(ob, "ascii_video_frames_dropped_total", "counter", "Frames dropped for being a full frame late.");
+    ob_printf(ob, "ascii_video_frames_dropped_total %d\n", stats.frames_dropped);
+    metrics_header(ob, "ascii_video_output_bytes_total", "counter", "Bytes written to the terminal.");
+    ob_printf(ob, "ascii_video_output_bytes_total %"PRId64"\n", stats.bytes_written);
+
+    metrics_header(ob, "ascii_video_stage_latency_seconds", "histogram", "Time spent per frame in each pipeline stage.");
+    for (s = 0; s < NB_STAGES; s++) {
+        static const char *const stage_names[NB_STAGES] = { "decode", "filter", "render", "write" };
+        const Histogram *h = &main_metrics.stages[s];
+        uint64_t count = 0;
+
+        for (i = 0; i <= NB_LATENCY_BUCKETS; i++) {
+            count += metric_sum(&h->buckets[i]);
+            if (i < NB_LATENCY_BUCKETS)
+                ob_printf(ob, "ascii_video_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %"PRIu64"\n",
+                          stage_names[s], latency_buckets[i] / 1e6, count);
+            else
+                ob_printf(ob, "ascii_video_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %"PRIu64"\n",
+                          stage_names[s], count);
+        }
+        ob_printf(ob, "ascii_video_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n",
+                  stage_names[s], metric_sum(&h->sum_ns) / 1e9);
+        ob_printf(ob, "ascii_video_stage_latency_seconds_count{stage=\"%s\"} %"PRIu64"\n", stage_names[s], count);
+    }
+
+    metrics_header(ob, "ascii_video_queue_depth", "gauge", "Items waiting in the player's queues.");
+    ob_printf(ob, "ascii_video_queue_depth{queue=\"prefetch\"} %d\n", prefetch_done(&prefetch) + !!queued);
+    ob_printf(ob, "ascii_video_queue_depth{queue=\"terminal\"} %d\n", flow.in_flight);
+    ob_printf(ob, "ascii_video_queue_depth{queue=\"decode\"} %d\n",
+              atomic_load_explicit(&decoder.metric_count, memory_order_relaxed));
+    metrics_header(ob, "ascii_video_decode_queue_seconds", "gauge", "Duration of the frames decoded ahead.");
+    ob_printf(ob, "ascii_video_decode_queue_seconds %.6f\n",
+              atomic_load_explicit(&decoder.metric_duration, memory_order_relaxed) / (double)AV_TIME_BASE);
+    metrics_header(ob, "ascii_video_decode_queue_bytes", "gauge", "Memory held by the frames decoded ahead.");
+    ob_printf(ob, "ascii_video_decode_queue_bytes %"PRId64"\n",
+              (int64_t)atomic_load_explicit(&decoder.metric_bytes, memory_order_relaxed));
+    metrics_header(ob, "ascii_video_decode_underruns_total", "counter", "Frames needed while the decode queue was empty.");
+    ob_printf(ob, "ascii_video_decode_underruns_total %d\n", stats.underruns);
+    // There is no audio clock, drift is the video clock against the wall clock
+    metrics_header(ob, "ascii_video_clock_drift_seconds", "gauge", "How late the last frame was presented.");
+    ob_printf(ob, "ascii_video_clock_drift_seconds %.6f\n", stats.clock_drift / 1e6);
+
+    if ((f = fopen("/proc/self/statm", "r"))) {
+        if (fscanf(f, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    metrics_header(ob, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes.");
+    ob_printf(ob, "process_resident_memory_bytes %ld\n", pages * sysconf(_SC_PAGESIZE));
+}
+
+static void metrics_respond(MetricsClient *c)
+{
+    OutBuf *ob = &metrics.ob;
+    const char *status = "200 OK";
+
+    ob->len = 0;
+    if (!strncmp(c->request, "GET /metrics ", 13) || !strncmp(c->request, "GET / ", 6))
+        metrics_format(ob);
+    else
+        status = "404 Not Found";
+    if (ob->error)
+        status = "500 Internal Server Error";
+    ob_printf(&c->response, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+              status, ob->error ? 0 : ob->len);
+    if (!ob->error)
+        ob_write(&c->response, ob->data, ob->len);
+    ob->error = 0;
+}
+
+/*
+ * Send as much of the response as the socket takes without blocking.
+ * Returns 1 while some of it is left, 0 once all of it went out, < 0 on
+ * an error.
+ */
+static int metrics_send(MetricsClient *c)
+{
+    ssize_t n;
+
+    if (c->response.error)
+        return AVERROR(ENOMEM);
+    while (c->sent < c->response.len) {
+        n = send(c->fd, c->response.data + c->sent, c->response.len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : AVERROR(errno);
+        c->sent += n;
+    }
+    return 0;
+}
+
+static int metrics_fds(struct pollfd *fds)
+{
+    int nb_fds = 0, i;
+
+    if (metrics.listen_fd < 0)
+        return 0;
+    fds[nb_fds++] = (struct pollfd){ .fd = metrics.listen_fd, .events = POLLIN };
+    for (i = 0; i < metrics.nb_clients; i++)
+        fds[nb_fds++] = (struct pollfd){ .fd = metrics.clients[i].fd,
+                                         .events = metrics.clients[i].response.len ? POLLOUT : POLLIN };
+    return nb_fds;
+}
+
+static void metrics_handle(const struct pollfd *fds)
+{
+    int i;
+
+    if (metrics.listen_fd < 0)
+        return;
+    // One request per connection: answered as soon as its header is complete,
+    // closed once the whole response is out
+    for (i = metrics.nb_clients - 1; i >= 0; i--) {
+        MetricsClient *c = &metrics.clients[i];
+        ssize_t n;
+
+        if (!fds[i + 1].revents)
+            continue;
+        if (c->response.len) {
+            if (metrics_send(c) <= 0)
+                metrics_drop_client(i);
+            continue;
+        }
+        n = read(c->fd, c->request + c->len, sizeof(c->request) - 1 - c->len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (n > 0) {
+            c->len += n;
+            c->request[c->len] = 0;
+            if (!strstr(c->request, "\r\n\r\n") && !strstr(c->request, "\n\n") &&
+                c->len < sizeof(c->request) - 1)
+                continue;
+            metrics_respond(c);
+            if (metrics_send(c) > 0)
+                continue;
+        }
+        metrics_drop_client(i);
+    }
+    if (fds[0].revents & POLLIN) {
+        int fd = accept(metrics.listen_fd, NULL, NULL);
+        if (fd >= 0 && (metrics.nb_clients == MAX_METRICS_CLIENTS ||
+                        fcntl(fd, F_SETFL, O_NONBLOCK) < 0)) {
+            close(fd);
+        } else if (fd >= 0) {
+            metrics.clients[metrics.nb_clients++] = (MetricsClient){ .fd = fd };
+        }
+    }
+}
+
+/*
+ * The event loop: sleep for up to timeout microseconds (< 0 waits for an
+ * event), serving the control socket and the metrics endpoint meanwhile.
+ * Returns early once something was handled.
+ */
+static void event_wait(int64_t timeout)
+{
+    struct pollfd fds[MAX_CONTROL_CLIENTS + MAX_METRICS_CLIENTS + 3];
+    int nb_control, nb_metrics, nb_flow, n;
+
+    nb_control = control_fds(fds);
+    nb_metrics = metrics_fds(fds + nb_control);
+    nb_flow = flow_fds(fds + nb_control + nb_metrics);
+    if (!nb_control && !nb_metrics && !nb_flow) {
+        if (timeout > 0)
+            av_usleep(timeout);
+        return;
+    }
+
+    // poll() counts in milliseconds, the rest of the wait is slept off
+    n = poll(fds, nb_control + nb_metrics + nb_flow, timeout < 0 ? -1 : timeout / 1000);
+    if (n <= 0) {
+        if (n == 0 && timeout > 0 && timeout < 1000)
+            av_usleep(timeout);
+        return;
+    }
+    control_handle(fds);
+    metrics_handle(fds + nb_control);
+    flow_handle(fds + nb_control + nb_metrics);
+}
+
+/*
+ * Start opening the file of a load command once the prefetch thread is
+ * free. A playlist item already prefetched is kept and plays after it.
+ */
+static void control_start_load(void)
+{
+    InputFile *in;
+    int ret;
+
+    if (!control.load)
+        return;
+    if (prefetch.running) {
+        if (!prefetch_done(&prefetch))
+            return;
+        in = prefetch_finish(&prefetch);
+        if (prefetch.replace && in)
+            close_input_file(in); // Overtaken by a newer load
+        else if (in)
+            queued = in;
+    }
+    if ((ret = prefetch_start(&prefetch, control.load)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Cannot load %s: %s\n", control.load, av_err2str(ret));
+    else
+        prefetch.replace = 1;
+    av_freep(&control.load);
+}
+
+/* Whether the playing item has to give way to a seek, a loaded file or a new renderer. */
+static int control_interrupt(void)
+{
+    return control.seek || control.renderer || (prefetch.replace && prefetch_done(&prefetch));
+}
+
+/* Apply a renderer command once no frame filtered for the old renderer is left. */
+static void control_switch_renderer(void)
+{
+    RenderContext *rc;
+
+    if (!control.renderer)
+        return;
+    if ((rc = renderer_alloc(control.renderer))) {
+        renderer_free(&render_ctx);
+        render_ctx = rc;
+    } else {
+        av_log(NULL, AV_LOG_ERROR, "Cannot switch to %s: out of memory\n", control.renderer->name);
+    }
+    control.renderer = NULL;
+}
+
+/* After the first frames, narrow the output if it needs more than the terminal takes. */
+static void flow_fit(int64_t duration)
+{
+    double need;
+
+    if (flow.fd < 0 || flow.fitted || width_set || !flow.bytes_per_sec ||
+        stats.frames_presented < FLOW_FIT_FRAMES)
+        return;
+    flow.fitted = 1;
+    need = (double)stats.bytes_written / stats.frames_presented * AV_TIME_BASE / duration * control.speed;
+    if (need <= flow.bytes_per_sec * FLOW_HEADROOM)
+        return;
+    // Bytes grow with the number of cells, the square of the width
+    ascii_width = FFMAX((int)(ascii_width * sqrt(flow.bytes_per_sec * FLOW_HEADROOM / need)), 16);
+    stats.flow_width = ascii_width;
+}
+
+#define DEADLINE_SLACK 2000 // Microseconds a frame may be late without counting as a miss
+
+/*
+ * Wait for the frame's deadline and show it, or drop it if we are a full
+ * frame late. A frame made stale by a seek or load is discarded, so is
+ * one that got late waiting for the terminal to catch up.
+ */
+static void present_frame(const AVFrame *frame, AVRational time_base, AVRational frame_rate)
+{
+    int64_t pts, t, duration, now;
+    int flow_blocked = 0;
+
+    pts = frame->pts == AV_NOPTS_VALUE ? 0 : frame->pts;
+    if (item_start_pts == AV_NOPTS_VALUE)
+        item_start_pts = pts;
+    t = item_offset + av_rescale_q(pts - item_start_pts, time_base, AV_TIME_BASE_Q);
+
+    if (frame->duration > 0)
+        duration = av_rescale_q(frame->duration, time_base, AV_TIME_BASE_Q);
+    else if (frame_rate.num > 0 && frame_rate.den > 0)
+        duration = av_rescale_q(1, av_inv_q(frame_rate), AV_TIME_BASE_Q);
+    else
+        duration = AV_TIME_BASE / 25;
+    if (t + duration > timeline_end)
+        timeline_end = t + duration;
+
+    if (exporter) {
+        // No clock to keep, every frame goes to the file as soon as it is decoded
+        exporter->t = t;
+        display_frame(frame, time_base);
+        control.position = av_rescale_q(pts, time_base, AV_TIME_BASE_Q);
+        stats.frames_presented++;
+        return;
+    }
+
+    now = av_gettime_relative();
+    if (clock_anchor == AV_NOPTS_VALUE) {
+        clock_anchor = now;
+        anchor_t = t;
+    }
+
+    if (now > clock_deadline(t + duration) && !control.paused) {
+        stats.frames_dropped++;
+        event_wait(0); // Don't let a slow pipeline starve the socket
+        return;
+    }
+    if (control_interrupt())
+        return; // Left over from before a command, don't wait for it
+    while (1) {
+        int64_t timeout = -1;
+
+        now = av_gettime_relative();
+        if (!control.paused)
+            timeout = FFMAX(clock_deadline(t) - now, 0);
+        else if (prefetch.replace && prefetch.running)
+            timeout = 10000; // Check back on the file being loaded
+        if (!timeout && !flow_ready()) {
+            timeout = flow_timeout(); // Woken up by the answer
+            flow_blocked = 1;
+        }
+        event_wait(timeout);
+        control_start_load();
+        if (control_interrupt())
+            return;
+        if (!control.paused && (now = av_gettime_relative()) >= clock_deadline(t) && flow_ready())
+            break;
+    }
+    if (now > clock_deadline(t + duration)) {
+        stats.frames_dropped++;
+        if (flow.fd >= 0 && flow_blocked)
+            stats.flow_drops++;
+        return;
+    }
+
+    stats.clock_drift = now - clock_deadline(t);
+    if (stats.clock_drift > DEADLINE_SLACK)
+        stats.deadline_misses++;
+    stats.deadline_max = FFMAX(stats.deadline_max, stats.clock_drift);
+    display_frame(frame, time_base);
+    control.position = av_rescale_q(pts, time_base, AV_TIME_BASE_Q);
+    control_effect();
+    stats.frames_presented++;
+    flow_fit(duration);
+}
+
+/* Move within the current item, see the seek command. */
+static void seek_input(InputFile *in)
+{
+    AVStream *st = in->fmt_ctx->streams[in->video_stream_index];
+    int64_t ts = control.seek_to;
+    int ret;
+
+    control.seek = 0;
+    decoder_stop(); // It owns the demuxer and decoder while it runs
+    if (control.seek_relative)
+        ts += control.position;
+    else if (in->fmt_ctx->start_time != AV_NOPTS_VALUE)
+        ts += in->fmt_ctx->start_time;
+
+    if ((ret = avformat_seek_file(in->fmt_ctx, -1, INT64_MIN, ts, ts, 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot seek in %s: %s\n", in->filename, av_err2str(ret));
+        return;
+    }
+    avcodec_flush_buffers(in->dec_ctx);
+    if (in->first_frame)
+        av_frame_unref(in->first_frame);
+    in->eof = 0;
+    // Seeking lands on a keyframe, decode up to the requested position
+    in->seek_pts = av_rescale_q(ts, AV_TIME_BASE_Q, st->time_base);
+
+    // The timeline keeps going forward, only the clock restarts
+    item_offset = timeline_end;
+    item_start_pts = AV_NOPTS_VALUE;
+    clock_anchor = AV_NOPTS_VALUE;
+}
+
+/*
+ * --replay plays asciicast v2 recordings through the same output buffer
+ * and event loop as video. Event times are compressed (no gap longer than
+ * the idle limit) and scaled by the speed, each deadline is computed from
+ * the clock anchor rather than from the previous event, so nothing drifts
+ * over a long recording. While loading, a VTerm follows the output and a
+ * snapshot of the screen is kept every few seconds: a seek draws the last
+ * snapshot before the target and replays only what came after it.
+ */
+typedef struct CastEvent {
+    int64_t t;            // Replay time after idle compression, microseconds
+    size_t offset, len;   // Data in Cast.data
+    char type;            // 'o' output, 'r' resize, the rest is skipped
+} CastEvent;
+
+typedef struct CastSnapshot {
+    int event;            // First event not included
+    VTerm screen;
+} CastSnapshot;
+
+typedef struct Cast {
+    int width, height;
+    CastEvent *events;
+    int nb_events;
+    OutBuf data;          // Decoded event payloads
+    CastSnapshot *snapshots;
+    int nb_snapshots;
+} Cast;
+
+static double replay_idle_limit = -1;      // Seconds, < 0 takes the recording's
+static double replay_snapshot_interval = 10;
+
+/* Parse a JSON string at *p, appending its decoded contents to ob. */
+static int json_string(const char **p, OutBuf *ob)
+{
+    const char *s = *p;
+    uint32_t c, lo;
+
+    if (*s++ != '"')
+        return AVERROR_INVALIDDATA;
+    while (*s != '"') {
+        if (!*s || *s == '\n')
+            return AVERROR_INVALIDDATA;
+        if (*s != '\\') {
+            ob_putc(ob, *s++);
+            continue;
+        }
+        s++;
+        switch (*s++) {
+        case '"':  ob_putc(ob, '"'); break;
+        case '\\': ob_putc(ob, '\\'); break;
+        case '/':  ob_putc(ob, '/'); break;
+        case 'b':  ob_putc(ob, '\b'); break;
+        case 'f':  ob_putc(ob, '\f'); break;
+        case 'n':  ob_putc(ob, '\n'); break;
+        case 'r':  ob_putc(ob, '\r'); break;
+        case 't':  ob_putc(ob, '\t'); break;
+        case 'u':
+            if (sscanf(s, "%4x", &c) != 1)
+                return AVERROR_INVALIDDATA;
+            s += 4;
+            // Characters outside the BMP come as a surrogate pair
+            if (c >= 0xD800 && c < 0xDC00 && s[0] == '\\' && s[1] == 'u' &&
+                sscanf(s + 2, "%4x", &lo) == 1 && lo >= 0xDC00 && lo < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                s += 6;
+            }
+            ob_put_utf8(ob, c);
+            break;
+        default:
+            return AVERROR_INVALIDDATA;
+        }
+    }
+    *p = s + 1;
+    return ob->error ? AVERROR(ENOMEM) : 0;
+}
+
+static int json_header_int(const char *header, const char *key, double *v)
+{
+    const char *s = strstr(header, key);
+
+    if (!s)
+        return 0;
+    s += strlen(key);
+    s += strspn(s, " \t\":");
+    return sscanf(s, "%lf", v) == 1;
+}
+
+static void cast_free(Cast *cast)
+{
+    while (cast->nb_snapshots)
+        vt_free(&cast->snapshots[--cast->nb_snapshots].screen);
+    av_freep(&cast->snapshots);
+    av_freep(&cast->events);
+    av_freep(&cast->data.data);
+}
+
+static int cast_add_snapshot(Cast *cast, const VTerm *vt, int event)
+{
+    CastSnapshot *s = av_realloc_array(cast->snapshots, cast->nb_snapshots + 1, sizeof(*s));
+    int ret;
+
+    if (!s)
+        return AVERROR(ENOMEM);
+    cast->snapshots = s;
+    s += cast->nb_snapshots;
+    if ((ret = vt_copy(&s->screen, vt)) < 0)
+        return ret;
+    s->event = event;
+    cast->nb_snapshots++;
+    return 0;
+}
+
+static int cast_load(Cast *cast, const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    char *text = NULL, *line, *next;
+    size_t size = 0, len = 0;
+    double v, idle_limit = replay_idle_limit, prev = 0, t;
+    int64_t replay_t = 0, next_snapshot = 0;
+    VTerm vt = { 0 };
+    int ret = 0, i;
+
+    memset(cast, 0, sizeof(*cast));
+    if (!f) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open %s: %s\n", filename, strerror(errno));
+        return AVERROR(errno);
+    }
+    while (!feof(f)) {
+        if (size - len < 65536) {
+            char *p = av_realloc(text, size += 1 << 20);
+            if (!p) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            text = p;
+        }
+        len += fread(text + len, 1, size - len - 1, f);
+        if (ferror(f)) {
+            ret = AVERROR(EIO);
+            goto end;
+        }
+    }
+    text[len] = 0;
+
+    // Header: {"version": 2, "width": 80, "height": 24, ...}
+    next = strchr(text, '\n');
+    if (next)
+        *next++ = 0;
+    if (!strstr(text, "\"version\"") || !json_header_int(text, "\"width\"", &v) || v < 1 || v > 4096) {
+        av_log(NULL, AV_LOG_ERROR, "%s is not an asciicast v2 recording\n", filename);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    cast->width = v;
+    cast->height = json_header_int(text, "\"height\"", &v) && v >= 1 && v <= 4096 ? v : 24;
+    if (idle_limit < 0 && json_header_int(text, "\"idle_time_limit\"", &v))
+        idle_limit = v;
+
+    // Events: [time, "type", "data"], one per line
+    for (line = next; line && *line; line = next) {
+        const char *p = line;
+        CastEvent *ev;
+        size_t offset = cast->data.len;
+        char type;
+
+        if ((next = strchr(line, '\n')))
+            *next++ = 0;
+        p += strspn(p, " \t\r");
+        if (!*p)
+            continue;
+        if (*p++ != '[' || sscanf(p, "%lf", &t) != 1 || !(p = strchr(p, ',')))
+            goto invalid;
+        p++;
+        p += strspn(p, " ");
+        if (p[0] != '"' || !p[1] || p[2] != '"')
+            goto invalid;
+        type = p[1];
+        p += 3;
+        p += strspn(p, " ,");
+        if ((ret = json_string(&p, &cast->data)) < 0)
+            goto invalid;
+
+        if (!(cast->nb_events & (cast->nb_events - 1))) {
+            CastEvent *e = av_realloc_array(cast->events, FFMAX(cast->nb_events * 2, 1), sizeof(*e));
+            if (!e) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            cast->events = e;
+        }
+        ev = &cast->events[cast->nb_events++];
+        // Idle compression: no pause lasts longer than the limit
+        t = FFMAX(t, prev);
+        replay_t += (int64_t)((idle_limit > 0 ? FFMIN(t - prev, idle_limit) : t - prev) * AV_TIME_BASE);
+        prev = t;
+        ev->t = replay_t;
+        ev->offset = offset;
+        ev->len = cast->data.len - offset;
+        ev->type = type;
+        continue;
+invalid:
+        av_log(NULL, AV_LOG_ERROR, "%s: invalid event: %.40s\n", filename, line);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    // Follow the screen and index it
+    if ((ret = vt_init(&vt, cast->width, cast->height)) < 0)
+        goto end;
+    for (i = 0; i < cast->nb_events; i++) {
+        const CastEvent *ev = &cast->events[i];
+        int cols, rows;
+
+        if (ev->t >= next_snapshot) {
+            if ((ret = cast_add_snapshot(cast, &vt, i)) < 0)
+                goto end;
+            next_snapshot = ev->t + (int64_t)(replay_snapshot_interval * AV_TIME_BASE);
+        }
+        if (ev->type == 'o')
+            vt_feed(&vt, cast->data.data + ev->offset, ev->len);
+        else if (ev->type == 'r' && sscanf((char *)cast->data.data + ev->offset, "%dx%d", &cols, &rows) == 2 &&
+                 cols > 0 && rows > 0 && cols <= 4096 && rows <= 4096 && (ret = vt_resize(&vt, cols, rows)) < 0)
+            goto end;
+    }
+
+end:
+    if (ret < 0)
+        cast_free(cast);
+    vt_free(&vt);
+    av_free(text);
+    fclose(f);
+    return ret;
+}
+
+/*
+ * Draw the screen as it was at replay time t. Returns the index of the
+ * first event after t.
+ */
+static int replay_seek(const Cast *cast, int64_t t)
+{
+    int s = 0, i;
+
+    while (s + 1 < cast->nb_snapshots && cast->events[cast->snapshots[s + 1].event].t <= t)
+        s++;
+    if (cast->nb_snapshots)
+        vt_draw(&cast->snapshots[s].screen, &out);
+    for (i = cast->nb_snapshots ? cast->snapshots[s].event : 0;
+         i < cast->nb_events && cast->events[i].t <= t; i++)
+        if (cast->events[i].type == 'o')
+            ob_write(&out, cast->data.data + cast->events[i].offset, cast->events[i].len);
+    ob_flush(&out);
+    return i;
+}
+
+static int replay_cast(const char *filename, int64_t start)
+{
+    Cast cast;
+    int64_t now, t = start;
+    int i, ret;
+
+    if ((ret = cast_load(&cast, filename)) < 0)
+        return ret;
+    av_log(NULL, AV_LOG_INFO, "Replaying %s: %d events, %d snapshots, %.1f s\n", filename,
+           cast.nb_events, cast.nb_snapshots,
+           cast.nb_events ? cast.events[cast.nb_events - 1].t / 1e6 : 0.0);
+
+    i = replay_seek(&cast, t);
+    clock_anchor = av_gettime_relative();
+    anchor_t = t;
+
+    while (i < cast.nb_events) {
+        if (control.seek) {
+            t = control.seek_to + (control.seek_relative ? control.position : 0);
+            t = FFMAX(t, 0);
+            control.seek = 0;
+            i = replay_seek(&cast, t);
+            clock_anchor = av_gettime_relative();
+            anchor_t = t;
+            if (control.paused)
+                control.pause_start = clock_anchor;
+            control.position = t;
+            control_effect();
+            continue;
+        }
+
+        now = av_gettime_relative();
+        if (control.paused || now < clock_deadline(cast.events[i].t)) {
+            event_wait(control.paused ? -1 : clock_deadline(cast.events[i].t) - now);
+            continue;
+        }
+
+        // Everything that is due goes out in a single write
+        for (; i < cast.nb_events && clock_deadline(cast.events[i].t) <= now; i++)
+            if (cast.events[i].type == 'o')
+                ob_write(&out, cast.data.data + cast.events[i].offset, cast.events[i].len);
+        stats.clock_drift = now - clock_deadline(cast.events[i - 1].t);
+        ob_flush(&out);
+        control.position = cast.events[i - 1].t;
+        control_effect();
+        stats.frames_presented++;
+    }
+
+    cast_free(&cast);
+    return 0;
+}
+
+/*
+ * --analytics: instead of playing the video, write luma statistics of
+ * every frame, for screening footage for black, blank or frozen stretches.
+ * The Y plane is box averaged down to at most ANALYTICS_WIDTH samples a row
+ * by the direct luma path, HDR tone-mapped like the gray output. A
+ * seekable file is cut into segments which a pool of threads decodes at
+ * once, every segment from the keyframe at or before its start. Frames
+ * ahead of the start are only decoded to give the first one a previous
+ * frame to compare with. Records go out in order as segments finish.
+ */
+#define ANALYTICS_WIDTH 256
+#define ANALYTICS_BUCKETS 16
+#define ANALYTICS_SEGMENT 30       // Seconds at least, every segment decodes up to a GOP in vain
+#define ANALYTICS_BLACK_LEVEL 0.1  // Samples this far from black towards white, or darker, are black
+#define ANALYTICS_BLACK_RATIO 0.98 // Share of black samples in a black frame
+#define ANALYTICS_FREEZE 0.25      // Mean change in 8-bit steps, a frozen frame changes less
+#define ANALYTICS_RECORD_SIZE (20 + 4 * ANALYTICS_BUCKETS)
+
+enum AnalyticsFormat { ANALYTICS_JSON, ANALYTICS_BINARY };
+
+static FILE *analytics_file;
+static enum AnalyticsFormat analytics_format = ANALYTICS_JSON;
+static int analytics_threads; // 0 for one per CPU
+
+typedef struct AnalyticsSegment {
+    int64_t start, end;   // Stream time base, the frames from start up to before end
+    OutBuf records;
+    int64_t frames;
+    int done;
+    int ret;
+} AnalyticsSegment;
+
+typedef struct Analytics {
+    InputFile *first;     // Opened to look at the file, then decodes segment 0
+    int item;             // Playlist index, in every record
+    AnalyticsSegment *segments;
+    int nb_segments;
+    int next;             // The segment the next free thread takes
+    atomic_int failed;    // Error of a segment, the others give up
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // Signalled when a segment is done
+} Analytics;
+
+typedef struct LumaStats {
+    double mean;          // 8-bit steps
+    double diff;          // Mean absolute change from the previous frame, < 0 without one
+    uint32_t hist[ANALYTICS_BUCKETS];
+    int black, freeze;
+} LumaStats;
+
+static int analytics_open(const char *dest)
+{
+    if (!strcmp(dest, "-")) {
+        analytics_file = stdout;
+    } else if (!(analytics_file = fopen(dest, "wb"))) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot open %s: %s\n", dest, strerror(errno));
+        return AVERROR(errno);
+    }
+    return 0;
+}
+
+static int analytics_close(void)
+{
+    int ret;
+
+    if (!analytics_file)
+        return 0;
+    ret = ferror(analytics_file);
+    if (analytics_file == stdout ? fflush(stdout) : fclose(analytics_file))
+        ret = 1;
+    analytics_file = NULL;
+    if (ret) {
+        av_log(NULL, AV_LOG_ERROR, "Error writing the analytics: %s\n", strerror(errno));
+        return AVERROR(errno);
+    }
+    return 0;
+}
+
+/* Size of the analysis picture for w x h frames. */
+static void analytics_size(int w, int h, int *aw, int *ah)
+{
+    *aw = FFMIN(w, ANALYTICS_WIDTH);
+    *ah = av_clip(lrint((double)*aw * h / w), 1, h);
+}
+
+/*
+ * Statistics of the analysis picture cur, prev is the previous frame's or
+ * NULL. With SSE2 the sums take 16 samples at a time, all of them done by
+ * PSADBW: against zero for the sum, against the previous frame for the
+ * change, against zero again on a mask for the dark samples. The histogram
+ * is counted into four tables, so that neighbouring samples in the same
+ * bucket don't wait on each other's increment.
+ */
+static void luma_stats(const AVFrame *cur, const AVFrame *prev, LumaStats *st)
+{
+    int limited = cur->color_range != AVCOL_RANGE_JPEG;
+    int black = lrint(limited ? 16 + 219 * ANALYTICS_BLACK_LEVEL : 255 * ANALYTICS_BLACK_LEVEL);
+    uint32_t hist[4][ANALYTICS_BUCKETS] = { { 0 } };
+    uint64_t sum = 0, sad = 0, dark = 0, n = (uint64_t)cur->width * cur->height;
+    int x, y, i;
+
+    for (y = 0; y < cur->height; y++) {
+        const uint8_t *p = cur->data[0] + y * cur->linesize[0];
+        const uint8_t *q = prev ? prev->data[0] + y * prev->linesize[0] : NULL;
+
+        x = 0;
+#ifdef __SSE2__
+        {
+            const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1), level = _mm_set1_epi8(black);
+            __m128i vsum = zero, vsad = zero, vdark = zero;
+
+            for (; x + 16 <= cur->width; x += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+                __m128i is_dark = _mm_cmpeq_epi8(_mm_min_epu8(v, level), v);
+
+                vsum = _mm_add_epi64(vsum, _mm_sad_epu8(v, zero));
+                vdark = _mm_add_epi64(vdark, _mm_sad_epu8(_mm_and_si128(is_dark, one), zero));
+                if (q)
+                    vsad = _mm_add_epi64(vsad, _mm_sad_epu8(v, _mm_loadu_si128((const __m128i *)(q + x))));
+            }
+            // Two 64-bit halves each, far from overflowing within a row
+            sum += _mm_cvtsi128_si32(vsum) + _mm_cvtsi128_si32(_mm_srli_si128(vsum, 8));
+            dark += _mm_cvtsi128_si32(vdark) + _mm_cvtsi128_si32(_mm_srli_si128(vdark, 8));
+            sad += _mm_cvtsi128_si32(vsad) + _mm_cvtsi128_si32(_mm_srli_si128(vsad, 8));
+        }
+#endif
+        for (i = x; i < cur->width; i++) {
+            sum += p[i];
+            dark += p[i] <= black;
+            if (q)
+                sad += abs(p[i] - q[i]);
+        }
+
+        for (x = 0; x + 4 <= cur->width; x += 4)
+            for (i = 0; i < 4; i++)
+                hist[i][p[x + i] * ANALYTICS_BUCKETS >> 8]++;
+        for (; x < cur->width; x++)
+            hist[0][p[x] * ANALYTICS_BUCKETS >> 8]++;
+    }
+    for (i = 0; i < ANALYTICS_BUCKETS; i++)
+        st->hist[i] = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+    st->mean = (double)sum / n;
+    st->diff = prev ? (double)sad / n : -1;
+    st->black = dark >= ANALYTICS_BLACK_RATIO * n;
+    st->freeze = prev && st->diff < ANALYTICS_FREEZE;
+}
+
+static void ob_put_le(OutBuf *ob, uint64_t v, int bytes)
+{
+    while (bytes--) {
+        ob_putc(ob, v & 0xFF);
+        v >>= 8;
+    }
+}
+
+static void ob_put_float(OutBuf *ob, float f)
+{
+    uint32_t v;
+
+    memcpy(&v, &f, sizeof(v));
+    ob_put_le(ob, v, 4);
+}
+
+/* One record, pts in microseconds or AV_NOPTS_VALUE. See the README for the formats. */
+static void analytics_record(OutBuf *ob, int item, int64_t pts, const LumaStats *st)
+{
+    int i;
+
+    if (analytics_format == ANALYTICS_BINARY) {
+        ob_put_le(ob, pts, 8);
+        ob_put_float(ob, st->mean);
+        ob_put_float(ob, st->diff);
+        ob_put_le(ob, item, 2);
+        ob_putc(ob, st->black | st->freeze << 1);
+        ob_putc(ob, 0);
+        for (i = 0; i < ANALYTICS_BUCKETS; i++)
+            ob_put_le(ob, st->hist[i], 4);
+        return;
+    }
+    ob_printf(ob, "{\"item\":%d,\"pts\":", item);
+    if (pts == AV_NOPTS_VALUE)
+        ob_puts(ob, "null");
+    else
+        ob_printf(ob, "%.6f", pts / (double)AV_TIME_BASE);
+    ob_printf(ob, ",\"mean\":%.2f,\"diff\":", st->mean);
+    if (st->diff < 0)
+        ob_puts(ob, "null");
+    else
+        ob_printf(ob, "%.2f", st->diff);
+    ob_printf(ob, ",\"black\":%s,\"freeze\":%s,\"hist\":[", st->black ? "true" : "false",
+              st->freeze ? "true" : "false");
+    for (i = 0; i < ANALYTICS_BUCKETS; i++)
+        ob_printf(ob, i ? ",%u" : "%u", st->hist[i]);
+    ob_puts(ob, "]}\n");
+}
+
+static void ob_put_json_string(OutBuf *ob, const char *s)
+{
+    ob_putc(ob, '"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            ob_printf(ob, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            ob_printf(ob, "\\u%04x", *s);
+        else
+            ob_putc(ob, *s);
+    }
+    ob_putc(ob, '"');
+}
+
+static int analyze_segment(Analytics *a, AnalyticsSegment *seg)
+{
+    InputFile *in = a->first;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc(), *cur = av_frame_alloc(), *prev = av_frame_alloc();
+    LumaScaler *s = NULL;
+    int width = 0, height = 0, format = AV_PIX_FMT_NONE, ret;
+    // A frame without a timestamp goes with the last one that had one.
+    // After a seek that is unknown until one comes, and those frames are
+    // the previous segment's.
+    int placed = seg->start == INT64_MIN;
+    int64_t last_pts = INT64_MIN;
+    AVRational time_base;
+    LumaStats st;
+
+    if (!packet || !frame || !cur || !prev) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    // Split up, every segment opens the file for itself
+    if (a->nb_segments > 1) {
+        if (!(in = av_mallocz(sizeof(*in))) || !(in->filename = av_strdup(a->first->filename))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        in->video_stream_index = -1;
+        in->seek_pts = AV_NOPTS_VALUE;
+        in->analytics = 1;
+        in->dec_threads = 1;
+        if ((ret = open_input_file(in)) < 0)
+            goto end;
+        // To a keyframe before the start if there is one, so that the first frame has one to compare with
+        if (seg->start != INT64_MIN &&
+            (ret = avformat_seek_file(in->fmt_ctx, in->video_stream_index, INT64_MIN,
+                                      seg->start - 1, seg->start - 1, 0)) < 0 &&
+            (ret = avformat_seek_file(in->fmt_ctx, in->video_stream_index, INT64_MIN,
+                                      seg->start, seg->start, 0)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Cannot seek in %s: %s\n", in->filename, av_err2str(ret));
+            goto end;
+        }
+    }
+    time_base = in->fmt_ctx->streams[in->video_stream_index]->time_base;
+
+    while (!atomic_load(&a->failed) && (ret = decode_next_frame(in, packet, frame)) >= 0) {
+        if (frame->pts != AV_NOPTS_VALUE) {
+            last_pts = frame->pts;
+            placed = 1;
+        }
+        if (placed && last_pts >= seg->end)
+            break;
+        if (frame->width != width || frame->height != height || frame->format != format) {
+            const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+            int rect[4] = { 0, 0, frame->width, frame->height }, aw, ah;
+
+            luma_free(&s);
+            av_frame_unref(prev);
+            if (!luma_readable(desc, 1)) {
+                av_log(NULL, AV_LOG_ERROR, "Cannot analyze %s video\n", av_get_pix_fmt_name(frame->format));
+                ret = AVERROR(EINVAL);
+                goto end;
+            }
+            analytics_size(frame->width, frame->height, &aw, &ah);
+            if ((ret = luma_alloc(&s, desc, frame->width, aw, ah, 1)) < 0)
+                goto end;
+            luma_set_view(s, rect);
+            width = frame->width;
+            height = frame->height;
+            format = frame->format;
+        }
+        if ((ret = luma_scale(s, frame, cur)) < 0)
+            goto end;
+        if (placed && last_pts >= seg->start) {
+            luma_stats(cur, prev->buf[0] ? prev : NULL, &st);
+            analytics_record(&seg->records, a->item, frame->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+                             av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q), &st);
+            seg->frames++;
+        }
+        av_frame_unref(prev);
+        av_frame_move_ref(prev, cur);
+        av_frame_unref(frame);
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+    if (ret >= 0 && seg->records.error)
+        ret = AVERROR(ENOMEM);
+
+end:
+    if (in && in != a->first)
+        close_input_file(in);
+    luma_free(&s);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    av_frame_free(&cur);
+    av_frame_free(&prev);
+    return ret;
+}
+
+static void *analytics_thread(void *arg)
+{
+    Analytics *a = arg;
+    ThreadMetrics metrics = { 0 }; // Not served by --metrics, there is nothing playing
+    AnalyticsSegment *seg;
+    int ret;
+
+    thread_metrics = &metrics;
+    thread_enter(ROLE_DECODE);
+    pthread_mutex_lock(&a->lock);
+    while (!atomic_load(&a->failed) && a->next < a->nb_segments) {
+        seg = &a->segments[a->next++];
+        pthread_mutex_unlock(&a->lock);
+        ret = analyze_segment(a, seg);
+        pthread_mutex_lock(&a->lock);
+        seg->ret = ret;
+        seg->done = 1;
+        if (ret < 0)
+            atomic_store(&a->failed, ret);
+        pthread_cond_broadcast(&a->cond);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+static int run_analytics(const char *filename, int item)
+{
+    Analytics a = { .item = item, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+    int nb_threads = analytics_threads ? analytics_threads : av_cpu_count();
+    int started = 0, i, aw, ah, ret;
+    pthread_t *threads = NULL;
+    int64_t start, duration = 0, frames = 0, t0 = now_ns();
+    AVStream *st = NULL;
+    OutBuf header = { 0 };
+
+    atomic_init(&a.failed, 0);
+    if (!(a.first = av_mallocz(sizeof(*a.first))) || !(a.first->filename = av_strdup(filename))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    a.first->video_stream_index = -1;
+    a.first->seek_pts = AV_NOPTS_VALUE;
+    a.first->analytics = 1;
+    if ((ret = open_input_file(a.first)) < 0)
+        goto end;
+    st = a.first->fmt_ctx->streams[a.first->video_stream_index];
+    start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    duration = st->duration != AV_NOPTS_VALUE ? st->duration :
+               a.first->fmt_ctx->duration != AV_NOPTS_VALUE ?
+               av_rescale_q(a.first->fmt_ctx->duration, AV_TIME_BASE_Q, st->time_base) : 0;
+
+    // Segments only where seeking is possible and the frames say where they
+    // are, enough of them to keep every thread busy. Alone, the decoder of
+    // the first opening runs with threads of its own.
+    a.nb_segments = 1;
+    if (nb_threads > 1 && a.first->fmt_ctx->pb && a.first->fmt_ctx->pb->seekable & AVIO_SEEKABLE_NORMAL &&
+        duration > 0 && st->start_time != AV_NOPTS_VALUE)
+        a.nb_segments = av_clip(av_q2d(st->time_base) * duration / ANALYTICS_SEGMENT, 1, 2 * nb_threads);
+    nb_threads = FFMIN(nb_threads, a.nb_segments);
+    if (a.nb_segments > 1)
+        avcodec_free_context(&a.first->dec_ctx); // Each segment has a decoder with one thread
+    if (!(a.segments = av_calloc(a.nb_segments, sizeof(*a.segments))) ||
+        !(threads = av_calloc(nb_threads, sizeof(*threads)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < a.nb_segments; i++) {
+        a.segments[i].start = i ? start + duration * i / a.nb_segments : INT64_MIN;
+        a.segments[i].end = i + 1 < a.nb_segments ? start + duration * (i + 1) / a.nb_segments : INT64_MAX;
+    }
+
+    if (analytics_format == ANALYTICS_JSON) {
+        analytics_size(st->codecpar->width, st->codecpar->height, &aw, &ah);
+        ob_printf(&header, "{\"item\":%d,\"file\":", item);
+        ob_put_json_string(&header, filename);
+        ob_printf(&header, ",\"width\":%d,\"height\":%d,\"analysis_width\":%d,\"analysis_height\":%d}\n",
+                  st->codecpar->width, st->codecpar->height, aw, ah);
+        if (header.error) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        fwrite(header.data, 1, header.len, analytics_file);
+    }
+
+    for (started = 0; started < nb_threads; started++) {
+        if ((ret = pthread_create(&threads[started], NULL, analytics_thread, &a))) {
+            av_log(NULL, AV_LOG_ERROR, "Cannot start an analytics thread\n");
+            ret = AVERROR(ret);
+            atomic_store(&a.failed, ret);
+            goto end;
+        }
+    }
+    for (i = 0; i < a.nb_segments; i++) {
+        AnalyticsSegment *seg = &a.segments[i];
+
+        pthread_mutex_lock(&a.lock);
+        while (!seg->done && !atomic_load(&a.failed))
+            pthread_cond_wait(&a.cond, &a.lock);
+        pthread_mutex_unlock(&a.lock);
+        if (!seg->done || seg->ret < 0)
+            break;
+        if (fwrite(seg->records.data, 1, seg->records.len, analytics_file) != seg->records.len) {
+            av_log(NULL, AV_LOG_ERROR, "Error writing the analytics: %s\n", strerror(errno));
+            ret = AVERROR(errno);
+            atomic_store(&a.failed, ret);
+            break;
+        }
+        frames += seg->frames;
+        av_freep(&seg->records.data);
+    }
+    ret = 0;
+
+end:
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (!ret)
+        ret = atomic_load(&a.failed);
+    if (ret >= 0 && frames) {
+        int64_t ns = FFMAX(now_ns() - t0, 1);
+        fprintf(stderr, "Analytics: %s, %"PRId64" frames in %.1f s (%.0f frames/s, %.1fx real time), "
+                "%d segments on %d threads\n", filename, frames, ns / 1e9, frames * 1e9 / ns,
+                av_q2d(st->time_base) * duration * 1e9 / ns, a.nb_segments, nb_threads);
+    }
+    for (i = 0; a.segments && i < a.nb_segments; i++)
+        av_freep(&a.segments[i].records.data);
+    av_freep(&a.segments);
+    av_freep(&threads);
+    av_freep(&header.data);
+    if (a.first)
+        close_input_file(a.first);
+    pthread_mutex_destroy(&a.lock);
+    pthread_cond_destroy(&a.cond);
+    return ret;
+}
+
+/*
+ * --bench: decode the first frames of the input once, then run every
+ * registered renderer over the same frames. Each renderer gets its own
+ * filtergraphs and filtering happens up front, only render() is timed.
+ */
+static int run_benchmark(InputFile *in, AVPacket *packet, int nb_frames)
+{
+    AVFrame **decoded = av_calloc(nb_frames, sizeof(*decoded));
+    AVFrame **filtered = av_calloc(nb_frames, sizeof(*filtered));
+    RenderContext *saved_ctx = render_ctx;
+    const Renderer *saved_renderer = in->renderer;
+    OutBuf ob = { 0 };
+    int nb_decoded = 0, nb_filtered = 0, i, r, ret = 0;
+
+    render_ctx = NULL;
+    if (!decoded || !filtered) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (nb_decoded < nb_frames) {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if (in->first_frame && in->first_frame->data[0]) {
+            av_frame_move_ref(frame, in->first_frame);
+        } else if ((ret = decode_next_frame(in, packet, frame)) < 0) {
+            av_frame_free(&frame);
+            if (ret != AVERROR_EOF)
+                goto end;
+            break;
+        }
+        decoded[nb_decoded++] = frame;
+    }
+    ret = 0;
+
+    printf("%-8s %12s %12s   (%d frames of %s)\n", "renderer", "ns/frame", "bytes/frame",
+           nb_decoded, in->filename);
+    for (r = 0; renderers[r]; r++) {
+        int64_t ns = 0, bytes = 0;
+
+        if (!(render_ctx = renderer_alloc(renderers[r]))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        // Graphs are looked up by the input's renderer, each one needs its own
+        in->renderer = renderers[r];
+        for (i = 0; i < nb_decoded; i++) {
+            if ((ret = get_filter_graph(in, decoded[i])) < 0)
+                goto end;
+            ret = filter_push(in->graph, decoded[i]);
+            if (ret < 0)
+                goto end;
+            while (nb_filtered < nb_decoded) {
+                if (!(filtered[nb_filtered] = av_frame_alloc())) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                ret = filter_pull(in->graph, filtered[nb_filtered]);
+                if (ret < 0) {
+                    av_frame_free(&filtered[nb_filtered]);
+                    if (ret != AVERROR(EAGAIN))
+                        goto end;
+                    break;
+                }
+                nb_filtered++;
+            }
+        }
+
+        for (i = 0; i < nb_filtered; i++) {
+            int64_t t0;
+            if ((ret = renderer_configure(render_ctx, filtered[i])) < 0)
+                goto end;
+            t0 = now_ns();
+            ret = render_ctx->renderer->render(render_ctx, filtered[i], &ob);
+            ns += now_ns() - t0;
+            if (ret < 0)
+                goto end;
+            bytes += ob.len;
+            ob.len = 0;
+        }
+        printf("%-8s %12"PRId64" %12"PRId64"\n", renderers[r]->name,
+               ns / FFMAX(nb_filtered, 1), bytes / FFMAX(nb_filtered, 1));
+
+        while (nb_filtered)
+            av_frame_free(&filtered[--nb_filtered]);
+        renderer_free(&render_ctx);
+    }
+
+end:
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Benchmark failed: %s\n", av_err2str(ret));
+    while (nb_filtered)
+        av_frame_free(&filtered[--nb_filtered]);
+    while (nb_decoded)
+        av_frame_free(&decoded[--nb_decoded]);
+    av_freep(&decoded);
+    av_freep(&filtered);
+    av_freep(&ob.data);
+    renderer_free(&render_ctx);
+    render_ctx = saved_ctx;
+    in->renderer = saved_renderer;
+    return ret;
+}
+
+static void print_stats(void)
+{
+    int frames = FFMAX(stats.frames_presented, 1), i;
+    uint64_t demuxed;
+
+    fprintf(stderr, "Frames: %d presented, %d dropped\n",
+            stats.frames_presented, stats.frames_dropped);
+    fprintf(stderr, "Output: %"PRId64" bytes, %"PRId64" bytes/frame\n",
+            stats.bytes_written, stats.bytes_written / frames);
+    if (stats.bytes_spliced)
+        fprintf(stderr, "Zero-copy: %.1f%% of the output spliced into the pipe, %d frames copied\n",
+                100.0 * stats.bytes_spliced / stats.bytes_written, stats.splice_copied);
+    fprintf(stderr, "Render: %"PRId64" ns/frame\n", stats.render_ns / frames);
+    if (stats.quant_ns)
+        fprintf(stderr, "Quantization: %.3f ms/frame avg, %.3f ms max, %d palette changes\n",
+                stats.quant_ns / 1e6 / frames, stats.quant_max_ns / 1e6, stats.palette_changes);
+    if (stats.frames_presented) {
+        fprintf(stderr, "Deadlines: %d missed by more than %d ms (%.1f%%), worst %.1f ms late\n",
+                stats.deadline_misses, DEADLINE_SLACK / 1000, 100.0 * stats.deadline_misses / frames,
+                stats.deadline_max / 1e3);
+        // Runs with and without --affinity/--realtime are told apart by this line
+        fprintf(stderr, "Scheduling: %s", sched_mode == SCHED_FIFO ? "SCHED_FIFO" : sched_mode < 0 ? "raised nice" : "default");
+        for (i = 0; i < NB_ROLES; i++)
+            if (role_cpu_list[i])
+                fprintf(stderr, ", %s on CPUs %s", role_names[i], role_cpu_list[i]);
+        fprintf(stderr, "\n");
+    }
+    if (stats.rows_total)
+        fprintf(stderr, "Rows: %.1f%% drawn, %d scrolls\n",
+                100.0 * stats.rows_drawn / stats.rows_total, stats.scrolls);
+    if (stats.cells_total)
+        fprintf(stderr, "Cells: %.1f%% changed per frame, %.3f ms/frame choosing shades\n",
+                100.0 * stats.cells_changed / stats.cells_total, stats.shade_ns / 1e6 / frames);
+    if (stats.cells_total && hysteresis)
+        fprintf(stderr, "Hysteresis: %.1f%% of cells held back per frame\n",
+                100.0 * stats.cells_held / stats.cells_total);
+    if (stats.ansi_bytes)
+        fprintf(stderr, "Protocol: %d keyframes, %"PRId64" bytes/frame, %"PRId64" as ANSI (%.1f%%)\n",
+                stats.keyframes, stats.bytes_written / frames, stats.ansi_bytes / frames,
+                100.0 * stats.bytes_written / FFMAX(stats.ansi_bytes, 1));
+    if (stats.datagrams_lost)
+        fprintf(stderr, "Protocol: %d datagrams could not be sent\n", stats.datagrams_lost);
+    if (stats.commands)
+        fprintf(stderr, "Commands: %d, %.3f ms avg, %.3f ms max to take effect\n",
+                stats.commands, stats.command_ns / 1e6 / stats.commands, stats.command_max_ns / 1e6);
+    if (stats.flow_answers)
+        fprintf(stderr, "Terminal: %.0f kB/s, round trip %.1f ms avg, %.1f ms max, %d frames late from waiting\n",
+                flow.bytes_per_sec / 1000, stats.flow_rtt / 1e3 / stats.flow_answers, stats.flow_rtt_max / 1e3,
+                stats.flow_drops);
+    if (stats.queue_gets)
+        fprintf(stderr, "Pre-roll: %.1f ms waiting to fill, %.1f frames queued avg, %d underruns (%.1f ms)\n",
+                stats.preroll_ns / 1e6, (double)stats.queue_fill / stats.queue_gets, stats.underruns,
+                stats.underrun_ns / 1e6);
+    if (stats.flow_width)
+        fprintf(stderr, "Terminal: width reduced to %d to keep up\n", stats.flow_width);
+    if (stats.pip_shown || stats.pip_dropped)
+        fprintf(stderr, "Picture-in-picture: %d frames shown, %d dropped, decoded at 1/%d size\n",
+                stats.pip_shown, stats.pip_dropped, 1 << stats.pip_lowres);
+    if ((demuxed = metric_sum(&main_metrics.bytes_demuxed)))
+        fprintf(stderr, "Input: %.1f MB read, %.1f MB (%.1f%%) of it decoded\n", demuxed / 1e6,
+                metric_sum(&main_metrics.bytes_used) / 1e6, 100.0 * metric_sum(&main_metrics.bytes_used) / demuxed);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] file [file...]\n"
+            "  -w, --width=COLS     output width in characters (default %d)\n"
+            "  -r, --renderer=NAME  output renderer (default ascii)\n"
+            "      --list-renderers list the available renderers\n"
+            "      --zlib           compress kitty graphics frames with zlib\n"
+            "  -c, --color=MODE     none, ansi16, adaptive16, ansi256 or truecolor (default none)\n"
+            "      --dither=MODE    ascii renderer: none, blue or temporal (default none)\n"
+            "      --hysteresis=N   ascii renderer: redraw a cell once its luma moved more than N (default 0)\n"
+            "      --stats          print playback statistics on exit\n"
+            "      --bench[=N]      time every renderer on the first N frames (default 100)\n"
+            "      --control=PATH   accept playback commands on a Unix socket\n"
+            "      --metrics=[HOST:]PORT  serve Prometheus metrics over HTTP\n"
+            "      --speed=FACTOR   playback rate (default 1)\n"
+            "      --start=SECS     start playing at this position\n"
+            "      --replay         the files are asciicast v2 recordings to replay\n"
+            "      --idle-limit=SECS  shorten pauses in a recording to at most SECS\n"
+            "      --snapshot-interval=SECS  seconds between replay seek points (default 10)\n"
+            "      --protocol-out=DEST  send frames in the binary protocol to a file, - or udp://HOST:PORT\n"
+            "      --keyint=N       frames between protocol keyframes (default 50)\n"
+            "      --flow-control[=N]  at most N frames unanswered by the terminal (default 2)\n"
+            "      --preroll=SECS   decode up to SECS ahead on a separate thread\n"
+            "      --preroll-max=MB memory limit of the frames decoded ahead (default 256)\n"
+            "      --affinity=ROLE:CPUS  pin main, decode or filter threads to CPUs like 0,2-3\n"
+            "      --realtime       run the output thread under SCHED_FIFO or a raised priority\n"
+            "      --verify         check every frame's output on a virtual terminal\n"
+            "      --video-stream=N play the N-th video stream, from 0 (default: the best one)\n"
+            "      --audio-stream=N, --subtitle-stream=N  also demux the N-th audio or subtitle stream (default none)\n"
+            "      --no-vmsplice    copy the output into a pipe on stdout with write()\n"
+            "      --export=FILE    render into a video file instead of the terminal, as fast as possible\n"
+            "      --pip=FILE       show FILE as an inset in the bottom right corner\n"
+            "      --pip-width=COLS width of the inset (default a quarter of the output)\n"
+            "      --analytics=FILE write per-frame luma statistics to FILE or - instead of playing\n"
+            "      --analytics-format=FMT  json (one object per line) or binary (default json)\n"
+            "      --analytics-threads=N  segments decoded at once (default one per CPU)\n",
+            prog, MAX_ASCII_WIDTH);
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 0;
     AVPacket *packet;
     AVFrame *frame;
     AVFrame *filt_frame;
+    InputFile *in = NULL, *done, *replacement;
+    char **items;
+    int nb_items, next_item, opt, i;
+    const Renderer *renderer = &ramp_renderer;
+    int bench_frames = 0, flow_frames = 0;
+    const char *control_path = NULL, *metrics_addr = NULL, *proto_dest = NULL, *export_path = NULL;
+    const char *pip_path = NULL, *analytics_path = NULL;
+    int64_t t0, filter_ns, start = 0;
+    int replay = 0, verify_frames = 0, verify_bad, export_ret, analytics_ret;
+
+    enum { OPT_STATS = 256, OPT_ZLIB, OPT_LIST_RENDERERS, OPT_BENCH, OPT_CONTROL, OPT_METRICS,
+           OPT_SPEED, OPT_START, OPT_REPLAY, OPT_IDLE_LIMIT, OPT_SNAPSHOT_INTERVAL,
+           OPT_PROTOCOL_OUT, OPT_KEYINT, OPT_DITHER,
+           OPT_HYSTERESIS, OPT_FLOW_CONTROL, OPT_PREROLL, OPT_PREROLL_MAX,
+           OPT_AFFINITY, OPT_REALTIME, OPT_VERIFY, OPT_VIDEO_STREAM, OPT_AUDIO_STREAM,
+           OPT_SUBTITLE_STREAM, OPT_NO_VMSPLICE,
+           OPT_EXPORT, OPT_PIP, OPT_PIP_WIDTH, OPT_ANALYTICS, OPT_ANALYTICS_FORMAT,
+           OPT_ANALYTICS_THREADS };
+    static const struct option long_options[] = {
+        { "width",          required_argument, NULL, 'w' },
+        { "renderer",       required_argument, NULL, 'r' },
+        { "list-renderers", no_argument,       NULL, OPT_LIST_RENDERERS },
+        { "color",          required_argument, NULL, 'c' },
+        { "dither",         required_argument, NULL, OPT_DITHER },
+        { "hysteresis",     required_argument, NULL, OPT_HYSTERESIS },
+        { "stats",          no_argument,       NULL, OPT_STATS },
+        { "zlib",           no_argument,       NULL, OPT_ZLIB },
+        { "bench",          optional_argument, NULL, OPT_BENCH },
+        { "control",        required_argument, NULL, OPT_CONTROL },
+        { "metrics",        required_argument, NULL, OPT_METRICS },
+        { "speed",          required_argument, NULL, OPT_SPEED },
+        { "start",          required_argument, NULL, OPT_START },
+        { "replay",         no_argument,       NULL, OPT_REPLAY },
+        { "idle-limit",     required_argument, NULL, OPT_IDLE_LIMIT },
+        { "snapshot-interval", required_argument, NULL, OPT_SNAPSHOT_INTERVAL },
+        { "protocol-out",   required_argument, NULL, OPT_PROTOCOL_OUT },
+        { "keyint",         required_argument, NULL, OPT_KEYINT },
+        { "flow-control",   optional_argument, NULL, OPT_FLOW_CONTROL },
+        { "preroll",        required_argument, NULL, OPT_PREROLL },
+        { "preroll-max",    required_argument, NULL, OPT_PREROLL_MAX },
+        { "affinity",       required_argument, NULL, OPT_AFFINITY },
+        { "realtime",       no_argument,       NULL, OPT_REALTIME },
+        { "verify",         no_argument,       NULL, OPT_VERIFY },
+        { "video-stream",   required_argument, NULL, OPT_VIDEO_STREAM },
+        { "audio-stream",   required_argument, NULL, OPT_AUDIO_STREAM },
+        { "subtitle-stream", required_argument, NULL, OPT_SUBTITLE_STREAM },
+        { "no-vmsplice",    no_argument,       NULL, OPT_NO_VMSPLICE },
+        { "export",         required_argument, NULL, OPT_EXPORT },
+        { "pip",            required_argument, NULL, OPT_PIP },
+        { "pip-width",      required_argument, NULL, OPT_PIP_WIDTH },
+        { "analytics",      required_argument, NULL, OPT_ANALYTICS },
+        { "analytics-format", required_argument, NULL, OPT_ANALYTICS_FORMAT },
+        { "analytics-threads", required_argument, NULL, OPT_ANALYTICS_THREADS },
+        { NULL, 0, NULL, 0 },
+    };
+
+    while ((opt = getopt_long(argc, argv, "w:r:c:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'w':
+            ascii_width = atoi(optarg);
+            if (ascii_width < 2) {
+                fprintf(stderr, "Invalid width: %s\n", optarg);
+                exit(1);
+            }
+            width_set = 1;
+            break;
+        case 'r':
+            if (!(renderer = find_renderer(optarg))) {
+                fprintf(stderr, "Unknown renderer: %s (see --list-renderers)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_LIST_RENDERERS:
+            for (i = 0; renderers[i]; i++)
+                printf("%-8s %s\n", renderers[i]->name, renderers[i]->description);
+            exit(0);
+        case OPT_BENCH:
+            bench_frames = optarg ? atoi(optarg) : 100;
+            if (bench_frames < 1) {
+                fprintf(stderr, "Invalid frame count: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            if (!strcmp(optarg, "none")) {
+                color_mode = COLOR_NONE;
+            } else if (!strcmp(optarg, "ansi16")) {
+                color_mode = COLOR_ANSI16;
+            } else if (!strcmp(optarg, "adaptive16")) {
+                color_mode = COLOR_ADAPTIVE16;
+            } else if (!strcmp(optarg, "ansi256")) {
+                color_mode = COLOR_ANSI256;
+            } else if (!strcmp(optarg, "truecolor")) {
+                color_mode = COLOR_TRUECOLOR;
+            } else {
+                fprintf(stderr, "Unknown color mode: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_DITHER:
+            if (!strcmp(optarg, "none")) {
+                dither = DITHER_NONE;
+            } else if (!strcmp(optarg, "blue")) {
+                dither = DITHER_BLUE;
+            } else if (!strcmp(optarg, "temporal")) {
+                dither = DITHER_TEMPORAL;
+            } else {
+                fprintf(stderr, "Unknown dither mode: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_HYSTERESIS:
+            hysteresis = atoi(optarg);
+            if (hysteresis < 0 || hysteresis > 255) {
+                fprintf(stderr, "Invalid hysteresis: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_STATS:
+            show_stats = 1;
+            break;
+        case OPT_ZLIB:
+            kitty_zlib = 1;
+            break;
+        case OPT_CONTROL:
+            control_path = optarg;
+            break;
+        case OPT_METRICS:
+            metrics_addr = optarg;
+            break;
+        case OPT_SPEED:
+            control.speed = atof(optarg);
+            if (!(control.speed >= 1.0 / 16 && control.speed <= 16)) {
+                fprintf(stderr, "Invalid speed: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_START:
+            start = (int64_t)(atof(optarg) * AV_TIME_BASE);
+            if (start < 0) {
+                fprintf(stderr, "Invalid start position: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_REPLAY:
+            replay = 1;
+            break;
+        case OPT_PROTOCOL_OUT:
+            proto_dest = optarg;
+            break;
+        case OPT_KEYINT:
+            proto_keyint = atoi(optarg);
+            if (proto_keyint < 1) {
+                fprintf(stderr, "Invalid keyframe interval: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_AFFINITY:
+            if (parse_affinity(optarg) < 0) {
+                fprintf(stderr, "Invalid affinity: %s (ROLE:CPUS, roles main, decode and filter)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_REALTIME:
+            realtime = 1;
+            break;
+        case OPT_VERIFY:
+            verify_frames = 1;
+            break;
+        case OPT_NO_VMSPLICE:
+            no_vmsplice = 1;
+            break;
+        case OPT_EXPORT:
+            export_path = optarg;
+            break;
+        case OPT_PIP:
+            pip_path = optarg;
+            break;
+        case OPT_PIP_WIDTH:
+            pip_width = atoi(optarg);
+            if (pip_width < 2 || pip_width > 4096) {
+                fprintf(stderr, "Invalid inset width: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ANALYTICS:
+            analytics_path = optarg;
+            break;
+        case OPT_ANALYTICS_FORMAT:
+            if (!strcmp(optarg, "json")) {
+                analytics_format = ANALYTICS_JSON;
+            } else if (!strcmp(optarg, "binary")) {
+                analytics_format = ANALYTICS_BINARY;
+            } else {
+                fprintf(stderr, "Unknown analytics format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ANALYTICS_THREADS:
+            analytics_threads = atoi(optarg);
+            if (analytics_threads < 1 || analytics_threads > 256) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_VIDEO_STREAM:
+        case OPT_AUDIO_STREAM:
+        case OPT_SUBTITLE_STREAM: {
+            int *n = opt == OPT_VIDEO_STREAM ? &video_stream : opt == OPT_AUDIO_STREAM ? &audio_stream : &subtitle_stream;
+            char *end;
+
+            if (opt != OPT_VIDEO_STREAM && !strcmp(optarg, "none")) {
+                *n = -1;
+                break;
+            }
+            *n = strtol(optarg, &end, 10);
+            if (end == optarg || *end || *n < 0) {
+                fprintf(stderr, "Invalid stream number: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_PREROLL:
+            preroll = atof(optarg);
+            if (!(preroll >= 0 && preroll <= 60)) {
+                fprintf(stderr, "Invalid pre-roll: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_PREROLL_MAX:
+            preroll_max = (int64_t)atoi(optarg) << 20;
+            if (preroll_max <= 0) {
+                fprintf(stderr, "Invalid pre-roll size: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_FLOW_CONTROL:
+            flow_frames = optarg ? atoi(optarg) : 2;
+            if (flow_frames < 1 || flow_frames > FLOW_MAX_IN_FLIGHT) {
+                fprintf(stderr, "Invalid frame count: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_IDLE_LIMIT:
+            replay_idle_limit = atof(optarg);
+            break;
+        case OPT_SNAPSHOT_INTERVAL:
+            replay_snapshot_interval = atof(optarg);
+            if (!(replay_snapshot_interval > 0)) {
+                fprintf(stderr, "Invalid snapshot interval: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    items = argv + optind;
+    nb_items = argc - optind;
+    if (nb_items < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s file\n", argv[0]);
+    if (proto_dest && renderer->graphics) {
+        fprintf(stderr, "The %s renderer can't be sent with --protocol-out\n", renderer->name);
+        exit(1);
+    }
+    if (proto_dest && flow_frames) {
+        fprintf(stderr, "--flow-control needs terminal output, not --protocol-out\n");
+        exit(1);
+    }
+    if (proto_dest && replay) {
+        fprintf(stderr, "--replay writes terminal output, it can't be sent with --protocol-out\n");
+        exit(1);
+    }
+    if (export_path && (renderer->graphics || proto_dest || flow_frames || replay || bench_frames)) {
+        fprintf(stderr, "--export works with the text renderers only, without --protocol-out, "
+                "--flow-control, --replay or --bench\n");
+        exit(1);
+    }
+    if (analytics_path && (export_path || proto_dest || flow_frames || replay || bench_frames || pip_path ||
+                           control_path || metrics_addr || verify_frames)) {
+        fprintf(stderr, "--analytics doesn't go with --export, --protocol-out, --flow-control, --replay, "
+                "--bench, --pip, --control, --metrics or --verify\n");
+        exit(1);
+    }
+    if (pip_path && renderer->graphics) {
+        fprintf(stderr, "--pip needs a text renderer, not %s\n", renderer->name);
+        exit(1);
+    }
+    if (pip_path && color_mode == COLOR_ADAPTIVE16) {
+        // Both pictures would want the 16 palette slots for themselves
+        fprintf(stderr, "--pip doesn't go with --color=adaptive16\n");
+        exit(1);
+    }
+    if (!(render_ctx = renderer_alloc(renderer))) {
+        fprintf(stderr, "Could not allocate renderer\n");
         exit(1);
     }
 
@@ -268,95 +6918,229 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    if ((ret = open_input_file(argv[1])) < 0)
+    sched_init();
+
+    if (control_path && (ret = control_open(control_path)) < 0)
+        goto end;
+    if (metrics_addr && (ret = metrics_open(metrics_addr)) < 0)
+        goto end;
+    if (proto_dest && (ret = proto_open(proto_dest)) < 0)
+        goto end;
+    if (export_path && (ret = export_open(export_path)) < 0)
+        goto end;
+    if (verify_frames && (ret = verify_open()) < 0)
+        goto end;
+    if (analytics_path) {
+        if ((ret = analytics_open(analytics_path)) < 0)
+            goto end;
+        for (i = 0; i < nb_items && ret >= 0; i++)
+            ret = run_analytics(items[i], i);
+        goto end;
+    }
+    splice_open();
+
+    if (replay) {
+        for (i = 0; i < nb_items && ret >= 0; i++)
+            ret = replay_cast(items[i], i ? 0 : start);
+        goto end;
+    }
+
+    // The first item is prefetched too, we just have to wait for it
+    next_item = 0;
+    while (!in && next_item < nb_items) {
+        if ((ret = prefetch_start(&prefetch, items[next_item++])) < 0)
+            goto end;
+        in = prefetch_finish(&prefetch);
+    }
+    if (!in) {
+        ret = AVERROR(EINVAL);
         goto end;
+    }
 
-    // Call init_filters with the detected input dimensions
-    if ((ret = init_filters(dec_ctx->width, dec_ctx->height)) < 0)
+    if (bench_frames) {
+        ret = run_benchmark(in, packet, bench_frames);
         goto end;
+    }
 
-    // Process and display only the first video frame
-    int frame_displayed = 0;
-    while (!frame_displayed) {
-        if ((ret = av_read_frame(fmt_ctx, packet)) < 0) {
-            if (ret != AVERROR_EOF) {
-                av_log(NULL, AV_LOG_ERROR, "Error reading frame from input: %s\n", av_err2str(ret));
+    if (flow_frames && (ret = flow_open(flow_frames)) < 0)
+        goto end;
+    if (pip_path && (ret = pip_start(pip_path, renderer)) < 0)
+        goto end;
+
+    // Start in the middle: the first item begins with a seek
+    if (start) {
+        control.seek = 1;
+        control.seek_to = start;
+    }
+
+    while (in) {
+        AVRational frame_rate;
+
+        frame_rate = av_guess_frame_rate(in->fmt_ctx, in->fmt_ctx->streams[in->video_stream_index], NULL);
+        replacement = NULL;
+
+        while (1) {
+            if (exporter && exporter->failed) {
+                ret = exporter->failed;
+                goto end;
             }
-            break; // Exit loop if no more packets or read error
-        }
+            // Open the next item while this one plays
+            if (!prefetch.running && !control.load && !queued && next_item < nb_items &&
+                (ret = prefetch_start(&prefetch, items[next_item++])) < 0)
+                goto end;
 
-        if (packet->stream_index == video_stream_index) {
-            ret = avcodec_send_packet(dec_ctx, packet);
-            if (ret < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Error while sending a packet to the decoder: %s\n", av_err2str(ret));
-                // If it's not a temporary error (EAGAIN/EOF), break to avoid infinite loop
-                if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-                    break;
-                }
+            // Commands from the control socket, applied between frames
+            control_start_load();
+            if (prefetch.replace && prefetch_done(&prefetch) &&
+                (replacement = prefetch_finish(&prefetch)))
+                break;
+            if (control.seek)
+                seek_input(in);
+            control_switch_renderer();
+            // Settings of resize and renderer commands reach the graph here
+            in->renderer = render_ctx->renderer;
+            in->ascii_width = ascii_width;
+
+            // Decode ahead, after a start or seek only once there is a lead
+            if (preroll && !decoder.running) {
+                if ((ret = decoder_start(in, frame_rate)) < 0)
+                    goto end;
+                if (clock_anchor == AV_NOPTS_VALUE)
+                    decoder_prime();
             }
 
-            while (ret >= 0) {
-                ret = avcodec_receive_frame(dec_ctx, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    // Need more packets or no more frames from decoder
-                    break;
-                } else if (ret < 0) {
-                    av_log(NULL, AV_LOG_ERROR, "Error while receiving a frame from the decoder: %s\n", av_err2str(ret));
-                    goto end; // Critical error, exit program
-                }
+            if (in->first_frame && in->first_frame->data[0]) {
+                av_frame_move_ref(frame, in->first_frame);
+                ret = 0;
+            } else if ((ret = preroll ? decoder_get(frame) : decode_next_frame(in, packet, frame)) < 0) {
+                if (ret != AVERROR_EOF)
+                    goto end;
+                // Flush the filtergraph along with the decoder
+                ret = filter_push(in->graph, NULL);
+            }
 
-                frame->pts = frame->best_effort_timestamp;
+            if (ret >= 0 && frame->data[0] && in->seek_pts != AV_NOPTS_VALUE) {
+                if (frame->pts != AV_NOPTS_VALUE && frame->pts < in->seek_pts) {
+                    av_frame_unref(frame);
+                    continue;
+                }
+                in->seek_pts = AV_NOPTS_VALUE;
+            }
 
+            filter_ns = 0;
+            if (ret >= 0 && frame->data[0]) {
+                t0 = now_ns();
+                // Pick the graph matching this frame, rebuilding on a format change
+                if ((ret = get_filter_graph(in, frame)) < 0)
+                    goto end;
                 // Push the decoded frame into the filtergraph
-                if (av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
+                ret = filter_push(in->graph, frame);
+                av_frame_unref(frame);
+                if (ret < 0) {
                     av_log(NULL, AV_LOG_ERROR, "Error while feeding the filtergraph: %s\n", av_err2str(ret));
-                    break;
+                    goto end;
                 }
+                filter_ns = now_ns() - t0;
+            }
 
-                // Pull filtered frames from the filtergraph
-                while (1) {
-                    ret = av_buffersink_get_frame(buffersink_ctx, filt_frame);
-                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        // Need more frames from filtergraph or no more
-                        break;
-                    }
-                    if (ret < 0) {
-                        av_log(NULL, AV_LOG_ERROR, "Error while pulling from filtergraph: %s\n", av_err2str(ret));
-                        goto end; // Critical error, exit program
-                    }
-                    display_frame(filt_frame, buffersink_ctx->inputs[0]->time_base);
-                    av_frame_unref(filt_frame);
-                    //frame_displayed = 1; // Mark that a frame has been displayed
-                    break; // Exit inner loop after displaying one filtered frame
+            // Pull filtered frames from the filtergraph
+            while (1) {
+                t0 = now_ns();
+                ret = filter_pull(in->graph, filt_frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    // Need more frames from filtergraph or no more
+                    break;
                 }
-                av_frame_unref(frame);
-                if (frame_displayed) {
-                    break; // Exit outer loop if a frame was displayed
+                if (ret < 0) {
+                    av_log(NULL, AV_LOG_ERROR, "Error while pulling from filtergraph: %s\n", av_err2str(ret));
+                    goto end; // Critical error, exit program
                 }
+                // The push is charged to the first frame it produced
+                metric_time(STAGE_FILTER, filter_ns + now_ns() - t0);
+                filter_ns = 0;
+                present_frame(filt_frame, in->graph->time_base, frame_rate);
+                av_frame_unref(filt_frame);
             }
+            if (ret == AVERROR_EOF)
+                break;
         }
-        av_packet_unref(packet);
-        if (frame_displayed) {
-            break; // Exit main loop if a frame was displayed
+
+        // Item finished or replaced by a load: the next one continues right
+        // where this one ended. The prefetch is joined before the old
+        // decoder is parked, it may still be looking at spare_dec_ctx.
+        decoder_stop();
+        done = in;
+        in = replacement;
+        while (!in && (prefetch.running || queued || next_item < nb_items)) {
+            if (prefetch.running) {
+                in = prefetch_finish(&prefetch);
+            } else if (queued) {
+                in = queued;
+                queued = NULL;
+            } else if ((ret = prefetch_start(&prefetch, items[next_item++])) < 0) {
+                close_input_file(done);
+                goto end;
+            }
         }
+        retire_input_file(done);
+        if (in) {
+            item_offset = timeline_end;
+            item_start_pts = AV_NOPTS_VALUE;
+            // A loaded file starts right away, a playlist item on time
+            if (replacement)
+                clock_anchor = AV_NOPTS_VALUE;
+            av_log(NULL, AV_LOG_INFO, "Playing %s%s\n", in->filename,
+                   in->reused_decoder ? " (reusing decoder)" : "");
+        }
+        ret = 0;
     }
 
 end:
     // Free all allocated FFmpeg structures
-    avfilter_graph_free(&filter_graph);
-    avcodec_free_context(&dec_ctx);
-    avformat_close_input(&fmt_ctx);
+    decoder_stop();
+    if (prefetch.running) {
+        pthread_join(prefetch.thread, NULL);
+        close_input_file(prefetch.in);
+    }
+    if (queued)
+        close_input_file(queued);
+    if (in)
+        close_input_file(in);
+    pip_stop();
+    control_close();
+    metrics_close();
+    proto_close();
+    export_ret = export_close();
+    analytics_ret = analytics_close();
+    flow_close();
+    avcodec_free_context(&spare_dec_ctx);
     av_frame_free(&frame);
     av_frame_free(&filt_frame);
     av_packet_free(&packet);
+    renderer_free(&render_ctx);
+    splice_close();
+    av_freep(&out.data);
+
+    // Give the terminal its own palette back
+    if (color_mode == COLOR_ADAPTIVE16 && !analytics_path)
+        printf("\033]104\033\\");
+    if (show_stats)
+        print_stats();
+    verify_bad = verify_close();
 
     // Report final status
-    if (ret < 0 && ret != AVERROR_EOF && !frame_displayed) {
+    if (ret >= 0 && export_ret < 0)
+        ret = export_ret;
+    if (ret >= 0 && analytics_ret < 0)
+        ret = analytics_ret;
+    if (ret < 0 && ret != AVERROR_EOF) {
         fprintf(stderr, "Program finished with an error: %s\n", av_err2str(ret));
         exit(1);
-    } else if (!frame_displayed && ret == AVERROR_EOF) {
+    } else if (!stats.frames_presented && !bench_frames && !analytics_path) {
         fprintf(stderr, "End of file reached, but no video frame could be displayed.\n");
         exit(1);
+    } else if (verify_bad) {
+        exit(1);
     }
 
     exit(0);